@@ -0,0 +1,68 @@
+#ifndef REGO_AGGREGATE_H
+#define REGO_AGGREGATE_H
+
+#include <stdint.h>
+
+#include <regoComm.h>
+
+/*****************************************************************************
+ * Defines
+ *****************************************************************************/
+
+#define REGO_AGG_MAX_WINDOWS			3
+#define REGO_AGG_DEFAULT_WINDOWS	"60,600,3600"
+
+// Series derived from two registers, after the known registers
+#define REGO_AGG_DERIVED					2
+
+/*****************************************************************************
+ * Types
+ *****************************************************************************/
+
+/*
+ * Running aggregate of one series over the current window. Numeric series
+ * keep min, max, sum and last, bool series the time spent on and the number of
+ * starts
+ */
+typedef struct {
+	int32_t sum;
+	uint32_t count;											// Samples in the window, 0 = nothing to emit
+	int16_t min;
+	int16_t max;
+	int16_t last;
+	uint32_t start;											// Start of the observed part of the window
+	uint32_t onSince;										// Time a bool series turned or was last seen on, 0 = off
+	uint32_t onTime;										// Seconds on in the window
+	uint16_t starts;										// Off to on transitions in the window
+	uint8_t known;											// State of a bool series has been seen
+} regoAggWindow;
+
+/*
+ * Windowed aggregation of the samples of one connection. Memory is fixed once
+ * allocated by initAggregator(), one running aggregate per series and window,
+ * and the aggregates are output when a window, aligned to the wall clock, ends
+ */
+typedef struct regoAggregator {
+	uint8_t windowCount;
+	uint32_t windowLen[REGO_AGG_MAX_WINDOWS];		// Window lengths (s)
+	uint32_t windowIndex[REGO_AGG_MAX_WINDOWS];	// Current window, time / length
+	int16_t registerCount;											// Known registers, followed by the derived series
+	regoAggWindow* series[REGO_AGG_MAX_WINDOWS];
+
+	// Latest value of each register, for the derived series
+	int16_t* lastValue;
+	uint8_t* lastValid;
+} regoAggregator;
+
+struct regoOutput;
+
+/*****************************************************************************
+ * Function declarations
+ *****************************************************************************/
+
+int initAggregator(regoAggregator* agg, const char* windows);
+void freeAggregator(regoAggregator* agg);
+void addAggregateSample(regoAggregator* agg, struct regoOutput* out, const char* tag, uint32_t time, int16_t id, int8_t status, int16_t value);
+void emitAggregates(regoAggregator* agg, struct regoOutput* out, const char* tag, uint32_t time);
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef REGO_ASYNC_H
+#define REGO_ASYNC_H
+
+#include <stdint.h>
+
+#include <regoSerialIO.h>
+
+/*****************************************************************************
+ * Defines
+ *****************************************************************************/
+
+// Requests submitted and completions not yet taken, together
+#define REGO_ASYNC_QUEUE_SIZE			16
+
+/*****************************************************************************
+ * Types
+ *****************************************************************************/
+
+/*
+ * Outcome of a request, after its retries
+ */
+typedef struct {
+	int32_t id;													// As returned when the request was submitted
+	uint8_t command;										// COMMAND_READ_SYS_REG or COMMAND_READ_DISPLAY
+	uint16_t reg;												// Register, or display row
+	int8_t status;											// RESPONSE_*
+	int16_t value;											// Register value, 0 on failure
+	uint8_t len;												// Bytes of text, including the null terminator
+	char text[REGO_DISPLAY_ROW_SIZE];		// Display row, decoded with a trailing newline
+} regoCompletion;
+
+typedef void (*regoCompletionCallback)(const regoCompletion* completion, void* context);
+
+typedef struct {
+	int32_t id;
+	uint8_t command;
+	uint16_t reg;
+	uint8_t attempt;										// Retries done
+	regoCompletionCallback callback;		// NULL to queue the completion
+	void* context;
+} regoAsyncRequest;
+
+/*
+ * Non-blocking request queue of a connection. The request at the head of the
+ * queue is in flight, or waiting out its retry backoff. The caller waits for
+ * the port fd to become readable, or for getAsyncTimeout() to run out, and
+ * then calls processAsync(). Only one queue may use a connection at a time
+ */
+typedef struct regoAsync {
+	rego_conn* conn;
+	regoAsyncRequest queue[REGO_ASYNC_QUEUE_SIZE];
+	uint8_t queueHead;
+	uint8_t queueCount;
+	uint8_t busy;												// Head request sent, response pending
+	uint8_t scheduled;									// sendAt is set for the head request
+	int64_t sendAt;											// Monotonic time (ms) to send the head request at
+	int32_t nextId;
+
+	// Completions of requests without a callback, taken with takeCompletion()
+	regoCompletion done[REGO_ASYNC_QUEUE_SIZE];
+	uint8_t doneHead;
+	uint8_t doneCount;
+} regoAsync;
+
+/*****************************************************************************
+ * Function declarations
+ *****************************************************************************/
+
+void initAsync(regoAsync* async, rego_conn* conn);
+int32_t submitRegisterRead(regoAsync* async, uint16_t reg, regoCompletionCallback callback, void* context);
+int32_t submitDisplayRowRead(regoAsync* async, uint8_t row, regoCompletionCallback callback, void* context);
+int getAsyncFd(regoAsync* async);
+int32_t getAsyncTimeout(regoAsync* async);
+int processAsync(regoAsync* async);
+int waitAsync(regoAsync* async);
+uint8_t takeCompletion(regoAsync* async, regoCompletion* completion);
+
+#endif
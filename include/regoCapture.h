@@ -0,0 +1,65 @@
+#ifndef REGO_CAPTURE_H
+#define REGO_CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <regoAsync.h>
+#include <regoSerialIO.h>
+
+/*****************************************************************************
+ * Defines
+ *****************************************************************************/
+
+#define REGO_CAPTURE_MAGIC				"REGOCAP"
+#define REGO_CAPTURE_VERSION			1
+
+// Record types
+#define REGO_CAPTURE_SENT					1			// Request frame written to the port
+#define REGO_CAPTURE_RECEIVED			2			// Response as received, possibly partial or corrupt
+
+/*****************************************************************************
+ * Types
+ *****************************************************************************/
+
+/*
+ * File header. It is followed by the records, each a regoCaptureRecord and
+ * then len bytes of the frame, in host byte order
+ */
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+} regoCaptureHeader;
+
+typedef struct {
+	uint32_t delta;											// Monotonic time since the previous record (us)
+	uint8_t type;												// REGO_CAPTURE_*
+	uint8_t len;
+	uint16_t reserved;
+} regoCaptureRecord;
+
+/*
+ * Capture file being written. Records are buffered by stdio
+ */
+typedef struct regoCapture {
+	FILE* file;
+	struct timespec last;								// Monotonic time of the last record
+	uint32_t records;
+} regoCapture;
+
+// Called with each response replayed and the time it was received, in us
+// from the start of the capture
+typedef void (*regoReplayCallback)(uint64_t time, const regoCompletion* response, void* context);
+
+/*****************************************************************************
+ * Function declarations
+ *****************************************************************************/
+
+int openCapture(regoCapture* capture, const char* path);
+void closeCapture(regoCapture* capture);
+void captureFrame(regoCapture* capture, uint8_t type, const char* frame, uint8_t len);
+int replayCapture(rego_conn* conn, const char* path, uint8_t timed, regoReplayCallback callback, void* context);
+
+#endif
@@ -1,5 +1,10 @@
+#ifndef REGO_COMM_H
+#define REGO_COMM_H
+
 #include <stdint.h>
 
+#include <regoSerialIO.h>
+
 /*****************************************************************************
  * Defines
  *****************************************************************************/
@@ -10,6 +15,19 @@
 #define COMMAND_READ_SYS_REG    0x02
 #define COMMAND_READ_DISPLAY		0x20
 
+// Longest interval between display polls in watchDisplay() (ms)
+#define REGO_DISPLAY_INTERVAL_MAX	3600000
+
+// Register value types, and flags stored with them in the register table
+#define REG_TYPE_UNKNOWN					0x0		// Value yet to be determined
+#define REG_TYPE_BOOL							0x1		// On = 1, Off = 0
+#define REG_TYPE_INT							0x2		// Integer value
+#define REG_TYPE_TEMP							0x3		// Temperature value in 0.1 degrees C
+#define REG_TYPE_FRAC							0x4		// Numeric value in 0.1 fractions
+
+#define REG_TYPE_MASK							0xf		// Mask for possible register types
+#define REG_TYPE_GRAPHITE					0x10	// Flag for inclusion in Graphite output
+
 // Serial response statuses
 #define RESPONSE_OK								1
 #define RESPONSE_TIMEOUT					0
@@ -17,25 +35,91 @@
 #define RESPONSE_INVALID_LENGTH		-2
 #define RESPONSE_INVALID_ADDRESS	-3
 
+// Poll priority classes, most urgent first. Client requests in daemon mode,
+// e.g. show_display, go ahead of all of them
+#define REG_PRIO_STATUS						0			// Status flags
+#define REG_PRIO_SENSOR						1			// Sensor readings
+#define REG_PRIO_SETTING					2			// Settings and control values
+#define REG_PRIO_COUNT						3
+
+// Register cache. Settings change rarely, sensors and status flags often
+#define REGO_CACHE_DEFAULT_AGE		-1		// Use the register's default TTL
+#define REGO_CACHE_TTL_SETTING		300000	// Default TTL of settings (ms)
+#define REGO_CACHE_TTL_SENSOR			2000	// Default TTL of sensors, status and unknown registers (ms)
+#define REGO_CACHE_PROBES					8			// Slots searched for an address
+
+// Delta mode. Values are only output when they move past the deadband of
+// their type (in tenths for temperatures), and all of them once per keyframe
+#define REGO_DELTA_DEADBAND_TEMP	2			// +-0.2 degrees C
+#define REGO_DELTA_DEADBAND_FRAC	0
+#define REGO_DELTA_DEADBAND_INT		0
+#define REGO_DELTA_KEYFRAME				900		// Default keyframe interval (s)
+
+// Upper bound of the known register table, register IDs are int16_t
+#define REGO_MAX_KNOWN_REGISTERS	INT16_MAX
+
+// Retry and link quality settings
+#define REGO_DEFAULT_RETRIES			2			// Retries after a failed transaction
+#define REGO_RETRY_BACKOFF				20		// Delay before first retry (ms), doubled per retry
+#define REGO_RETRY_BACKOFF_MAX		500		// Upper bound of the retry delay (ms)
+#define REGO_LINK_QUALITY_WINDOW	16		// Transactions in the error rate moving average
+#define REGO_PACING_THRESHOLD			50		// Error rate (1/1000) above which requests are paced
+#define REGO_PACING_MAX						200		// Gap between requests (ms) at 100% error rate
+
 /*****************************************************************************
- * Variable declarations
+ * Types
  *****************************************************************************/
 
-extern int graphiteOutputFlag;
-extern int ignoreChecksumsFlag;
-extern int showPacketsFlag;
+/*
+ * Register map entry. The ID of a register is its index in the map
+ */
+typedef struct {
+	uint16_t address;				// Register address
+	const char* name;				// Short name (for command line use, no spaces)
+	const char* description;	// Description
+	int type;								// See #define REG_TYPE_*. Used to guide interpretation
+	uint16_t interval;			// Poll interval in seconds when scheduled, 0 = not scheduled
+	uint8_t priority;				// See #define REG_PRIO_*. Used to order scheduled polls
+} registerLookupTable;
 
 /*****************************************************************************
  * Function declarations
  *****************************************************************************/
 
-int8_t getRegisterIdByName(char* name);
-int8_t getRegisterIdByAddress(uint16_t reg);
-uint16_t getRegisterAddressById(int8_t id);
-char* getRegisterDescriptionById(int8_t id);
-char* getRegisterNameById(int8_t id);
+void sortRegisterIndex(const registerLookupTable* table, int16_t count, int16_t* byAddress, int16_t* byName);
+void buildRegisterIndex();
+void setRegisterMap(const registerLookupTable* table, int16_t count, const int16_t* byAddress, const int16_t* byName);
+int16_t getKnownRegisterCount();
+int16_t getRegisterIdByName(const char* name);
+int16_t getRegisterIdByAddress(uint16_t reg);
+uint16_t getRegisterAddressById(int16_t id);
+const char* getRegisterDescriptionById(int16_t id);
+const char* getRegisterNameById(int16_t id);
+uint8_t getRegisterTypeById(int16_t id);
+uint8_t isGraphiteRegisterById(int16_t id);
+uint16_t getRegisterIntervalById(int16_t id);
+uint8_t getRegisterPriorityById(int16_t id);
+int8_t lookupRegister(char* text, uint16_t* reg);
+char* getResponseText(int8_t status);
+
+uint32_t getRequestDelay(rego_conn* conn, uint8_t attempt);
+void updateLinkQuality(rego_conn* conn, int8_t retval);
+uint16_t getLinkErrorRate(rego_conn* conn);
+
+int8_t queryRegister(rego_conn* conn, uint16_t reg, int16_t* value);
+int32_t defaultCacheTTL(uint16_t reg);
+int8_t queryRegisterCached(rego_conn* conn, uint16_t reg, int16_t* value, int32_t maxAge);
+void updateRegisterCache(rego_conn* conn, uint16_t reg, int8_t status, int16_t value);
+int8_t getCachedRegister(rego_conn* conn, uint16_t reg, int16_t* value, int32_t* age);
+uint8_t getFreshRegister(rego_conn* conn, uint16_t reg, int16_t* value, int32_t maxAge);
+int8_t queryDisplayRow(rego_conn* conn, uint8_t row, char* text, uint8_t* len);
+int8_t queryDisplay(rego_conn* conn, char* text);
+void watchDisplay(rego_conn* conn, uint8_t rows, uint32_t interval);
+int8_t printRegister(rego_conn* conn, uint16_t reg);
+uint8_t isDeltaChange(rego_conn* conn, int16_t id, int8_t retval, int16_t value);
+void closeDelta(rego_conn* conn);
+void printRegisterValue(rego_conn* conn, uint16_t reg, int8_t retval, int16_t value);
+int16_t nextKnownRegister(rego_conn* conn, int16_t id);
+void printKnownRegisters(rego_conn* conn);
 
-int8_t queryRegister(uint16_t reg, int16_t* value);
-int8_t queryDisplay(char* text);
-int8_t printRegister(uint16_t reg);
-void printKnownRegisters();
+#endif
@@ -0,0 +1,28 @@
+#ifndef REGO_DAEMON_H
+#define REGO_DAEMON_H
+
+#include <stdio.h>
+
+#include <regoSched.h>
+#include <regoSerialIO.h>
+
+/*****************************************************************************
+ * Defines
+ *****************************************************************************/
+
+// Default path of the daemon's Unix domain socket
+#define REGO_SOCKET_PATH					"/var/run/regoClient.sock"
+
+// Limits
+#define REGO_DAEMON_MAX_CLIENTS		32		// Concurrently connected clients
+#define REGO_DAEMON_LINE_SIZE			128		// Longest request line
+#define REGO_DAEMON_QUEUE_SIZE		REGO_DAEMON_MAX_CLIENTS
+
+/*****************************************************************************
+ * Function declarations
+ *****************************************************************************/
+
+int runDaemon(rego_conn* conn, const char* socketPath, regoSchedule* sched);
+int runBatch(rego_conn* conn, int fd, FILE* out);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef REGO_GRAPHITE_H
+#define REGO_GRAPHITE_H
+
+#include <stdint.h>
+
+/*****************************************************************************
+ * Defines
+ *****************************************************************************/
+
+#define REGO_GRAPHITE_HOST_SIZE				64
+#define REGO_GRAPHITE_PATH_SIZE				128
+
+#define REGO_GRAPHITE_DEFAULT_PORT		"2003"
+#define REGO_GRAPHITE_CONNECT_TIMEOUT	2000		// Time to wait for the connection (ms)
+#define REGO_GRAPHITE_SEND_TIMEOUT		5000		// Time to wait for a write to go through (ms)
+#define REGO_GRAPHITE_RETRY						10000		// Time between connection attempts (ms)
+#define REGO_GRAPHITE_SPOOL_MAX				(1024 * 1024)	// Default bound of the spool (bytes)
+
+/*****************************************************************************
+ * Types
+ *****************************************************************************/
+
+/*
+ * Graphite plaintext sender. Sweeps rendered by regoOutput.c are written to a
+ * carbon server in one go, over a connection kept open across sweeps. While
+ * the server is unreachable, sweeps are appended to a spool file, which is
+ * replayed on reconnect
+ */
+typedef struct graphiteSender {
+	char host[REGO_GRAPHITE_HOST_SIZE];			// Carbon server
+	char port[8];
+	int fd;																	// Connection, -1 if not connected
+	int64_t retryAt;												// Monotonic time (ms) of the next connection attempt
+	int32_t retryInterval;									// Time between connection attempts (ms)
+
+	char spoolPath[REGO_GRAPHITE_PATH_SIZE];	// Spool file, empty to drop data during outages
+	uint32_t spoolMax;											// Upper bound of the spool size (bytes)
+} graphiteSender;
+
+/*****************************************************************************
+ * Function declarations
+ *****************************************************************************/
+
+int initGraphiteSender(graphiteSender* sender, const char* target, const char* spoolPath);
+void closeGraphiteSender(graphiteSender* sender);
+int sendGraphiteSweep(graphiteSender* sender, const char* data, uint32_t len);
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef REGO_LOG_H
+#define REGO_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*****************************************************************************
+ * Defines
+ *****************************************************************************/
+
+#define REGO_LOG_MAGIC						"REGOLOG"
+#define REGO_LOG_VERSION					1
+
+// The file starts with a page holding two copies of the header, followed by
+// the ring of records
+#define REGO_LOG_HEADER_SIZE			4096
+#define REGO_LOG_DEFAULT_RECORDS	65536		// Ring size of new files, 768 kB
+#define REGO_LOG_MAX_RECORDS			(16 * 1024 * 1024)
+
+// Records are synced to disk in batches, bounding flash wear. A power cut
+// loses at most the records of the batch in progress
+#define REGO_LOG_BATCH_RECORDS		256
+#define REGO_LOG_BATCH_INTERVAL		300			// Longest time between syncs (s)
+
+/*****************************************************************************
+ * Types
+ *****************************************************************************/
+
+typedef struct {
+	uint32_t time;											// Unix time of the sample
+	uint16_t address;
+	int16_t value;
+	int8_t status;											// RESPONSE_* of the read
+	uint8_t reserved[3];
+} regoLogRecord;
+
+/*
+ * File header. Written alternately to two slots, each with a checksum, so a
+ * torn header write leaves the previous one intact
+ */
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t recordSize;
+	uint32_t capacity;									// Record slots in the ring
+	uint32_t reserved;
+	uint64_t head;											// Records synced, the next goes to slot head % capacity
+	uint64_t sequence;									// Header writes, the valid slot with the highest wins
+	uint32_t checksum;									// Over all fields above
+} regoLogHeader;
+
+/*
+ * Open log file. Records are appended to the mapping and made durable by
+ * flushLog(), which syncs them before the header that makes them valid
+ */
+typedef struct regoLog {
+	int fd;
+	uint8_t* map;
+	size_t mapSize;
+	uint8_t writable;
+	regoLogHeader header;								// Last header written or read
+	uint64_t head;											// Records written, including unsynced ones
+	uint32_t lastTime;									// Newest record time, records are kept in time order
+	int64_t lastFlush;									// Monotonic time (ms) of the last sync
+} regoLog;
+
+/*****************************************************************************
+ * Function declarations
+ *****************************************************************************/
+
+int openLog(regoLog* log, const char* path, uint32_t capacity, uint8_t writable);
+void closeLog(regoLog* log);
+void appendLog(regoLog* log, uint32_t time, uint16_t address, int8_t status, int16_t value);
+int flushLog(regoLog* log);
+void getLogRange(regoLog* log, uint64_t* first, uint64_t* end);
+regoLogRecord* getLogRecord(regoLog* log, uint64_t index);
+uint64_t findLogTime(regoLog* log, uint32_t time);
+
+#endif
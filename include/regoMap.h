@@ -0,0 +1,56 @@
+#ifndef REGO_MAP_H
+#define REGO_MAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*****************************************************************************
+ * Defines
+ *****************************************************************************/
+
+#define REGO_MAP_MAGIC						"REGOMAP"
+#define REGO_MAP_VERSION					2
+#define REGO_MAP_CACHE_SUFFIX			".cache"	// Appended to the map path
+#define REGO_MAP_LINE_MAX					512
+#define REGO_MAP_NAME_MAX					63
+
+/*****************************************************************************
+ * Types
+ *****************************************************************************/
+
+/*
+ * Compiled register map, as stored in the cache file: the header, the
+ * entries, the IDs sorted by address and by name, and the string pool
+ */
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;											// Registers in the map
+	uint64_t sourceSize;								// Size and modification time of the text map the
+	int64_t sourceTime;									// cache was compiled from, to tell when it is stale
+	uint32_t stringsSize;
+	uint32_t reserved;
+} regoMapHeader;
+
+typedef struct {
+	uint16_t address;
+	uint16_t interval;									// Poll interval (s), 0 = not scheduled
+	uint8_t type;												// REG_TYPE_*, with REG_TYPE_GRAPHITE
+	uint8_t priority;										// REG_PRIO_*
+	uint16_t reserved;
+	uint32_t name;											// Offsets into the string pool
+	uint32_t description;
+} regoMapEntry;
+
+/*****************************************************************************
+ * Function declarations
+ *****************************************************************************/
+
+int loadRegisterMap(const char* path);
+int compileRegisterMap(const char* path, uint8_t** image, size_t* size);
+int useRegisterMapImage(const uint8_t* image, size_t size);
+void printMapEntry(FILE* out, uint16_t address, const char* name, uint8_t type, uint16_t interval, uint8_t priority, const char* description);
+void printRegisterMap(FILE* out);
+
+#endif
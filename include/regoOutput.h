@@ -0,0 +1,68 @@
+#ifndef REGO_OUTPUT_H
+#define REGO_OUTPUT_H
+
+#include <stdint.h>
+
+#include <regoGraphite.h>
+
+/*****************************************************************************
+ * Defines
+ *****************************************************************************/
+
+// Output formats
+#define OUTPUT_HUMAN						0			// Register name, description and value
+#define OUTPUT_GRAPHITE					1			// Graphite plaintext protocol
+#define OUTPUT_INFLUX						2			// InfluxDB line protocol
+#define OUTPUT_JSON							3			// One JSON object per line
+#define OUTPUT_CSV							4			// Comma separated values with a header line
+#define OUTPUT_FORMATS					5
+
+// Samples of a sweep are rendered into one buffer and written in one call
+#define REGO_OUTPUT_BUF_SIZE		8192
+#define REGO_OUTPUT_LINE_MAX		256		// Longest rendered sample
+
+/*****************************************************************************
+ * Types
+ *****************************************************************************/
+
+/*
+ * One register read, as handed to the formatters
+ */
+typedef struct {
+	const char* tag;									// Connection tag, may be empty
+	uint16_t address;
+	int16_t id;												// Known register ID, -1 if unknown
+	const char* name;									// Series name, NULL for the name of the register
+	uint8_t type;											// REG_TYPE_* of a named series
+	int8_t status;										// RESPONSE_* of the read
+	int16_t value;
+	uint32_t time;										// Unix time of the sweep
+} regoSample;
+
+/*
+ * Output sink. Samples are rendered into the buffer as they come in and
+ * written out by flushOutput(), to stdout or for Graphite optionally to a
+ * carbon server
+ */
+typedef struct regoOutput {
+	uint8_t format;										// OUTPUT_*
+	uint8_t headerDone;								// CSV header has been written
+	graphiteSender* graphite;					// Carbon server for Graphite output, NULL for stdout
+	uint32_t sweepTime;								// Timestamp of the samples in the buffer
+	char buffer[REGO_OUTPUT_BUF_SIZE];
+	uint32_t len;
+} regoOutput;
+
+/*****************************************************************************
+ * Function declarations
+ *****************************************************************************/
+
+void initOutput(regoOutput* out, uint8_t format);
+int8_t getOutputFormatByName(const char* name);
+uint16_t formatSample(uint8_t format, char* dst, regoSample* sample);
+uint16_t formatDisplayRow(uint8_t format, char* dst, const char* tag, uint32_t sec, uint16_t ms, uint8_t row, const char* text);
+void addOutputSample(regoOutput* out, const char* tag, uint16_t address, int16_t id, int8_t status, int16_t value, uint32_t sampleTime);
+void addOutputSeries(regoOutput* out, const char* tag, uint16_t address, const char* name, uint8_t type, int16_t value, uint32_t sampleTime);
+int flushOutput(regoOutput* out);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef REGO_POLLER_H
+#define REGO_POLLER_H
+
+#include <regoSerialIO.h>
+
+/*****************************************************************************
+ * Defines
+ *****************************************************************************/
+
+// Most heatpumps that can be polled concurrently
+#define REGO_MAX_PORTS		8
+
+/*****************************************************************************
+ * Function declarations
+ *****************************************************************************/
+
+int runPoller(rego_conn* conns, uint8_t count, uint16_t* regs, uint16_t regCount);
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef REGO_SCAN_H
+#define REGO_SCAN_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <regoSerialIO.h>
+
+/*****************************************************************************
+ * Defines
+ *****************************************************************************/
+
+#define REGO_SCAN_MAGIC						"REGOSCAN"
+#define REGO_SCAN_VERSION					1
+
+#define REGO_SCAN_ADDRESSES				0x10000
+#define REGO_SCAN_MAX_RANGES			16
+
+// Response timeout, learned from the round trip times of the registers that
+// respond like a TCP retransmission timeout (mean + 4 deviations). Until
+// enough have responded the full --timeout is used
+#define REGO_SCAN_LEARN_SAMPLES		8
+#define REGO_SCAN_MIN_TIMEOUT			20			// Floor of the learned timeout (ms)
+
+#define REGO_SCAN_CHECKPOINT			30			// Time between checkpoints (s)
+#define REGO_SCAN_PASS_INTERVAL		60			// Least time between the starts of passes (s)
+
+/*****************************************************************************
+ * Types
+ *****************************************************************************/
+
+/*
+ * What was seen of one address. Values are only tracked once it has responded
+ */
+typedef struct {
+	int16_t first;
+	int16_t min;
+	int16_t max;
+	int16_t last;
+	uint16_t reads;											// Successful reads
+	uint16_t changes;										// Reads that differed from the one before
+	uint16_t pass;											// Pass the address was last probed in, 0 = never
+	int8_t status;											// RESPONSE_* of the last probe
+	uint8_t reserved;
+} regoScanEntry;
+
+/*
+ * Checkpoint file header, followed by one entry per address
+ */
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint16_t passes;										// Passes to make
+	uint16_t pass;											// Pass in progress, from 1, passes + 1 when done
+	uint32_t next;											// Next address to probe in the pass
+	uint32_t rangeCount;
+	uint16_t rangeFrom[REGO_SCAN_MAX_RANGES];	// Address ranges scanned, inclusive
+	uint16_t rangeTo[REGO_SCAN_MAX_RANGES];
+	uint32_t srtt;											// Smoothed round trip time (us)
+	uint32_t rttvar;										// Round trip time deviation (us)
+	uint32_t rttSamples;
+	uint32_t minTimeout;								// Floor of the timeout (ms), raised by late responses
+} regoScanHeader;
+
+/*
+ * Discovery scan of the register space. The first pass probes every address
+ * in the ranges, the later ones only those that responded, to see how their
+ * values vary
+ */
+typedef struct {
+	regoScanHeader header;
+	regoScanEntry* entries;							// REGO_SCAN_ADDRESSES entries
+	const char* statePath;							// Checkpoint file, NULL for none
+	uint32_t passInterval;							// Least time between the starts of passes (s)
+	int maxTimeout;											// Timeout before any have responded (ms)
+	time_t lastCheckpoint;
+	uint32_t lateResponses;							// Responses that came after the timeout
+} regoScan;
+
+/*****************************************************************************
+ * Function declarations
+ *****************************************************************************/
+
+int initScan(regoScan* scan, const char* ranges, uint16_t passes, const char* statePath);
+void freeScan(regoScan* scan);
+int saveScan(regoScan* scan);
+int runScan(regoScan* scan, rego_conn* conn);
+int getScanTimeout(regoScan* scan);
+void addScanSample(regoScan* scan, uint16_t address, int8_t status, int16_t value);
+void printScanMap(regoScan* scan, FILE* out);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef REGO_SCHED_H
+#define REGO_SCHED_H
+
+#include <regoComm.h>
+#include <regoSerialIO.h>
+
+/*****************************************************************************
+ * Defines
+ *****************************************************************************/
+
+// Transactions timed by check_schedule to measure the link capacity
+#define REGO_SCHED_CALIBRATION_SAMPLES	10
+
+/*****************************************************************************
+ * Types
+ *****************************************************************************/
+
+typedef struct {
+	uint16_t address;					// Register address
+	uint32_t interval;				// Poll interval (ms)
+	int64_t due;							// Monotonic time (ms) of the next poll
+} schedEntry;
+
+/*
+ * Poll schedule. Each priority class has its own deadline queue (a binary
+ * min-heap of entry indexes ordered by due time), and the most urgent class
+ * with a due entry is always served first
+ */
+typedef struct {
+	rego_conn* conn;
+	schedEntry* entries;
+	uint16_t count;
+	uint16_t* heap[REG_PRIO_COUNT];
+	uint16_t heapLen[REG_PRIO_COUNT];
+	uint32_t avgTransaction;	// Moving average of the transaction time (us), 0 = unknown
+	uint8_t overloadWarned;		// Warned that the schedule exceeds the link capacity
+} regoSchedule;
+
+/*****************************************************************************
+ * Function declarations
+ *****************************************************************************/
+
+int initSchedule(regoSchedule* sched, rego_conn* conn);
+void freeSchedule(regoSchedule* sched);
+int32_t getScheduleWait(regoSchedule* sched);
+uint8_t runScheduledPoll(regoSchedule* sched);
+void runSchedule(regoSchedule* sched);
+void measureLinkCapacity(regoSchedule* sched, uint8_t samples);
+uint32_t getScheduleLoad(regoSchedule* sched);
+void printScheduleReport(regoSchedule* sched);
+
+#endif
@@ -1,24 +1,153 @@
+#ifndef REGO_SERIAL_IO_H
+#define REGO_SERIAL_IO_H
+
 #include <stdint.h>
+#include <time.h>
 
 /*************************************************************************************
  * Defines
  *************************************************************************************/
 
-// Serial port of device
+// Default serial port of device
 #define PORT_NAME								"/dev/ttyACM0"
+#define REGO_PORT_NAME_SIZE			64
+#define REGO_TAG_SIZE						32
+
+// Response frame lengths, including address and checksum bytes
+#define REGO_LEN_INT_RESPONSE		5
+#define REGO_LEN_DISPLAY_RESPONSE	42
+
+// LCD display, 4 rows of 20 characters. A decoded row takes up to 2 bytes per
+// character in UTF-8, and ends with newline and null
+#define REGO_DISPLAY_ROWS				4
+#define REGO_DISPLAY_ROW_SIZE		42
+
+// Default time to wait for a complete response (ms)
+#define REGO_RESPONSE_TIMEOUT		500
+
+// Buffer settings
+#define REGO_COM_BUF_SIZE	43
+#define REGO_RX_RING_SIZE	128		// Must be a power of two
+#define REGO_RX_RING_MASK	(REGO_RX_RING_SIZE - 1)
+
+// Register cache slots per connection, must be a power of two
+#define REGO_CACHE_SIZE		64
+
+/*************************************************************************************
+ * Types
+ *************************************************************************************/
+
+/*
+ * Register cache entry, maintained by regoComm.c
+ */
+typedef struct {
+	uint16_t address;
+	int16_t value;
+	int8_t status;											// RESPONSE_* of the acquisition
+	uint8_t used;
+	int64_t time;												// Monotonic time (ms) of the acquisition
+} regoCacheEntry;
+
+/*
+ * Delta mode state of a register, maintained by regoComm.c
+ */
+typedef struct {
+	int16_t value;											// Value last output
+	uint8_t emitted;										// value is valid
+	uint32_t keyframe;									// Keyframe period the value was last output in
+} regoDeltaEntry;
+
+// Instrumentation and output sinks, see regoStats.h and regoOutput.h
+struct regoStats;
+struct regoOutput;
+struct regoLog;
+struct regoAggregator;
+struct regoShm;
+struct regoCapture;
+
+/*
+ * Connection handle. Holds everything needed to talk to one controller, so
+ * separate handles can be used from separate threads or for separate ports
+ */
+typedef struct rego_conn {
+	int fd;															// File descriptor of the serial port, -1 if closed
+	char portName[REGO_PORT_NAME_SIZE];	// Path of the serial port
+	char tag[REGO_TAG_SIZE];						// Name identifying the port in output, may be empty
+
+	// Packet buffer for the rego communications both send and receive
+	char buffer[REGO_COM_BUF_SIZE];
+	uint8_t len;
+	uint8_t expectedLen;								// Response length of the transaction in progress
+
+	// Receive ring buffer. Bytes are read in here and framed by extractFrame()
+	char ring[REGO_RX_RING_SIZE];
+	uint16_t ringHead;									// Write position (free-running)
+	uint16_t ringTail;									// Read position (free-running)
+	uint32_t discardedBytes;						// Bytes skipped while resynchronizing
+
+	// Settings, see initConnection() for defaults
+	int graphiteOutputFlag;							// Outputs data suitable for Graphite
+	int ignoreChecksumsFlag;						// Just warn on checksum errors
+	int showPacketsFlag;								// Print packets in hex form
+	int showTimingFlag;									// Print round trip times to stderr
+	int responseTimeout;								// Time to wait for a complete response (ms)
+	int maxRetries;											// Retries after a failed transaction
+	int requestGap;											// Least time between a response and the next request (ms)
+	int cacheMaxAge;										// Oldest cached value to use (ms), -1 = per register
+	int deltaKeyframe;									// Delta mode keyframe interval (s), 0 = output every value
+	struct regoOutput* output;					// Sweep buffer for output, NULL prints each sample
+	struct regoLog* log;								// Ring log every sample is appended to, NULL for none
+	struct regoAggregator* agg;					// Windowed aggregation replacing the samples in output, NULL for none
+	struct regoShm* shm;								// Shared snapshot every read is published to, NULL for none
+	struct regoCapture* capture;				// File every frame sent and received is captured to, NULL for none
+
+	// Timing and link quality
+	struct timespec sendTime;						// Monotonic time of the last sendPacket()
+	uint32_t lastLatency;								// Round trip time of the last transaction (us)
+	int64_t lastReceive;								// Monotonic time (ms) the last response ended, 0 = none yet
+	uint16_t linkErrorRate;							// Moving average of failed transactions in 1/1000
+	uint32_t firstByteLatency;					// Time to the first response byte (us), 0 = none yet
+	uint32_t lockWait;									// Time spent waiting for the port lock (us)
+	struct regoStats* stats;						// Collected statistics, NULL when not enabled
+
+	// Recently read register values, keyed by address
+	regoCacheEntry cache[REGO_CACHE_SIZE];
+
+	// Values last output in delta mode, by register ID. Allocated on first use
+	regoDeltaEntry* delta;
+
+	// Error state
+	int8_t lastStatus;									// RESPONSE_* of the last transaction
+	int lastErrno;											// errno of the last failed system call
+	const char* errorContext;						// Where the last system call failed
+} rego_conn;
 
 /*************************************************************************************
  * Function declarations
  *************************************************************************************/
 
-void openSerialPort();
-void closeSerialPort();
-int setSerialParams();
+void initConnection(rego_conn* conn);
+int openSerialPort(rego_conn* conn, const char* portName);
+void closeSerialPort(rego_conn* conn);
+int setSerialParams(rego_conn* conn);
+void setConnError(rego_conn* conn, const char* context);
+void printConnError(rego_conn* conn);
+int64_t monotonicMillis();
+uint64_t monotonicMicros();
 
-uint8_t buildPacket(uint8_t device, uint8_t command, uint16_t reg, uint16_t data);
-void prettyPrintPacket();
-uint8_t receivePacket();
-void sendPacket();
-int8_t decodeIntPacket(int16_t* value);
-int8_t decodeDisplayPacket(uint8_t* len, char* text);
+int16_t decodeInt(char* buffer);
+uint8_t buildPacket(rego_conn* conn, uint8_t device, uint8_t command, uint16_t reg, uint16_t data);
+void prettyPrintPacket(rego_conn* conn);
+uint8_t responseLength(uint8_t command);
+uint8_t receivePacket(rego_conn* conn, uint8_t expectedLen);
+int sendPacket(rego_conn* conn);
+void flushInput(rego_conn* conn);
+int32_t getTimeLeft(rego_conn* conn);
+int startTransaction(rego_conn* conn, uint8_t command, uint16_t reg);
+uint8_t continueTransaction(rego_conn* conn);
+uint32_t getLastLatency(rego_conn* conn);
+uint32_t getDiscardedBytes(rego_conn* conn);
+int8_t decodeIntPacket(rego_conn* conn, int16_t* value);
+int8_t decodeDisplayPacket(rego_conn* conn, uint8_t* len, char* text);
 
+#endif
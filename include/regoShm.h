@@ -0,0 +1,77 @@
+#ifndef REGO_SHM_H
+#define REGO_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*****************************************************************************
+ * Defines
+ *****************************************************************************/
+
+#define REGO_SHM_MAGIC						"REGOSHM"
+#define REGO_SHM_VERSION					1
+#define REGO_SHM_DEFAULT_NAME			"/regoClient"
+#define REGO_SHM_NAME_SIZE				64
+
+// Times a reader retries a snapshot torn by the publisher before giving up.
+// A publisher killed while writing leaves the sequence odd for good
+#define REGO_SHM_READ_TRIES				10000
+
+/*****************************************************************************
+ * Types
+ *****************************************************************************/
+
+/*
+ * Latest read of one register
+ */
+typedef struct {
+	char name[REGO_SHM_NAME_SIZE];
+	uint16_t address;
+	int16_t value;											// Last value read successfully
+	int8_t status;											// RESPONSE_* of the last read
+	uint8_t type;												// REG_TYPE_*, with REG_TYPE_GRAPHITE
+	uint16_t reserved;
+	uint32_t valueTime;									// Unix time of value, 0 = never read
+	uint32_t readTime;									// Unix time of the last read
+} regoShmEntry;
+
+/*
+ * Segment header, followed by one entry per register of the publisher's
+ * register map, in register ID order
+ */
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t entrySize;
+	uint32_t count;											// Entries in use
+	uint32_t capacity;									// Entries the segment has room for
+	uint32_t pid;												// Process publishing to the segment
+	uint32_t sequence;									// Seqlock, odd while the entries are written
+} regoShmHeader;
+
+/*
+ * Open shared memory segment. The publisher bumps the sequence around every
+ * write, and readers copy the entries and retry until the sequence was even
+ * and unchanged over the copy. Readers never block the publisher
+ */
+typedef struct regoShm {
+	int fd;
+	uint8_t* map;
+	size_t mapSize;
+	uint8_t writable;
+	uint32_t capacity;									// Entries mapped
+	regoShmHeader* header;
+	regoShmEntry* entries;
+} regoShm;
+
+/*****************************************************************************
+ * Function declarations
+ *****************************************************************************/
+
+int openShm(regoShm* shm, const char* name, uint8_t writable);
+void closeShm(regoShm* shm);
+void publishShm(regoShm* shm, int16_t id, int8_t status, int16_t value, uint32_t time);
+int readShmSnapshot(regoShm* shm, regoShmEntry* entries, uint32_t max);
+int readShmRegister(regoShm* shm, uint16_t address, regoShmEntry* entry);
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef REGO_STATS_H
+#define REGO_STATS_H
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <regoComm.h>
+#include <regoSerialIO.h>
+
+/*****************************************************************************
+ * Defines
+ *****************************************************************************/
+
+// Latency histogram buckets. Each power of two of microseconds is split into
+// four buckets, giving 25% resolution or better up to about 2 s. The last bucket also
+// counts everything slower
+#define REGO_STATS_SUB_BUCKETS		4
+#define REGO_STATS_BUCKETS				80
+
+// Command types with separate statistics
+#define REGO_STATS_CMD_REGISTER		0
+#define REGO_STATS_CMD_DISPLAY		1
+#define REGO_STATS_COMMANDS				2
+
+/*****************************************************************************
+ * Types
+ *****************************************************************************/
+
+typedef struct {
+	uint32_t buckets[REGO_STATS_BUCKETS];
+	uint32_t count;
+	uint32_t max;												// Slowest sample (us)
+	uint64_t sum;												// Sum of all samples (us)
+} regoHistogram;
+
+typedef struct {
+	regoHistogram firstByte;						// Send to first response byte
+	regoHistogram complete;							// Send to complete, valid response
+} regoLatencyStats;
+
+/*
+ * Instrumentation of one connection, allocated by enableStats(). Latencies
+ * are kept per command type and per known register, with one extra slot
+ * after the known registers shared by all registers not in the table
+ */
+typedef struct regoStats {
+	int64_t since;											// Monotonic time (ms) collection started
+	uint32_t transactions;							// Attempts, including retries
+	uint32_t errors[4];									// Failed attempts, indexed by -RESPONSE_*
+	regoLatencyStats command[REGO_STATS_COMMANDS];
+	int16_t regCount;										// Known registers, the index of the extra slot
+	regoLatencyStats* reg;
+} regoStats;
+
+/*****************************************************************************
+ * Shared variables
+ *****************************************************************************/
+
+// Set by statsSignalHandler(), checked by long-running loops
+extern volatile sig_atomic_t statsDumpRequested;
+
+/*****************************************************************************
+ * Function declarations
+ *****************************************************************************/
+
+int enableStats(rego_conn* conn);
+void freeStats(rego_conn* conn);
+void recordTransaction(rego_conn* conn, uint8_t command, uint16_t reg, int8_t status);
+void printStats(rego_conn* conn, FILE* out);
+void statsSignalHandler(int sig);
+void checkStatsDump(rego_conn* conn);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef REGO_TUNE_H
+#define REGO_TUNE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <regoSerialIO.h>
+
+/*****************************************************************************
+ * Defines
+ *****************************************************************************/
+
+// File of the tuning profiles, one line per port
+#define REGO_PROFILE_PATH					"/etc/regoClient.profiles"
+#define REGO_PROFILE_LINE_MAX			256
+
+// The controller talks 19200 baud 8N1. USB adapters of the ACM kind ignore
+// the rate, RS-232 adapters may need it set
+#define REGO_TUNE_BAUD						19200
+
+// Calibration. Each profile is measured with this many reads, without retries,
+// and counts as reliable if at most this share of them fail
+#define REGO_TUNE_READS						20
+#define REGO_TUNE_MAX_ERROR_RATE	20			// Failed reads in 1/1000
+#define REGO_TUNE_MIN_TIMEOUT			50			// Floor of the timeout chosen (ms)
+
+/*****************************************************************************
+ * Types
+ *****************************************************************************/
+
+/*
+ * Serial transport settings of a port
+ */
+typedef struct {
+	uint32_t baud;											// Line rate, 0 leaves the port's rate as is
+	uint8_t lowLatency;									// Have the driver hand over bytes at once
+	uint16_t gap;												// Least time between a response and the next request (ms)
+	uint16_t timeout;										// Response timeout (ms), 0 leaves --timeout as is
+} regoSerialProfile;
+
+/*****************************************************************************
+ * Function declarations
+ *****************************************************************************/
+
+int applySerialProfile(rego_conn* conn, const regoSerialProfile* profile);
+int calibratePort(rego_conn* conn, uint16_t reads, regoSerialProfile* best, FILE* report);
+int loadSerialProfile(const char* path, const char* portName, regoSerialProfile* profile);
+int saveSerialProfile(const char* path, const char* portName, const regoSerialProfile* profile);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef REGO_WATCH_H
+#define REGO_WATCH_H
+
+#include <stdint.h>
+
+#include <regoComm.h>
+#include <regoSerialIO.h>
+
+/*****************************************************************************
+ * Defines
+ *****************************************************************************/
+
+#define REGO_WATCH_INTERVAL				1000		// Default time between polls of the flags (ms)
+#define REGO_WATCH_DEBOUNCE				0				// Default time a change must persist (ms)
+#define REGO_WATCH_DEBOUNCE_MAX		3600000	// Longest debounce time (ms)
+#define REGO_WATCH_HOOK_RATE			30			// Default most hooks run per minute
+#define REGO_WATCH_HOOK_RATE_MAX	60000		// Highest hook rate, keeps the token bucket in 32 bits
+
+/*****************************************************************************
+ * Types
+ *****************************************************************************/
+
+/*
+ * Watcher of the bool status registers. Their states are kept as bitsets, one
+ * bit per watched register, so a poll round finds its edges with a few word
+ * operations
+ */
+typedef struct {
+	rego_conn* conn;
+	uint16_t count;											// Registers watched
+	uint16_t words;											// Words per bitset
+	int16_t* ids;												// Register IDs, by bit
+	uint64_t* state;										// Debounced states
+	uint64_t* known;										// Registers whose state has been read
+	uint64_t* pending;									// Registers last read in the other state
+	int64_t* pendingSince;							// Monotonic time (ms) the other state was first read
+	uint64_t* reading;									// States read in the current round
+	uint64_t* valid;										// Registers read successfully in the current round
+	uint32_t debounce;									// Time a change must persist to be an edge (ms)
+
+	// Command run on each edge, limited by a token bucket
+	const char* hook;										// NULL for none
+	uint32_t hookRate;									// Most hooks per minute
+	uint32_t hookTokens;								// Hooks that can be run now, in 1/1000
+	int64_t hookRefill;									// Monotonic time (ms) tokens were last added
+	uint32_t hooksSuppressed;						// Hooks not run because of the rate limit
+	uint32_t edges;
+} regoWatch;
+
+/*****************************************************************************
+ * Function declarations
+ *****************************************************************************/
+
+int initWatch(regoWatch* watch, rego_conn* conn, uint32_t debounce, const char* hook, uint32_t hookRate);
+void freeWatch(regoWatch* watch);
+uint16_t pollWatch(regoWatch* watch);
+uint16_t applyWatchRound(regoWatch* watch, int64_t now);
+void runWatch(regoWatch* watch, uint32_t interval);
+
+#endif
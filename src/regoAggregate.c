@@ -0,0 +1,255 @@
+/*
+ * regoAggregate.c
+ *
+ * Windowed aggregation of register samples. Each series keeps a running
+ * aggregate per window, updated in constant time and memory as samples come
+ * in, and only the aggregates are output when a window ends. Besides the
+ * registers themselves, temperature differences across the heat exchangers
+ * are derived, and bool registers such as status.compressor are summarized as
+ * duty cycle, on-time and number of starts.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <regoAggregate.h>
+#include <regoComm.h>
+#include <regoOutput.h>
+
+/*****************************************************************************
+ * Types
+ *****************************************************************************/
+
+/*
+ * Series derived as the difference of two registers
+ */
+typedef struct {
+	const char* name;
+	uint16_t minuend;
+	uint16_t subtrahend;
+} derivedSeries;
+
+/*****************************************************************************
+ * Internal function declarations
+ *****************************************************************************/
+
+void addNumericSample(regoAggWindow* window, uint32_t time, int16_t value);
+void addBoolSample(regoAggWindow* window, uint32_t time, int16_t value);
+void updateDerived(regoAggregator* agg, uint32_t time, int16_t id);
+void emitWindow(regoAggregator* agg, struct regoOutput* out, const char* tag, uint8_t w);
+void emitSeries(struct regoOutput* out, const char* tag, uint16_t address, const char* name, const char* label, const char* stat, uint8_t type, int16_t value, uint32_t time);
+
+/*****************************************************************************
+ * Shared variables
+ *****************************************************************************/
+
+derivedSeries derived[REGO_AGG_DERIVED] = {
+	{"derived.heatFluidDeltaT", 0x020F, 0x0210},			// GT8 - GT9, across the condenser
+	{"derived.coldFluidDeltaT", 0x0211, 0x0212},			// GT10 - GT11, across the evaporator
+};
+
+/*****************************************************************************
+ * Functions
+ *****************************************************************************/
+
+/*
+ * Set up aggregation over the windows given as a comma separated list of
+ * lengths in seconds, e.g. 60,600,3600
+ * Returns 0 on success, -1 if the list is invalid, -2 if out of memory
+ */
+int initAggregator(regoAggregator* agg, const char* windows) {
+	char* end;
+	long len;
+	uint8_t w;
+
+	memset(agg, 0, sizeof(*agg));
+	while (*windows) {
+		len = strtol(windows, &end, 0);
+		if (end == windows || len <= 0 || agg->windowCount == REGO_AGG_MAX_WINDOWS) return -1;
+		agg->windowLen[agg->windowCount++] = len;
+		windows = *end == ',' ? end + 1 : end;
+		if (*end != ',' && *end != 0) return -1;
+	}
+	if (agg->windowCount == 0) return -1;
+
+	agg->registerCount = getKnownRegisterCount();
+	agg->lastValue = calloc(agg->registerCount, sizeof(int16_t));
+	agg->lastValid = calloc(agg->registerCount, sizeof(uint8_t));
+	for (w = 0; w < agg->windowCount; w++) {
+		agg->series[w] = calloc(agg->registerCount + REGO_AGG_DERIVED, sizeof(regoAggWindow));
+		if (agg->series[w] == NULL) break;
+	}
+	if (w < agg->windowCount || agg->lastValue == NULL || agg->lastValid == NULL) {
+		freeAggregator(agg);
+		return -2;
+	}
+	return 0;
+}
+
+/*
+ * Release the memory of the aggregator
+ */
+void freeAggregator(regoAggregator* agg) {
+	uint8_t w;
+
+	for (w = 0; w < REGO_AGG_MAX_WINDOWS; w++) {
+		free(agg->series[w]);
+		agg->series[w] = NULL;
+	}
+	free(agg->lastValue);
+	free(agg->lastValid);
+	agg->lastValue = NULL;
+	agg->lastValid = NULL;
+}
+
+/*
+ * Add a sample to the running min, max, mean and last
+ */
+void addNumericSample(regoAggWindow* window, uint32_t time, int16_t value) {
+	if (window->count == 0) {
+		window->min = value;
+		window->max = value;
+		window->sum = 0;
+		if (window->start == 0) window->start = time;
+	}
+	if (value < window->min) window->min = value;
+	if (value > window->max) window->max = value;
+	window->sum += value;
+	window->last = value;
+	window->count++;
+}
+
+/*
+ * Add a sample of a bool series, accounting for the time on since the last one
+ */
+void addBoolSample(regoAggWindow* window, uint32_t time, int16_t value) {
+	if (window->start == 0) window->start = time;
+	if (window->onSince) window->onTime += time - window->onSince;
+	else if (value && window->known) window->starts++;
+
+	window->known = 1;
+	window->onSince = value ? time : 0;
+	window->last = value;
+	window->count++;
+}
+
+/*
+ * Update the series derived from a register that just got a new value
+ */
+void updateDerived(regoAggregator* agg, uint32_t time, int16_t id) {
+	uint16_t address = getRegisterAddressById(id);
+	int16_t a, b;
+	uint8_t i, w;
+
+	for (i = 0; i < REGO_AGG_DERIVED; i++) {
+		if (address != derived[i].minuend && address != derived[i].subtrahend) continue;
+
+		a = getRegisterIdByAddress(derived[i].minuend);
+		b = getRegisterIdByAddress(derived[i].subtrahend);
+		if (a < 0 || b < 0 || !agg->lastValid[a] || !agg->lastValid[b]) continue;
+
+		for (w = 0; w < agg->windowCount; w++) {
+			addNumericSample(&agg->series[w][agg->registerCount + i], time, agg->lastValue[a] - agg->lastValue[b]);
+		}
+	}
+}
+
+/*
+ * Add a sample to all windows, first outputting the windows that ended before
+ * it. Failed reads and unknown registers are left out
+ */
+void addAggregateSample(regoAggregator* agg, struct regoOutput* out, const char* tag, uint32_t time, int16_t id, int8_t status, int16_t value) {
+	uint8_t w;
+
+	emitAggregates(agg, out, tag, time);
+	if (status != RESPONSE_OK || id < 0 || id >= agg->registerCount) return;
+
+	for (w = 0; w < agg->windowCount; w++) {
+		if (getRegisterTypeById(id) == REG_TYPE_BOOL) addBoolSample(&agg->series[w][id], time, value);
+		else addNumericSample(&agg->series[w][id], time, value);
+	}
+
+	agg->lastValue[id] = value;
+	agg->lastValid[id] = 1;
+	updateDerived(agg, time, id);
+}
+
+/*
+ * Output the aggregates of all windows that have ended by the given time
+ */
+void emitAggregates(regoAggregator* agg, struct regoOutput* out, const char* tag, uint32_t time) {
+	uint8_t w;
+
+	for (w = 0; w < agg->windowCount; w++) {
+		if (time / agg->windowLen[w] == agg->windowIndex[w]) continue;
+		if (agg->windowIndex[w] != 0) emitWindow(agg, out, tag, w);
+		agg->windowIndex[w] = time / agg->windowLen[w];
+	}
+}
+
+/*
+ * Output the aggregates of a window that has ended and start the next one.
+ * Bool series that are on carry over into the next window
+ */
+void emitWindow(regoAggregator* agg, struct regoOutput* out, const char* tag, uint8_t w) {
+	uint32_t end = (agg->windowIndex[w] + 1) * agg->windowLen[w];
+	regoAggWindow* window;
+	const char* name;
+	char label[12];
+	uint16_t address;
+	int32_t count;
+	uint8_t type;
+	int32_t i;
+
+	if (agg->windowLen[w] % 3600 == 0) snprintf(label, sizeof(label), "%uh", agg->windowLen[w] / 3600);
+	else if (agg->windowLen[w] % 60 == 0) snprintf(label, sizeof(label), "%um", agg->windowLen[w] / 60);
+	else snprintf(label, sizeof(label), "%us", agg->windowLen[w]);
+
+	for (i = 0; i < agg->registerCount + REGO_AGG_DERIVED; i++) {
+		window = &agg->series[w][i];
+		if (window->count == 0) continue;
+
+		if (i < agg->registerCount) {
+			name = getRegisterNameById(i);
+			address = getRegisterAddressById(i);
+			type = getRegisterTypeById(i);
+		} else {
+			name = derived[i - agg->registerCount].name;
+			address = 0;
+			type = REG_TYPE_TEMP;
+		}
+
+		if (type == REG_TYPE_BOOL) {
+			if (window->onSince) window->onTime += end - window->onSince;
+			emitSeries(out, tag, address, name, label, "duty", REG_TYPE_FRAC, end > window->start ? (uint64_t) window->onTime * 1000 / (end - window->start) : 0, end);
+			emitSeries(out, tag, address, name, label, "onTime", REG_TYPE_INT, window->onTime > INT16_MAX ? INT16_MAX : window->onTime, end);
+			emitSeries(out, tag, address, name, label, "starts", REG_TYPE_INT, window->starts, end);
+		} else {
+			emitSeries(out, tag, address, name, label, "min", type, window->min, end);
+			emitSeries(out, tag, address, name, label, "max", type, window->max, end);
+			count = window->count;
+			emitSeries(out, tag, address, name, label, "mean", type, (window->sum + (window->sum < 0 ? -count : count) / 2) / count, end);
+			emitSeries(out, tag, address, name, label, "last", type, window->last, end);
+		}
+
+		// The next window starts out with the state of a bool series at the
+		// boundary, so it is output even if the state does not change
+		window->count = type == REG_TYPE_BOOL;
+		window->start = end;
+		window->onSince = window->onSince ? end : 0;
+		window->onTime = 0;
+		window->starts = 0;
+	}
+}
+
+/*
+ * Output one aggregate as the series name.window.stat, e.g.
+ * sensors.temperature.gt2Outdoor.10m.mean
+ */
+void emitSeries(struct regoOutput* out, const char* tag, uint16_t address, const char* name, const char* label, const char* stat, uint8_t type, int16_t value, uint32_t time) {
+	char series[80];
+
+	snprintf(series, sizeof(series), "%s.%s.%s", name, label, stat);
+	addOutputSeries(out, tag, address, series, type, value, time);
+}
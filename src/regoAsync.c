@@ -0,0 +1,229 @@
+/*
+ * regoAsync.c
+ *
+ * Non-blocking requests to the heatpump, for embedding the protocol in an
+ * event loop. Requests are queued per connection and run one at a time: the
+ * caller polls the port fd together with its own, calls processAsync() when
+ * the fd is readable or the timeout has run out, and gets each result through
+ * a callback or from the completion queue. Retries back off without blocking.
+ * queryRegister() and queryDisplayRow() are built on this, waiting for their
+ * own request.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <regoAsync.h>
+#include <regoComm.h>
+#include <regoSerialIO.h>
+#include <regoStats.h>
+
+/*****************************************************************************
+ * Internal function declarations
+ *****************************************************************************/
+
+int32_t submitAsyncRequest(regoAsync* async, uint8_t command, uint16_t reg, regoCompletionCallback callback, void* context);
+void sendAsyncRequest(regoAsync* async);
+uint8_t finishAsyncRequest(regoAsync* async);
+
+/*****************************************************************************
+ * Functions
+ *****************************************************************************/
+
+/*
+ * Set up an empty request queue for an open connection
+ */
+void initAsync(regoAsync* async, rego_conn* conn) {
+	memset(async, 0, sizeof(*async));
+	async->conn = conn;
+	async->nextId = 1;
+}
+
+/*
+ * Queue a request. It is sent from processAsync()
+ * Returns the request id, or -1 if the queue is full
+ */
+int32_t submitAsyncRequest(regoAsync* async, uint8_t command, uint16_t reg, regoCompletionCallback callback, void* context) {
+	regoAsyncRequest* request;
+
+	// Completions not yet taken hold their slots, so the completion queue
+	// never overflows
+	if (async->queueCount + async->doneCount >= REGO_ASYNC_QUEUE_SIZE) return -1;
+
+	request = &async->queue[(async->queueHead + async->queueCount++) % REGO_ASYNC_QUEUE_SIZE];
+	request->id = async->nextId;
+	request->command = command;
+	request->reg = reg;
+	request->attempt = 0;
+	request->callback = callback;
+	request->context = context;
+
+	async->nextId = async->nextId == INT32_MAX ? 1 : async->nextId + 1;
+	return request->id;
+}
+
+/*
+ * Queue the read of a register. With a callback, it is called with the
+ * result from processAsync(), otherwise the result is queued for
+ * takeCompletion()
+ * Returns the request id, or -1 if the queue is full
+ */
+int32_t submitRegisterRead(regoAsync* async, uint16_t reg, regoCompletionCallback callback, void* context) {
+	return submitAsyncRequest(async, COMMAND_READ_SYS_REG, reg, callback, context);
+}
+
+/*
+ * Queue the read of a display row, see submitRegisterRead()
+ * Returns the request id, or -1 if the queue is full
+ */
+int32_t submitDisplayRowRead(regoAsync* async, uint8_t row, regoCompletionCallback callback, void* context) {
+	return submitAsyncRequest(async, COMMAND_READ_DISPLAY, row, callback, context);
+}
+
+/*
+ * File descriptor to wait on for input, along with the caller's own
+ */
+int getAsyncFd(regoAsync* async) {
+	return async->conn->fd;
+}
+
+/*
+ * Longest time (ms) the caller may wait for input before calling
+ * processAsync(), 0 to call it right away, or -1 if no request is queued
+ */
+int32_t getAsyncTimeout(regoAsync* async) {
+	int32_t timeout;
+
+	if (async->queueCount == 0) return -1;
+	if (async->busy) timeout = getTimeLeft(async->conn);
+	else if (async->scheduled) timeout = async->sendAt - monotonicMillis();
+	else timeout = 0;
+	return timeout < 0 ? 0 : timeout;
+}
+
+/*
+ * Send the request at the head of the queue. If the port fails, the request
+ * is left to complete as timed out
+ */
+void sendAsyncRequest(regoAsync* async) {
+	regoAsyncRequest* request = &async->queue[async->queueHead];
+
+	async->scheduled = 0;
+	async->busy = 1;
+	startTransaction(async->conn, request->command, request->reg);
+}
+
+/*
+ * Decode the response to the head request. A failed attempt is retried if
+ * retries are left, otherwise the request is removed from the queue and its
+ * completion delivered
+ * Returns 1 if the request completed, 0 if it is to be retried
+ */
+uint8_t finishAsyncRequest(regoAsync* async) {
+	rego_conn* conn = async->conn;
+	regoAsyncRequest request = async->queue[async->queueHead];
+	regoCompletion completion;
+
+	async->busy = 0;
+	memset(&completion, 0, sizeof(completion));
+	completion.id = request.id;
+	completion.command = request.command;
+	completion.reg = request.reg;
+	if (request.command == COMMAND_READ_DISPLAY) {
+		completion.status = decodeDisplayPacket(conn, &completion.len, completion.text);
+	} else {
+		completion.status = decodeIntPacket(conn, &completion.value);
+	}
+	updateLinkQuality(conn, completion.status);
+	recordTransaction(conn, request.command, request.reg, completion.status);
+	if (conn->showTimingFlag) fprintf(stderr, "Command %02x for %04x: %u us\n", request.command, request.reg, getLastLatency(conn));
+
+	if (completion.status != RESPONSE_OK && request.attempt < conn->maxRetries) {
+		async->queue[async->queueHead].attempt++;
+		return 0;
+	}
+
+	conn->lastStatus = completion.status;
+	if (request.command == COMMAND_READ_SYS_REG) updateRegisterCache(conn, request.reg, completion.status, completion.value);
+
+	// The request leaves the queue before the callback, which may submit more
+	async->queueHead = (async->queueHead + 1) % REGO_ASYNC_QUEUE_SIZE;
+	async->queueCount--;
+	if (request.callback) {
+		request.callback(&completion, request.context);
+	} else {
+		async->done[(async->doneHead + async->doneCount++) % REGO_ASYNC_QUEUE_SIZE] = completion;
+	}
+	return 1;
+}
+
+/*
+ * Advance the queued requests as far as possible without blocking: read the
+ * response in flight, deliver completions and send the next request once its
+ * delay has passed
+ * Returns the number of requests completed
+ */
+int processAsync(regoAsync* async) {
+	rego_conn* conn = async->conn;
+	regoAsyncRequest* request;
+	int completed = 0;
+
+	// Input while nothing is in flight or due to be sent is stale, and dropping
+	// it keeps the fd from waking up the caller again
+	if (!async->busy && (async->queueCount == 0 || async->scheduled)) flushInput(conn);
+
+	while (async->queueCount) {
+		if (async->busy) {
+			if (!continueTransaction(conn)) return completed;
+			completed += finishAsyncRequest(async);
+			continue;
+		}
+
+		request = &async->queue[async->queueHead];
+		if (!async->scheduled) {
+			// Retries start from a clean line
+			if (request->attempt > 0) flushInput(conn);
+			async->sendAt = monotonicMillis() + getRequestDelay(conn, request->attempt);
+			async->scheduled = 1;
+		}
+		if (monotonicMillis() < async->sendAt) break;
+		sendAsyncRequest(async);
+	}
+	return completed;
+}
+
+/*
+ * Wait for input or the timeout, then process the queue. With nothing queued
+ * there is nothing to wait for, so it returns at once
+ * Returns the number of requests completed, 0 if the queue is empty, or -1
+ * if poll failed
+ */
+int waitAsync(regoAsync* async) {
+	struct pollfd pfd;
+	int32_t timeout;
+
+	if (async->queueCount == 0) return 0;
+	timeout = getAsyncTimeout(async);
+	// Only a response in flight is waited for, not stale input
+	pfd.fd = async->busy ? getAsyncFd(async) : -1;
+	pfd.events = POLLIN;
+	if (timeout != 0 && poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+		perror("waitAsync: error in poll");
+		return -1;
+	}
+	return processAsync(async);
+}
+
+/*
+ * Take the oldest completion of a request submitted without a callback
+ * Returns 1 if there was one
+ */
+uint8_t takeCompletion(regoAsync* async, regoCompletion* completion) {
+	if (async->doneCount == 0) return 0;
+	*completion = async->done[async->doneHead];
+	async->doneHead = (async->doneHead + 1) % REGO_ASYNC_QUEUE_SIZE;
+	async->doneCount--;
+	return 1;
+}
@@ -0,0 +1,172 @@
+/*
+ * regoCapture.c
+ *
+ * Capture of the raw frames on a port, for reproducing link problems offline.
+ * Every request sent and every response as received, including partial and
+ * corrupt ones, is appended to a binary file with its monotonic time. A
+ * replay feeds the responses back through the packet decoders, as fast as
+ * possible or with the original timing.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <regoCapture.h>
+#include <regoComm.h>
+#include <regoSerialIO.h>
+
+/*****************************************************************************
+ * Functions
+ *****************************************************************************/
+
+/*
+ * Create the capture file at path, replacing any existing file
+ * Returns 0 on success, -1 on failure
+ */
+int openCapture(regoCapture* capture, const char* path) {
+	regoCaptureHeader header;
+
+	memset(capture, 0, sizeof(*capture));
+	capture->file = fopen(path, "wbe");
+	if (capture->file == NULL) {
+		fprintf(stderr, "openCapture: cannot create %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, REGO_CAPTURE_MAGIC, sizeof(REGO_CAPTURE_MAGIC));
+	header.version = REGO_CAPTURE_VERSION;
+	if (fwrite(&header, sizeof(header), 1, capture->file) != 1) {
+		fprintf(stderr, "openCapture: error writing %s: %s\n", path, strerror(errno));
+		fclose(capture->file);
+		capture->file = NULL;
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &capture->last);
+	return 0;
+}
+
+/*
+ * Write out the buffered records and close the file
+ */
+void closeCapture(regoCapture* capture) {
+	if (capture->file == NULL) return;
+	if (fclose(capture->file) == EOF) perror("closeCapture: error writing capture");
+	capture->file = NULL;
+}
+
+/*
+ * Append a frame, timed from the previous record
+ */
+void captureFrame(regoCapture* capture, uint8_t type, const char* frame, uint8_t len) {
+	regoCaptureRecord record;
+	struct timespec now;
+	int64_t delta;
+
+	if (capture->file == NULL) return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	delta = (now.tv_sec - capture->last.tv_sec) * 1000000LL + (now.tv_nsec - capture->last.tv_nsec) / 1000;
+	capture->last = now;
+
+	memset(&record, 0, sizeof(record));
+	record.delta = delta > UINT32_MAX ? UINT32_MAX : delta;
+	record.type = type;
+	record.len = len;
+	fwrite(&record, sizeof(record), 1, capture->file);
+	fwrite(frame, 1, len, capture->file);
+	capture->records++;
+}
+
+/*
+ * Decode the responses in the capture at path, calling callback with each.
+ * Responses are decoded for the request sent before them, using the settings
+ * of conn, such as ignoreChecksumsFlag. Its packet buffer is overwritten, the
+ * port is not used. If timed is set, the responses are replayed with the gaps
+ * they were received with, otherwise as fast as possible
+ * Returns the number of responses replayed, or -1 on failure
+ */
+int replayCapture(rego_conn* conn, const char* path, uint8_t timed, regoReplayCallback callback, void* context) {
+	regoCaptureRecord record;
+	regoCompletion response;
+	struct stat st;
+	uint8_t* map;
+	uint8_t command = COMMAND_READ_SYS_REG;
+	uint16_t reg = 0;
+	uint64_t time = 0, start, now;
+	size_t pos;
+	int fd, count = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "replayCapture: cannot open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(regoCaptureHeader)
+			|| (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		fprintf(stderr, "replayCapture: %s is not a capture file\n", path);
+		close(fd);
+		return -1;
+	}
+	if (memcmp(((regoCaptureHeader*) map)->magic, REGO_CAPTURE_MAGIC, sizeof(REGO_CAPTURE_MAGIC)) != 0
+			|| ((regoCaptureHeader*) map)->version != REGO_CAPTURE_VERSION) {
+		fprintf(stderr, "replayCapture: %s has an unsupported format\n", path);
+		munmap(map, st.st_size);
+		close(fd);
+		return -1;
+	}
+
+	start = monotonicMicros();
+	for (pos = sizeof(regoCaptureHeader); pos < (size_t) st.st_size; pos += record.len) {
+		// A capture cut off while writing ends in a partial record
+		if (pos + sizeof(record) > (size_t) st.st_size) {
+			fprintf(stderr, "replayCapture: %s is truncated\n", path);
+			break;
+		}
+		// Records follow their variable length frames, so they may be unaligned
+		memcpy(&record, map + pos, sizeof(record));
+		pos += sizeof(record);
+		if (record.len > REGO_COM_BUF_SIZE || pos + record.len > (size_t) st.st_size) {
+			fprintf(stderr, "replayCapture: %s is truncated\n", path);
+			break;
+		}
+		time += record.delta;
+
+		if (record.type == REGO_CAPTURE_SENT) {
+			// The request tells what the next response holds
+			if (record.len >= 5) {
+				command = map[pos + 1];
+				reg = decodeInt((char*) map + pos + 2);
+			}
+			continue;
+		}
+		if (record.type != REGO_CAPTURE_RECEIVED) continue;
+
+		if (timed) {
+			now = monotonicMicros();
+			if (now < start + time) usleep(start + time - now);
+		}
+
+		memcpy(conn->buffer, map + pos, record.len);
+		conn->len = record.len;
+		memset(&response, 0, sizeof(response));
+		response.id = ++count;
+		response.command = command;
+		response.reg = reg;
+		if (command == COMMAND_READ_DISPLAY) {
+			response.status = decodeDisplayPacket(conn, &response.len, response.text);
+		} else {
+			response.status = decodeIntPacket(conn, &response.value);
+		}
+		callback(time, &response, context);
+	}
+
+	munmap(map, st.st_size);
+	close(fd);
+	return count;
+}
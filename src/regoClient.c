@@ -1,10 +1,96 @@
 #include <errno.h>	// Used for perror(), etc
 #include <fcntl.h>
 #include <getopt.h>	// Used for getopt()
+#include <signal.h>	// Used for sigaction()
 #include <stdio.h>	// Used for printf(), etc
 #include <stdlib.h>	// Used for exit(), etc
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
+#include <regoAggregate.h>
+#include <regoCapture.h>
 #include <regoComm.h>
+#include <regoDaemon.h>
+#include <regoGraphite.h>
+#include <regoLog.h>
+#include <regoMap.h>
+#include <regoOutput.h>
+#include <regoPoller.h>
+#include <regoScan.h>
+#include <regoSched.h>
+#include <regoSerialIO.h>
+#include <regoShm.h>
+#include <regoStats.h>
+#include <regoTune.h>
+#include <regoWatch.h>
+
+/*
+ * Tally of replayed responses, by status
+ */
+typedef struct {
+	uint8_t quiet;
+	uint32_t count[RESPONSE_OK - RESPONSE_INVALID_ADDRESS + 1];	// Indexed by status - RESPONSE_INVALID_ADDRESS
+} replayTally;
+
+// Connections to the heatpump controllers, one per '--port'. Options are
+// parsed into the first connection and copied to the others
+rego_conn conns[REGO_MAX_PORTS];
+char* portSpecs[REGO_MAX_PORTS];
+int portCount = 0;
+
+// Long-running daemon mode, set by '--daemon'. '--schedule' adds background polling
+int daemonFlag = 0;
+int scheduleFlag = 0;
+char* socketPath = REGO_SOCKET_PATH;
+
+// Requests read from a file or stdin instead of commands, given with '--batch'
+char* batchPath = NULL;
+
+// Collect transaction statistics, set by '--stats'
+int statsFlag = 0;
+
+// Output of register values, in the format given with '--output'. Graphite
+// output goes to stdout, or to the server given with '--graphite-host'
+regoOutput output;
+int8_t outputFormat = OUTPUT_HUMAN;
+graphiteSender graphite;
+char* graphiteHost = NULL;
+char* graphiteSpool = NULL;
+
+// Windowed aggregation of each port, set up by '--aggregate'
+regoAggregator aggregators[REGO_MAX_PORTS];
+char* aggregateWindows = NULL;
+
+// Ring log of samples, given with '--log'
+regoLog ringLog;
+char* logPath = NULL;
+uint32_t logSize = REGO_LOG_DEFAULT_RECORDS;
+
+// Shared snapshot of the latest values, published to with '--shm'
+regoShm shm;
+char* shmName = NULL;
+
+// Capture of the frames on the port, given with '--capture'
+regoCapture capture;
+char* capturePath = NULL;
+
+// Tuning profiles of the ports, loaded when they are opened and written by
+// calibrate. A timeout given with '--timeout' overrides the profile's
+char* profilePath = REGO_PROFILE_PATH;
+int timeoutGiven = 0;
+
+// Register map file, given with '--register-map'
+char* registerMapPath = NULL;
+
+// Edge hook of watch_status, given with '--hook', with its settings
+char* hookCommand = NULL;
+uint32_t hookRate = REGO_WATCH_HOOK_RATE;
+uint32_t debounce = REGO_WATCH_DEBOUNCE;
+
+// A run starting with a command that does not talk to the heatpump leaves
+// the port closed, and only reads the log, the shared snapshot or a capture
+int portless = 0;
 
 void printUsage(char* cmd) {
 	printf("Usage: %s [options] command [arg] [command [arg] [...]\n"
@@ -14,25 +100,369 @@ void printUsage(char* cmd) {
 				 "      read_known_registers - Query and print all known registers\n"
 				 "  read_reg_range (fr) (to) - Query and print all registers in the given range\n"
 	       "              show_display - Displays the info currently on the LCD display\n"
+	       "watch_display (rows) (ms) - Poll the display rows, e.g. all or 0,2, every ms\n"
+	       "                             milliseconds (0 for back to back) and print the\n"
+	       "                             rows that change, with the time they were read\n"
+	       "              run_schedule - Poll known registers forever, each at its own interval\n"
+	       "         watch_status (ms) - Poll the bool status registers forever, every ms\n"
+	       "                             milliseconds (0 for %d), and output their edges\n"
+	       "            check_schedule - Measure the link and report if the poll schedule fits\n"
+	       "         calibrate (reads) - Time reads under each serial tuning profile, with\n"
+	       "                             reads per profile (0 for %d), and store the fastest\n"
+	       "                             reliable one for the port in the --profiles file\n"
+	       "        print_register_map - Print the register map in use, in map file format\n"
+	       "scan_registers (r) (n) (s) - Probe the addresses in the ranges r, e.g. all or\n"
+	       "                             0x0000-0x02ff,0x1000, then read those that respond\n"
+	       "                             again in n - 1 more passes, at least %d s apart,\n"
+	       "                             and print a candidate register map. Progress is\n"
+	       "                             saved in the state file s, and an interrupted scan\n"
+	       "                             resumes from it\n"
+	       " query_log (reg) (fr) (to) - Print the samples of a register logged between two\n"
+	       "                             times, given as Unix times or as now, now-3600\n"
+	       "                             and so on\n"
+	       "      read_shm (reg | all) - Print the latest value of a register, or of all\n"
+	       "                             registers, published by another process with --shm\n"
+	       "replay_capture (path) (m) - Decode the responses in a --capture file and print\n"
+	       "                             them with their times, as fast as possible with m\n"
+	       "                             fast, with the original timing with m timed, or\n"
+	       "                             only count them with m quiet\n"
 	       "\nAvailable options:\n"
-				 "         --graphite-output - Outputs data suitable for Graphite logging\n"
+	       "                  --daemon - Keep the port open and serve requests from local\n"
+	       "                             clients on a Unix socket instead of running commands\n"
+	       "           --socket (path) - Socket path for --daemon (default %s)\n"
+	       "                --schedule - With --daemon, poll known registers in the background\n"
+	       "            --batch (path) - Run the requests in this file, - for stdin, one per\n"
+	       "                             line, on one open port instead of running commands\n"
+	       "      --port ([tag=]path) - Serial port of the heatpump (default %s). Repeat to\n"
+	       "                             poll several heatpumps concurrently, tagging output\n"
+	       "         --output (format) - Output format of register values: human (default),\n"
+	       "                             graphite, influx, json or csv\n"
+				 "         --graphite-output - Outputs data suitable for Graphite logging, same as\n"
+	       "                             --output graphite\n"
+	       "    --graphite-host (addr) - Send Graphite output to the carbon server at addr,\n"
+	       "                             host[:port], over a persistent connection (default\n"
+	       "                             port %s). Implies --graphite-output\n"
+	       "   --graphite-spool (path) - Keep sweeps the server did not get in this file,\n"
+	       "                             and send them once it can be reached again\n"
 				 "        --ignore-checksums - Just prints a warning if checksum error occurs\n"
 	       "            --show-packets - Prints packets sent and received in hex form\n"
+	       "             --show-timing - Prints the round trip time of each request to stderr\n"
+	       "            --timeout (ms) - Time to wait for a complete response (default %d)\n"
+	       "         --retries (count) - Retries after a failed request (default %d)\n"
+	       "         --profiles (path) - File of the serial tuning profiles stored by\n"
+	       "                             calibrate and applied to each port it lists\n"
+	       "                             (default %s)\n"
+	       "            --max-age (ms) - Reuse register values read at most this long ago.\n"
+	       "                             0 always reads (default: long for settings, short\n"
+	       "                             for sensors and status)\n"
+	       "               --delta (s) - Only output values that changed, temperatures by\n"
+	       "                             more than 0.2 degrees, and all values every s\n"
+	       "                             seconds (0 for %d)\n"
+	       "   --aggregate (s[,s[,s]]) - Output min, max, mean and last of each register,\n"
+	       "                             delta-Ts, duty cycles and on-times over windows\n"
+	       "                             of these lengths instead of every value, e.g.\n"
+	       "                             %s\n"
+	       "   --register-map (path) - Load the register map from this file instead of\n"
+	       "                             using the built-in Rego 637 map, see maps/\n"
+	       "              --log (path) - Append every sample read to a fixed-size ring log\n"
+	       "                             file, created if it does not exist\n"
+	       "      --log-size (records) - Number of samples a new log holds (default %d)\n"
+	       "          --capture (path) - Write every frame sent and received, with its time,\n"
+	       "                             to this file for replay_capture\n"
+	       "              --shm (name) - Publish the latest value of every register to this\n"
+	       "                             shared memory segment, e.g. %s, for read_shm\n"
+	       "                             and other local readers. read_shm reads it from\n"
+	       "                             the segment given, or else from %s\n"
+	       "              --hook (cmd) - Run this shell command on each edge in watch_status,\n"
+	       "                             with REGO_REGISTER, REGO_ADDRESS, REGO_VALUE,\n"
+	       "                             REGO_TIME and REGO_TAG set\n"
+	       "       --hook-rate (count) - Most hooks run per minute, 0 for no limit\n"
+	       "                             (default %d)\n"
+	       "           --debounce (ms) - Time a status change must persist to be an edge\n"
+	       "                             (default %d)\n"
+	       "                   --stats - Print latency and error statistics to stderr on\n"
+	       "                             exit, and on SIGUSR1 in daemon mode and run_schedule\n"
 	       "\nNotes:\n"
 	       "- Addresses can be specified using their name or numeric address\n"
 	       "- Numeric values need to be specified in a numeric format supported by strol(),\n"
-	       "such as '1234', '0x020b', '0b1010', etc.\n", cmd);
+	       "such as '1234', '0x020b', '0b1010', etc.\n"
+	       "- In daemon mode, clients send one command per line (read_register (address)\n"
+	       "[max age] or show_display) and get one line back, starting with OK or ERR\n"
+	       "- In batch mode, read_reg_range (fr) (to) [max age] and read_known_registers\n"
+	       "[max age] are also taken. Each request gets one OK or ERR line per register,\n"
+	       "or for the display, and then a line END\n"
+	       "- query_log, read_shm, replay_capture and print_register_map do not use the\n"
+	       "port. Given first, the port is left closed and the log and the segment are\n"
+	       "only read, so they can run while another process writes them. Use a\n"
+	       "timestamped --output format for query_log and read_shm\n", cmd, REGO_WATCH_INTERVAL, REGO_TUNE_READS, REGO_SCAN_PASS_INTERVAL, REGO_SOCKET_PATH, PORT_NAME, REGO_GRAPHITE_DEFAULT_PORT, REGO_RESPONSE_TIMEOUT, REGO_DEFAULT_RETRIES, REGO_PROFILE_PATH, REGO_DELTA_KEYFRAME, REGO_AGG_DEFAULT_WINDOWS, REGO_LOG_DEFAULT_RECORDS, REGO_SHM_DEFAULT_NAME, REGO_SHM_DEFAULT_NAME, REGO_WATCH_HOOK_RATE, REGO_WATCH_DEBOUNCE);
+}
+
+/*
+ * Open all ports given with '--port'. A port given as tag=path is tagged with
+ * tag in output, otherwise ports are tagged with their device name when
+ * several are polled. Ports with a tuning profile get it applied
+ */
+void openPorts() {
+	regoSerialProfile profile;
+	char* path;
+	char* eq;
+	int i;
+
+	for (i = 0; i < portCount; i++) {
+		if (i > 0) conns[i] = conns[0];
+		if (aggregateWindows) {
+			if (i > 0 && initAggregator(&aggregators[i], aggregateWindows) < 0) {
+				printf("Out of memory setting up aggregation.\n");
+				exit(EXIT_FAILURE);
+			}
+			conns[i].agg = &aggregators[i];
+		}
+
+		path = portSpecs[i];
+		eq = strchr(path, '=');
+		if (eq != NULL) {
+			*eq = 0;
+			snprintf(conns[i].tag, sizeof(conns[i].tag), "%s", path);
+			path = eq + 1;
+		} else if (portCount > 1) {
+			snprintf(conns[i].tag, sizeof(conns[i].tag), "%s", strrchr(path, '/') ? strrchr(path, '/') + 1 : path);
+		}
+
+		if (openSerialPort(&conns[i], path) < 0) {
+			printConnError(&conns[i]);
+			exit(EXIT_FAILURE);
+		}
+
+		if (loadSerialProfile(profilePath, conns[i].portName, &profile) == 1) {
+			if (timeoutGiven) profile.timeout = 0;
+			if (applySerialProfile(&conns[i], &profile) < 0) {
+				// A profile of another adapter is no reason not to run
+				printConnError(&conns[i]);
+				fprintf(stderr, "Ignoring the tuning profile of %s, run calibrate again.\n", conns[i].portName);
+			}
+		}
+	}
+}
+
+/*
+ * Start collecting statistics on all ports, dumped on SIGUSR1 by long-running
+ * modes
+ */
+void enablePortStats() {
+	struct sigaction sa;
+	int i;
+
+	for (i = 0; i < portCount; i++) {
+		if (enableStats(&conns[i]) < 0) {
+			printf("Out of memory enabling statistics.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = statsSignalHandler;
+	sigaction(SIGUSR1, &sa, NULL);
+}
+
+/*
+ * Close all open ports, printing their statistics if collected
+ */
+void closePorts() {
+	int i;
+	flushOutput(&output);
+	if (graphiteHost) closeGraphiteSender(&graphite);
+	closeLog(&ringLog);
+	closeShm(&shm);
+	closeCapture(&capture);
+	for (i = 0; i < portCount; i++) {
+		if (conns[i].stats) {
+			printStats(&conns[i], stderr);
+			freeStats(&conns[i]);
+		}
+		if (conns[i].agg) freeAggregator(conns[i].agg);
+		closeDelta(&conns[i]);
+		closeSerialPort(&conns[i]);
+	}
+}
+
+/*
+ * Read and print a list of registers from every port. Several ports are
+ * polled concurrently
+ */
+void readRegisters(uint16_t* regs, uint16_t count) {
+	uint16_t i;
+
+	if (portCount > 1) {
+		runPoller(conns, portCount, regs, count);
+		return;
+	}
+	for (i = 0; i < count; i++) printRegister(&conns[0], regs[i]);
+}
+
+/*
+ * Parse the rows for watch_display, all or a comma separated list of rows
+ * Returns the rows as a bitmask, or 0 if invalid
+ */
+uint8_t parseDisplayRows(char* text) {
+	uint8_t rows = 0;
+
+	if (strcmp(text, "all") == 0) return (1 << REGO_DISPLAY_ROWS) - 1;
+	for (; *text; text++) {
+		if (*text >= '0' && *text < '0' + REGO_DISPLAY_ROWS) rows |= 1 << (*text - '0');
+		else if (*text != ',') return 0;
+	}
+	return rows;
+}
+
+/*
+ * Parse a query_log time, a Unix time or now, optionally followed by an offset
+ * in seconds
+ */
+uint32_t parseLogTime(char* text) {
+	if (strncmp(text, "now", 3) == 0) return time(NULL) + strtol(text + 3, NULL, 0);
+	return strtoul(text, NULL, 0);
+}
+
+/*
+ * Print the logged samples of a register from one time up to and including
+ * another. Only the records in the time window are read
+ */
+void queryLog(uint16_t reg, uint32_t from, uint32_t to) {
+	regoLogRecord* record;
+	uint64_t i, first, end;
+	int16_t id = getRegisterIdByAddress(reg);
+
+	getLogRange(&ringLog, &first, &end);
+	for (i = findLogTime(&ringLog, from); i < end; i++) {
+		record = getLogRecord(&ringLog, i);
+		if (record->time > to) break;
+		if (record->address == reg) addOutputSample(&output, "", reg, id, record->status, record->value, record->time);
+	}
+}
+
+/*
+ * Print the latest published value of a register, or of all registers read
+ * so far if which is all, from the shared snapshot
+ * Returns 0 on success, -1 on failure
+ */
+int readShm(char* which) {
+	regoShmEntry* entries = malloc(shm.capacity * sizeof(regoShmEntry));
+	int count, i;
+	uint16_t reg = 0;
+	uint8_t all = strcmp(which, "all") == 0, found = 0;
+
+	// Names are matched in the snapshot, as the publisher may use another map
+	if (!all && lookupRegister(which, &reg) < 0) reg = 0xffff;
+
+	if (entries == NULL) {
+		printf("Out of memory reading the shared snapshot.\n");
+		return -1;
+	}
+	count = readShmSnapshot(&shm, entries, shm.capacity);
+	if (count < 0) {
+		printf("The shared snapshot is being written without pause, is the publisher stuck?\n");
+		free(entries);
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		if (!all && entries[i].address != reg && strcmp(entries[i].name, which) != 0) continue;
+		found = 1;
+		if (entries[i].valueTime == 0) continue;
+		addOutputSeries(&output, "", entries[i].address, entries[i].name, entries[i].type, entries[i].value, entries[i].valueTime);
+	}
+	free(entries);
+	if (!all && !found) {
+		printf("Register %s is not in the shared snapshot.\n", which);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Print and count a response decoded by replay_capture
+ */
+void printReplayedResponse(uint64_t time, const regoCompletion* response, void* context) {
+	replayTally* tally = context;
+
+	if (response->status >= RESPONSE_INVALID_ADDRESS && response->status <= RESPONSE_OK) {
+		tally->count[response->status - RESPONSE_INVALID_ADDRESS]++;
+	}
+	if (tally->quiet) return;
+
+	printf("%llu.%06llu ", (unsigned long long) time / 1000000, (unsigned long long) time % 1000000);
+	if (response->command == COMMAND_READ_DISPLAY) printf("row%u ", response->reg);
+	else printf("%04x ", response->reg);
+	if (response->status != RESPONSE_OK) printf("%s\n", getResponseText(response->status));
+	else if (response->command == COMMAND_READ_DISPLAY) printf("ok %s", response->text);
+	else printf("ok %d\n", response->value);
+}
+
+/*
+ * Replay a capture file through the decoders, printing a summary to stderr
+ * Returns 0 on success, -1 on failure
+ */
+int replayCaptureFile(char* path, char* mode) {
+	replayTally tally;
+	struct timespec start, end;
+	int count;
+	int8_t status;
+
+	memset(&tally, 0, sizeof(tally));
+	if (strcmp(mode, "fast") != 0 && strcmp(mode, "timed") != 0 && strcmp(mode, "quiet") != 0) {
+		printf("Replay mode %s must be fast, timed or quiet.\n", mode);
+		return -1;
+	}
+	tally.quiet = strcmp(mode, "quiet") == 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	count = replayCapture(&conns[0], path, strcmp(mode, "timed") == 0, printReplayedResponse, &tally);
+	if (count < 0) return -1;
+	fflush(stdout);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	fprintf(stderr, "%d responses in %ld us:", count, (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_nsec - start.tv_nsec) / 1000);
+	for (status = RESPONSE_OK; status >= RESPONSE_INVALID_ADDRESS; status--) {
+		fprintf(stderr, " %u %s%s", tally.count[status - RESPONSE_INVALID_ADDRESS], getResponseText(status),
+			status > RESPONSE_INVALID_ADDRESS ? "," : "\n");
+	}
+	return 0;
 }
 
 int main (int argc, char **argv) {
   int c; /* Argument char */
 	int8_t retval; /* Heatpump return value */
 
+	initConnection(&conns[0]);
+
   while (1) {
     static struct option long_options[] = {
-			{"graphite-output", no_argument, &graphiteOutputFlag, 1},
-    	{"ignore-checksums", no_argument, &ignoreChecksumsFlag, 1},
-    	{"show-packets", no_argument, &showPacketsFlag, 1},
+			{"daemon", no_argument, &daemonFlag, 1},
+			{"socket", required_argument, 0, 's'},
+			{"schedule", no_argument, &scheduleFlag, 1},
+			{"batch", required_argument, 0, 'B'},
+			{"port", required_argument, 0, 'p'},
+			{"graphite-output", no_argument, &conns[0].graphiteOutputFlag, 1},
+			{"output", required_argument, 0, 'o'},
+			{"graphite-host", required_argument, 0, 'g'},
+			{"graphite-spool", required_argument, 0, 'S'},
+    	{"ignore-checksums", no_argument, &conns[0].ignoreChecksumsFlag, 1},
+    	{"show-packets", no_argument, &conns[0].showPacketsFlag, 1},
+    	{"show-timing", no_argument, &conns[0].showTimingFlag, 1},
+    	{"timeout", required_argument, 0, 't'},
+    	{"retries", required_argument, 0, 'r'},
+    	{"profiles", required_argument, 0, 'P'},
+    	{"max-age", required_argument, 0, 'a'},
+    	{"delta", required_argument, 0, 'd'},
+    	{"stats", no_argument, &statsFlag, 1},
+    	{"aggregate", required_argument, 0, 'A'},
+    	{"register-map", required_argument, 0, 'm'},
+    	{"log", required_argument, 0, 'l'},
+    	{"log-size", required_argument, 0, 'L'},
+    	{"shm", required_argument, 0, 'M'},
+    	{"capture", required_argument, 0, 'C'},
+    	{"hook", required_argument, 0, 'h'},
+    	{"hook-rate", required_argument, 0, 'R'},
+    	{"debounce", required_argument, 0, 'b'},
       {0, 0, 0, 0}
     };
     /* getopt_long stores the option index here. */
@@ -51,6 +481,125 @@ int main (int argc, char **argv) {
       //if (long_options[option_index].flag != 0) break;
       break;
 
+    case 'B':
+      batchPath = optarg;
+      break;
+
+    case 'p':
+      if (portCount == REGO_MAX_PORTS) {
+        printf("At most %d ports can be given.\n", REGO_MAX_PORTS);
+        exit(EXIT_FAILURE);
+      }
+      portSpecs[portCount++] = optarg;
+      break;
+
+    case 's':
+      socketPath = optarg;
+      break;
+
+    case 'o':
+      outputFormat = getOutputFormatByName(optarg);
+      if (outputFormat < 0) {
+        printf("Invalid output format %s.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+    case 'g':
+      graphiteHost = optarg;
+      outputFormat = OUTPUT_GRAPHITE;
+      break;
+
+    case 'S':
+      graphiteSpool = optarg;
+      break;
+
+    case 't':
+      conns[0].responseTimeout = strtol(optarg, NULL, 0);
+      if (conns[0].responseTimeout <= 0) {
+        printf("Invalid timeout %s.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      timeoutGiven = 1;
+      break;
+
+    case 'P':
+      profilePath = optarg;
+      break;
+
+    case 'a':
+      conns[0].cacheMaxAge = strtol(optarg, NULL, 0);
+      if (conns[0].cacheMaxAge < 0) {
+        printf("Invalid maximum age %s.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+    case 'd':
+      conns[0].deltaKeyframe = strtol(optarg, NULL, 0);
+      if (conns[0].deltaKeyframe < 0) {
+        printf("Invalid keyframe interval %s.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      if (conns[0].deltaKeyframe == 0) conns[0].deltaKeyframe = REGO_DELTA_KEYFRAME;
+      break;
+
+    case 'A':
+      aggregateWindows = optarg;
+      break;
+
+    case 'm':
+      registerMapPath = optarg;
+      break;
+
+    case 'l':
+      logPath = optarg;
+      break;
+
+    case 'L':
+      logSize = strtol(optarg, NULL, 0);
+      if (logSize < 2 * REGO_LOG_BATCH_RECORDS || logSize > REGO_LOG_MAX_RECORDS) {
+        printf("Invalid log size %s, must be %d to %d records.\n", optarg, 2 * REGO_LOG_BATCH_RECORDS, REGO_LOG_MAX_RECORDS);
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+    case 'M':
+      shmName = optarg;
+      break;
+
+    case 'C':
+      capturePath = optarg;
+      break;
+
+    case 'h':
+      hookCommand = optarg;
+      break;
+
+    case 'R':
+      hookRate = strtol(optarg, NULL, 0);
+      if (hookRate > REGO_WATCH_HOOK_RATE_MAX) {
+        printf("Invalid hook rate %s, must be 0 to %d per minute.\n", optarg, REGO_WATCH_HOOK_RATE_MAX);
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+    case 'b':
+      debounce = strtol(optarg, NULL, 0);
+      if (debounce > REGO_WATCH_DEBOUNCE_MAX) {
+        printf("Invalid debounce time %s, must be 0 to %d ms.\n", optarg, REGO_WATCH_DEBOUNCE_MAX);
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+    case 'r':
+      conns[0].maxRetries = strtol(optarg, NULL, 0);
+      if (conns[0].maxRetries < 0) {
+        printf("Invalid retry count %s.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+
     case '?':
       /* getopt_long already printed an error message. */
       break;
@@ -61,29 +610,166 @@ int main (int argc, char **argv) {
   }
 
   /* Parse the action commands following the options */
-  if (optind == argc) {
+  if (optind == argc && !daemonFlag && !batchPath) {
     printUsage(argv[0]);
 		exit(0);
   }
 
-  openSerialPort();
+	// Register IDs depend on the map, so it is loaded before anything uses them
+	if (registerMapPath && loadRegisterMap(registerMapPath) < 0) exit(EXIT_FAILURE);
+	if (aggregateWindows) {
+		retval = initAggregator(&aggregators[0], aggregateWindows);
+		if (retval < 0) {
+			if (retval == -1) printf("Invalid aggregation windows %s, give up to %d lengths in seconds.\n", aggregateWindows, REGO_AGG_MAX_WINDOWS);
+			else printf("Out of memory setting up aggregation.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// Graphite output also limits sweeps to the registers flagged for it
+	if (conns[0].graphiteOutputFlag) outputFormat = OUTPUT_GRAPHITE;
+	conns[0].graphiteOutputFlag = outputFormat == OUTPUT_GRAPHITE;
+	initOutput(&output, outputFormat);
+	if (graphiteHost) {
+		if (initGraphiteSender(&graphite, graphiteHost, graphiteSpool) < 0) {
+			printf("Graphite host or spool path too long.\n");
+			exit(EXIT_FAILURE);
+		}
+		output.graphite = &graphite;
+	}
+	conns[0].output = &output;
+
+	if (portCount == 0) portSpecs[portCount++] = PORT_NAME;
+	if (daemonFlag && portCount > 1) {
+		printf("Daemon mode serves a single port.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (batchPath && (daemonFlag || optind < argc || portCount > 1)) {
+		printf("Batch mode runs on a single port, without --daemon or commands.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	portless = !daemonFlag && !batchPath && (strcmp("query_log", argv[optind]) == 0 || strcmp("read_shm", argv[optind]) == 0
+		|| strcmp("replay_capture", argv[optind]) == 0 || strcmp("print_register_map", argv[optind]) == 0);
+	if (logPath) {
+		if (portCount > 1 && !portless) {
+			printf("The log holds the samples of a single port.\n");
+			exit(EXIT_FAILURE);
+		}
+		if (openLog(&ringLog, logPath, logSize, !portless) < 0) exit(EXIT_FAILURE);
+		conns[0].log = &ringLog;
+	}
+	for (c = optind; portless && c < argc && !shmName; c++) {
+		if (strcmp("read_shm", argv[c]) == 0) shmName = REGO_SHM_DEFAULT_NAME;
+	}
+	if (shmName) {
+		if (portCount > 1 && !portless) {
+			printf("The shared snapshot holds the registers of a single port.\n");
+			exit(EXIT_FAILURE);
+		}
+		if (openShm(&shm, shmName, !portless) < 0) exit(EXIT_FAILURE);
+		if (!portless) conns[0].shm = &shm;
+	}
+
+	if (capturePath && !portless) {
+		if (portCount > 1) {
+			printf("A capture holds the frames of a single port.\n");
+			exit(EXIT_FAILURE);
+		}
+		if (openCapture(&capture, capturePath) < 0) exit(EXIT_FAILURE);
+		conns[0].capture = &capture;
+	}
+
+	if (!portless) openPorts();
+	if (statsFlag) enablePortStats();
+
+	if (daemonFlag) {
+		regoSchedule sched;
+		if (scheduleFlag && initSchedule(&sched, &conns[0]) < 0) {
+			printf("Out of memory creating poll schedule.\n");
+			exit(EXIT_FAILURE);
+		}
+		retval = runDaemon(&conns[0], socketPath, scheduleFlag ? &sched : NULL);
+		if (scheduleFlag) freeSchedule(&sched);
+		closePorts();
+		exit(retval < 0 ? EXIT_FAILURE : 0);
+	}
+
+	if (batchPath) {
+		int fd = strcmp(batchPath, "-") == 0 ? STDIN_FILENO : open(batchPath, O_RDONLY);
+		if (fd < 0) {
+			printf("Cannot open batch file %s: %s.\n", batchPath, strerror(errno));
+			closePorts();
+			exit(EXIT_FAILURE);
+		}
+		retval = runBatch(&conns[0], fd, stdout);
+		if (fd != STDIN_FILENO) close(fd);
+		closePorts();
+		exit(retval < 0 ? EXIT_FAILURE : 0);
+	}
 
 	/*
 	 * Main command interpreter loop - this is where the action happens!
    */
 	while (optind < argc) {
+		if (strcmp("print_register_map", argv[optind]) == 0) {
+
+			/*
+			 * Print the register map, e.g. as a starting point for a map file
+			 */
+			printRegisterMap(stdout);
+			optind++;
+			continue;
+
+		} else if (portless && strcmp("query_log", argv[optind]) != 0 && strcmp("read_shm", argv[optind]) != 0
+				&& strcmp("replay_capture", argv[optind]) != 0) {
+			printf("Command %s needs the port, give it before query_log, read_shm, replay_capture or print_register_map.\n", argv[optind]);
+			break;
+		}
+
     if (strcmp("show_display", argv[optind]) == 0) {
 
 			/*
 			 * Show display contents
 			 */
 			char text[170]; 			// 21 chars x 4 rows in UTF-8 = 170 bytes to be safe
-			retval = queryDisplay(text);
-			if (retval < 0) {
-				printf("Error %d querying display.\n", retval);
+			int i;
+			for (i = 0; i < portCount; i++) {
+				if (conns[i].tag[0]) printf("%s:\n", conns[i].tag);
+				retval = queryDisplay(&conns[i], text);
+				if (retval < 0) {
+					printf("Error %d querying display.\n", retval);
+					continue;
+				}
+				printf("%s", text);
+			}
+
+		} else if (strcmp("watch_display", argv[optind]) == 0) {
+
+			/*
+			 * Follow the display, printing the rows that change
+			 */
+			if (optind+2 >= argc) {
+				printf("Command %s requires two parameters.\n", argv[optind]);
 				break;
 			}
-                        printf("%s", text);
+			optind+=2;
+
+			uint8_t rows = parseDisplayRows(argv[optind-1]);
+			if (rows == 0) {
+				printf("Rows for %s must be all or a list of rows 0-%d.\n", argv[optind-2], REGO_DISPLAY_ROWS - 1);
+				break;
+			}
+			if (portCount > 1) {
+				printf("Command %s watches a single port.\n", argv[optind-2]);
+				break;
+			}
+			int interval = strtol(argv[optind], NULL, 0);
+			if (interval < 1 || interval > REGO_DISPLAY_INTERVAL_MAX) {
+				printf("Invalid interval %s, must be 1 to %d ms.\n", argv[optind], REGO_DISPLAY_INTERVAL_MAX);
+				break;
+			}
+			watchDisplay(&conns[0], rows, interval);
 
 		} else if (strcmp("read_register", argv[optind]) == 0) {
 			/*
@@ -95,30 +781,110 @@ int main (int argc, char **argv) {
 			}
 			optind++;
 
-			/* Try to find register by name from lookup table. */
-			int8_t id = getRegisterIdByName(argv[optind]);
+			/* Look up register by name or numeric address */
 			uint16_t reg;
-			if (id < 0) {
-				/* Not in lookup table, try instead to convert text to register address directly */					
-				reg = strtol(argv[optind], NULL, 0); 
-				if (reg == 0) {
-					printf("Parameter %s for %s could not be interpreted.\n", argv[optind], argv[optind-1]);
-					break;
-				}
-			} else {
-				/* Get register from lookup table */
-				reg = getRegisterAddressById(id);
+			if (lookupRegister(argv[optind], &reg) < 0) {
+				printf("Parameter %s for %s could not be interpreted.\n", argv[optind], argv[optind-1]);
+				break;
 			}
 
 			/* Print register contents */
-			printRegister(reg);
+			readRegisters(&reg, 1);
 
 		} else if (strcmp("read_known_registers", argv[optind]) == 0) {
 
 			/*
 			 * Print a list of all registers and their contents
 			 */
-			printKnownRegisters();
+			uint16_t* regs = malloc(getKnownRegisterCount() * sizeof(uint16_t));
+			uint16_t count = 0;
+			int16_t id;
+			if (regs == NULL) {
+				printf("Out of memory listing registers.\n");
+				break;
+			}
+			for (id = nextKnownRegister(&conns[0], -1); id >= 0; id = nextKnownRegister(&conns[0], id)) {
+				regs[count++] = getRegisterAddressById(id);
+			}
+			readRegisters(regs, count);
+			free(regs);
+
+		} else if (strcmp("run_schedule", argv[optind]) == 0 || strcmp("check_schedule", argv[optind]) == 0) {
+
+			/*
+			 * Poll registers according to the schedule, or report whether it fits
+			 */
+			regoSchedule sched;
+			if (initSchedule(&sched, &conns[0]) < 0) {
+				printf("Out of memory creating poll schedule.\n");
+				break;
+			}
+			if (strcmp("run_schedule", argv[optind]) == 0) {
+				runSchedule(&sched);
+			} else {
+				measureLinkCapacity(&sched, REGO_SCHED_CALIBRATION_SAMPLES);
+				printScheduleReport(&sched);
+			}
+			freeSchedule(&sched);
+
+		} else if (strcmp("calibrate", argv[optind]) == 0) {
+
+			/*
+			 * Find the fastest reliable serial settings and store them
+			 */
+			if (optind+1 == argc) {
+				printf("Command %s requires a parameter.\n", argv[optind]);
+				break;
+			}
+			optind++;
+
+			regoSerialProfile profile;
+			int reads = strtol(argv[optind], NULL, 0);
+			if (reads < 0 || reads > UINT16_MAX) {
+				printf("Invalid number of reads %s.\n", argv[optind]);
+				break;
+			}
+			if (portCount > 1) {
+				printf("Command %s tunes a single port.\n", argv[optind-1]);
+				break;
+			}
+			// Measure with the full timeout, not that of an earlier profile
+			if (!timeoutGiven) conns[0].responseTimeout = REGO_RESPONSE_TIMEOUT;
+			retval = calibratePort(&conns[0], reads ? reads : REGO_TUNE_READS, &profile, stdout);
+			if (retval < 0) {
+				printf("No reads on %s succeeded, check the port and the heatpump.\n", conns[0].portName);
+				break;
+			}
+			if (retval == 1) printf("No profile was reliable, using the one with the fewest errors.\n");
+			printf("%s baud=%u low_latency=%u gap=%u timeout=%u\n", conns[0].portName, profile.baud,
+				profile.lowLatency, profile.gap, profile.timeout);
+			if (saveSerialProfile(profilePath, conns[0].portName, &profile) < 0) break;
+
+		} else if (strcmp("watch_status", argv[optind]) == 0) {
+
+			/*
+			 * Follow the status flags, outputting their edges
+			 */
+			if (optind+1 == argc) {
+				printf("Command %s requires a parameter.\n", argv[optind]);
+				break;
+			}
+			optind++;
+
+			regoWatch watch;
+			uint32_t interval = strtoul(argv[optind], NULL, 0);
+			if (portCount > 1) {
+				printf("Command %s watches a single port.\n", argv[optind-1]);
+				break;
+			}
+			retval = initWatch(&watch, &conns[0], debounce, hookCommand, hookRate);
+			if (retval < 0) {
+				if (retval == -1) printf("The register map has no bool registers to watch.\n");
+				else printf("Out of memory setting up the status watch.\n");
+				break;
+			}
+			runWatch(&watch, interval ? interval : REGO_WATCH_INTERVAL);
+			freeWatch(&watch);
 
 		} else if (strcmp("read_reg_range", argv[optind]) == 0) {
 
@@ -131,7 +897,7 @@ int main (int argc, char **argv) {
 			}
 			optind+=2;
 
-			uint16_t reg, reg1, reg2;
+			uint16_t reg, reg1, reg2, regs[256], count = 0;
 			reg1 = strtol(argv[optind-1], NULL, 0);
 			reg2 = strtol(argv[optind], NULL, 0);
 			if ((reg1 >= reg2) || (reg1+0xff < reg2)) {
@@ -140,9 +906,95 @@ int main (int argc, char **argv) {
 			}
 
 			/* Print a list of all registers and their contents */
-			for (reg = reg1; reg <= reg2; reg++) {
-				printRegister(reg);
+			for (reg = reg1; reg <= reg2; reg++) regs[count++] = reg;
+			readRegisters(regs, count);
+
+		} else if (strcmp("scan_registers", argv[optind]) == 0) {
+
+			/*
+			 * Discover the registers that respond, and how their values vary
+			 */
+			if (optind+3 >= argc) {
+				printf("Command %s requires three parameters.\n", argv[optind]);
+				break;
+			}
+			optind+=3;
+
+			regoScan scan;
+			int passes = strtol(argv[optind-1], NULL, 0);
+			if (passes < 1 || passes > UINT16_MAX) {
+				printf("Invalid number of passes %s.\n", argv[optind-1]);
+				break;
+			}
+			if (portCount > 1) {
+				printf("Command %s scans a single port.\n", argv[optind-3]);
+				break;
+			}
+			retval = initScan(&scan, argv[optind-2], passes, argv[optind]);
+			if (retval < 0) break;
+			if (retval == 1) fprintf(stderr, "Resuming the scan in %s.\n", argv[optind]);
+
+			retval = runScan(&scan, &conns[0]);
+			if (retval == 1) fprintf(stderr, "Scan interrupted, run the same command to resume it.\n");
+			printScanMap(&scan, stdout);
+			freeScan(&scan);
+			if (retval != 0) break;
+
+		} else if (strcmp("query_log", argv[optind]) == 0) {
+
+			/*
+			 * Print logged samples of a register over a time window
+			 */
+			if (optind+3 >= argc) {
+				printf("Command %s requires three parameters.\n", argv[optind]);
+				break;
+			}
+			optind+=3;
+
+			uint16_t reg;
+			if (logPath == NULL) {
+				printf("Command %s requires --log.\n", argv[optind-3]);
+				break;
+			}
+			if (lookupRegister(argv[optind-2], &reg) < 0) {
+				printf("Parameter %s for %s could not be interpreted.\n", argv[optind-2], argv[optind-3]);
+				break;
+			}
+			queryLog(reg, parseLogTime(argv[optind-1]), parseLogTime(argv[optind]));
+
+		} else if (strcmp("read_shm", argv[optind]) == 0) {
+
+			/*
+			 * Print values from the snapshot published by another process
+			 */
+			if (optind+1 == argc) {
+				printf("Command %s requires a parameter.\n", argv[optind]);
+				break;
+			}
+			optind++;
+
+			if (!portless) {
+				printf("Command %s reads the snapshot of another process, give it first.\n", argv[optind-1]);
+				break;
+			}
+			if (readShm(argv[optind]) < 0) break;
+
+		} else if (strcmp("replay_capture", argv[optind]) == 0) {
+
+			/*
+			 * Decode the responses of a capture offline
+			 */
+			if (optind+2 >= argc) {
+				printf("Command %s requires two parameters.\n", argv[optind]);
+				break;
+			}
+			optind+=2;
+
+			if (!portless) {
+				printf("Command %s works offline, give it first.\n", argv[optind-2]);
+				break;
 			}
+			if (replayCaptureFile(argv[optind-1], argv[optind]) < 0) break;
 
 		} else {
 
@@ -150,10 +1002,12 @@ int main (int argc, char **argv) {
 
 		}
 
+		// One write of the whole sweep
+		flushOutput(&output);
 		optind++;
   }
 	
-  closeSerialPort();
+  closePorts();
 
 	exit(0);
 }
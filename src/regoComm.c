@@ -5,101 +5,186 @@
  */
 
 #include <stdio.h> /* For printf() etc */
+#include <stdlib.h> /* For strtol() */
+#include <string.h>
+#include <time.h>
+#include <unistd.h> /* For usleep() */
 
+#include <regoAggregate.h>
+#include <regoAsync.h>
 #include <regoComm.h>
+#include <regoLog.h>
+#include <regoOutput.h>
 #include <regoSerialIO.h>
+#include <regoShm.h>
+#include <regoStats.h>
 
 /*****************************************************************************
- * Defines
+ * Shared variables
  *****************************************************************************/
 
-#define REG_TYPE_UNKNOWN	0x0		// Value yet to be determined
-#define REG_TYPE_BOOL			0x1		// On = 1, Off = 0
-#define REG_TYPE_INT			0x2		// Integer value
-#define REG_TYPE_TEMP			0x3		// Temperature value in 0.1 degrees C
-#define REG_TYPE_FRAC			0x4		// Numeric value in 0.1 fractions
+// Built-in register map of the Rego 637, used unless another map is loaded
+registerLookupTable builtinRegisters[] = {
+	{0x0000,"setting_heat_curve","Inställning värmekurva",REG_TYPE_FRAC, 3600, REG_PRIO_SETTING},
+	{0x0001,"setting_heat_curve_adj","Inställning värmekurva justering",REG_TYPE_FRAC, 3600, REG_PRIO_SETTING}, // TBV
+	{0x0008,"setting_temp_adj-35","Kurvjustering vid -35 grader ute", REG_TYPE_TEMP, 3600, REG_PRIO_SETTING},
+	{0x000a,"setting_temp_adj-30","Kurvjustering vid -30 grader ute", REG_TYPE_TEMP, 3600, REG_PRIO_SETTING},
+	{0x000c,"setting_temp_adj-25","Kurvjustering vid -25 grader ute", REG_TYPE_TEMP, 3600, REG_PRIO_SETTING},
+	{0x000e,"setting_temp_adj-20","Kurvjustering vid -20 grader ute", REG_TYPE_TEMP, 3600, REG_PRIO_SETTING},
+	{0x0010,"setting_temp_adj-15","Kurvjustering vid -15 grader ute", REG_TYPE_TEMP, 3600, REG_PRIO_SETTING},
+	{0x0012,"setting_temp_adj-10","Kurvjustering vid -10 grader ute", REG_TYPE_TEMP, 3600, REG_PRIO_SETTING},
+	{0x0014,"setting_temp_adj-5","Kurvjustering vid -5 grader ute", REG_TYPE_TEMP, 3600, REG_PRIO_SETTING},
+	{0x0016,"setting_temp_adj-0","Kurvjustering vid 0 grader ute", REG_TYPE_TEMP, 3600, REG_PRIO_SETTING},
+	{0x0018,"setting_temp_adj+5","Kurvjustering vid +5 grader ute", REG_TYPE_TEMP, 3600, REG_PRIO_SETTING},
+	{0x001a,"setting_temp_adj+10","Kurvjustering vid +10 grader ute", REG_TYPE_TEMP, 3600, REG_PRIO_SETTING},
+	{0x001c,"setting_temp_adj+15","Kurvjustering vid +15 grader ute", REG_TYPE_TEMP, 3600, REG_PRIO_SETTING},
+	{0x001e,"setting_temp_adj+20","Kurvjustering vid +20 grader ute", REG_TYPE_TEMP, 3600, REG_PRIO_SETTING},
+	{0x0021,"setting_room_temp","Inställning rumstemperatur",REG_TYPE_TEMP, 3600, REG_PRIO_SETTING},
+	{0x0022,"setting_room_temp_effect","Inställning rumsgivarpåverkan",REG_TYPE_FRAC, 3600, REG_PRIO_SETTING}, // TBV
+	{0x002b,"control_gt3_target","Styrning GT3 målvärde",REG_TYPE_TEMP, 600, REG_PRIO_SETTING}, // TBV
+	{0x006c,"control_add_heat","Styrning tilläggsvärme %",REG_TYPE_FRAC, 600, REG_PRIO_SETTING}, // TBV
+	{0x006e,"control_gt1_target","Styrning GT1 målvärde",REG_TYPE_TEMP, 600, REG_PRIO_SETTING}, // TBV
+	{0x006f,"control_gt1_on","Styrning GT1 tillslag",REG_TYPE_TEMP, 600, REG_PRIO_SETTING}, // TBV
+	{0x0070,"control_gt1_off","Styrning GT1 frånslag",REG_TYPE_TEMP, 600, REG_PRIO_SETTING}, // TBV
+	{0x0073,"control_gt3_on","Styrning GT3 tillslag",REG_TYPE_TEMP, 600, REG_PRIO_SETTING}, // TBV
+	{0x0074,"control_gt3_off","Styrning GT3 frånslag",REG_TYPE_TEMP, 600, REG_PRIO_SETTING}, // TBV
+	{0x01fd,"status.p3GroundLoopPump","Status köldbärarpump (P3)",REG_TYPE_BOOL | REG_TYPE_GRAPHITE, 10, REG_PRIO_STATUS},
+	{0x01fe,"status.compressor","Status kompressor",REG_TYPE_BOOL | REG_TYPE_GRAPHITE, 10, REG_PRIO_STATUS},
+	{0x01ff,"status.addHeatStage1","Status elpatron 3kW",REG_TYPE_BOOL | REG_TYPE_GRAPHITE, 10, REG_PRIO_STATUS},
+	{0x0200,"status.addHeatStage2","Status elpatron 6kW",REG_TYPE_BOOL | REG_TYPE_GRAPHITE, 10, REG_PRIO_STATUS},
+	{0x0203,"status.p1RadiatorPump","Status radiatorpump (P1)",REG_TYPE_BOOL | REG_TYPE_GRAPHITE, 10, REG_PRIO_STATUS},
+	{0x0204,"status.p2HeatCarrierPump","Status värmebärarpump (P2)",REG_TYPE_BOOL | REG_TYPE_GRAPHITE, 10, REG_PRIO_STATUS},
+	{0x0205,"status.vxvThreeWayValve","Status trevägsventil (VXV)",REG_TYPE_BOOL | REG_TYPE_GRAPHITE, 10, REG_PRIO_STATUS},
+	{0x0206,"status.alarm","Status alarm",REG_TYPE_BOOL | REG_TYPE_GRAPHITE, 10, REG_PRIO_STATUS},
+	{0x0209,"sensors.temperature.gt1RadiatorReturn","Retur radiator (GT1)",REG_TYPE_TEMP | REG_TYPE_GRAPHITE, 15, REG_PRIO_SENSOR},
+	{0x020A,"sensors.temperature.gt2Outdoor","Utomhustemperatur (GT2)",REG_TYPE_TEMP | REG_TYPE_GRAPHITE, 60, REG_PRIO_SENSOR},
+	{0x020D,"sensors.temperature.gt5Room","Rumstemperatur (GT5)",REG_TYPE_TEMP | REG_TYPE_GRAPHITE, 60, REG_PRIO_SENSOR},
+  {0x020E,"sensors.temperature.gt6Compressor","Kompressortemperatur (GT6)",REG_TYPE_TEMP | REG_TYPE_GRAPHITE, 60, REG_PRIO_SENSOR},
+	{0x020F,"sensors.temperature.gt8HeatFluidOut","Temp. värmebärare ut (GT8)",REG_TYPE_TEMP | REG_TYPE_GRAPHITE, 15, REG_PRIO_SENSOR},
+	{0x0210,"sensors.temperature.gt9HeatFluidIn","Temp. värmebärare in (GT9)",REG_TYPE_TEMP | REG_TYPE_GRAPHITE, 15, REG_PRIO_SENSOR},
+	{0x0211,"sensors.temperature.gt10ColdFluidIn","Temp. köldbärare in (GT10)",REG_TYPE_TEMP | REG_TYPE_GRAPHITE, 60, REG_PRIO_SENSOR},
+	{0x0212,"sensors.temperature.gt11ColdFluidOut", "Temp. köldbärare ut (GT11)",REG_TYPE_TEMP | REG_TYPE_GRAPHITE, 60, REG_PRIO_SENSOR},
+	{0x0213,"sensors.temperature.gt3HotWater","Temp. varmvatten (GT3)",REG_TYPE_TEMP | REG_TYPE_GRAPHITE, 60, REG_PRIO_SENSOR}
+};
 
-#define REG_TYPE_MASK			0xf		// Mask for possible register types
-#define REG_TYPE_GRAPHITE	0x10	// Flag for inclusion in Graphite output
+#define BUILTIN_REGISTER_COUNT (int16_t) (sizeof(builtinRegisters)/sizeof(builtinRegisters[0]))
 
-#define GRAPHITE_PREFIX		"heatpump."		// Prefix for Graphite output
+// Active register map, set by setRegisterMap(). Register IDs index the table,
+// and the indexes hold the IDs sorted by address and by name for binary search
+const registerLookupTable* knownRegisters = builtinRegisters;
+int16_t knownRegisterCount = BUILTIN_REGISTER_COUNT;
+const int16_t* addressIndex = NULL;
+const int16_t* nameIndex = NULL;
 
-/*****************************************************************************
- * Shared variables
- *****************************************************************************/
-
-int graphiteOutputFlag = 0;				// Flag set by '--graphite'
-int ignoreChecksumsFlag = 0;			// Flag set by '--ignore-checksums'
-int showPacketsFlag = 0;					// Flag set by ‘--show-packets’
-
-typedef struct {
-	uint16_t address;		// Register address
-	char* name;					// Short name (for command line use, no spaces)
-	char* description;	// Description
-	int type;						// See #define REG_TYPE_*. Used to guide interpretation
-} registerLookupTable;
-
-registerLookupTable knownRegisters[] = {
-	{0x0000,"setting_heat_curve","Inställning värmekurva",REG_TYPE_FRAC},
-	{0x0001,"setting_heat_curve_adj","Inställning värmekurva justering",REG_TYPE_FRAC}, // TBV
-	{0x0008,"setting_temp_adj-35","Kurvjustering vid -35 grader ute", REG_TYPE_TEMP},
-	{0x000a,"setting_temp_adj-30","Kurvjustering vid -30 grader ute", REG_TYPE_TEMP},
-	{0x000c,"setting_temp_adj-25","Kurvjustering vid -25 grader ute", REG_TYPE_TEMP},
-	{0x000e,"setting_temp_adj-20","Kurvjustering vid -20 grader ute", REG_TYPE_TEMP},
-	{0x0010,"setting_temp_adj-15","Kurvjustering vid -15 grader ute", REG_TYPE_TEMP},
-	{0x0012,"setting_temp_adj-10","Kurvjustering vid -10 grader ute", REG_TYPE_TEMP},
-	{0x0014,"setting_temp_adj-5","Kurvjustering vid -5 grader ute", REG_TYPE_TEMP},
-	{0x0016,"setting_temp_adj-0","Kurvjustering vid 0 grader ute", REG_TYPE_TEMP},
-	{0x0018,"setting_temp_adj+5","Kurvjustering vid +5 grader ute", REG_TYPE_TEMP},
-	{0x001a,"setting_temp_adj+10","Kurvjustering vid +10 grader ute", REG_TYPE_TEMP},
-	{0x001c,"setting_temp_adj+15","Kurvjustering vid +15 grader ute", REG_TYPE_TEMP},
-	{0x001e,"setting_temp_adj+20","Kurvjustering vid +20 grader ute", REG_TYPE_TEMP},
-	{0x0021,"setting_room_temp","Inställning rumstemperatur",REG_TYPE_TEMP},
-	{0x0022,"setting_room_temp_effect","Inställning rumsgivarpåverkan",REG_TYPE_FRAC}, // TBV
-	{0x002b,"control_gt3_target","Styrning GT3 målvärde",REG_TYPE_TEMP}, // TBV
-	{0x006c,"control_add_heat","Styrning tilläggsvärme %",REG_TYPE_FRAC}, // TBV
-	{0x006e,"control_gt1_target","Styrning GT1 målvärde",REG_TYPE_TEMP}, // TBV
-	{0x006f,"control_gt1_on","Styrning GT1 tillslag",REG_TYPE_TEMP}, // TBV
-	{0x0070,"control_gt1_off","Styrning GT1 frånslag",REG_TYPE_TEMP}, // TBV
-	{0x0073,"control_gt3_on","Styrning GT3 tillslag",REG_TYPE_TEMP}, // TBV
-	{0x0074,"control_gt3_off","Styrning GT3 frånslag",REG_TYPE_TEMP}, // TBV
-	{0x01fd,"status.p3GroundLoopPump","Status köldbärarpump (P3)",REG_TYPE_BOOL | REG_TYPE_GRAPHITE},
-	{0x01fe,"status.compressor","Status kompressor",REG_TYPE_BOOL | REG_TYPE_GRAPHITE},
-	{0x01ff,"status.addHeatStage1","Status elpatron 3kW",REG_TYPE_BOOL | REG_TYPE_GRAPHITE},
-	{0x0200,"status.addHeatStage2","Status elpatron 6kW",REG_TYPE_BOOL | REG_TYPE_GRAPHITE},
-	{0x0203,"status.p1RadiatorPump","Status radiatorpump (P1)",REG_TYPE_BOOL | REG_TYPE_GRAPHITE},
-	{0x0204,"status.p2HeatCarrierPump","Status värmebärarpump (P2)",REG_TYPE_BOOL | REG_TYPE_GRAPHITE},
-	{0x0205,"status.vxvThreeWayValve","Status trevägsventil (VXV)",REG_TYPE_BOOL | REG_TYPE_GRAPHITE},
-	{0x0206,"status.alarm","Status alarm",REG_TYPE_BOOL | REG_TYPE_GRAPHITE},
-	{0x0209,"sensors.temperature.gt1RadiatorReturn","Retur radiator (GT1)",REG_TYPE_TEMP | REG_TYPE_GRAPHITE},
-	{0x020A,"sensors.temperature.gt2Outdoor","Utomhustemperatur (GT2)",REG_TYPE_TEMP | REG_TYPE_GRAPHITE},
-	{0x020D,"sensors.temperature.gt5Room","Rumstemperatur (GT5)",REG_TYPE_TEMP | REG_TYPE_GRAPHITE},
-  {0x020E,"sensors.temperature.gt6Compressor","Kompressortemperatur (GT6)",REG_TYPE_TEMP | REG_TYPE_GRAPHITE},
-	{0x020F,"sensors.temperature.gt8HeatFluidOut","Temp. värmebärare ut (GT8)",REG_TYPE_TEMP | REG_TYPE_GRAPHITE},
-	{0x0210,"sensors.temperature.gt9HeatFluidIn","Temp. värmebärare in (GT9)",REG_TYPE_TEMP | REG_TYPE_GRAPHITE},
-	{0x0211,"sensors.temperature.gt10ColdFluidIn","Temp. köldbärare in (GT10)",REG_TYPE_TEMP | REG_TYPE_GRAPHITE},
-	{0x0212,"sensors.temperature.gt11ColdFluidOut", "Temp. köldbärare ut (GT11)",REG_TYPE_TEMP | REG_TYPE_GRAPHITE},
-	{0x0213,"sensors.temperature.gt3HotWater","Temp. varmvatten (GT3)",REG_TYPE_TEMP | REG_TYPE_GRAPHITE}
-};
+// Indexes of the built-in map, sorted by buildRegisterIndex() on first use
+int16_t builtinAddressIndex[BUILTIN_REGISTER_COUNT];
+int16_t builtinNameIndex[BUILTIN_REGISTER_COUNT];
 
 /*****************************************************************************
  * Internal function declarations
  *****************************************************************************/
 
+int compareRegisterAddress(const registerLookupTable* table, int16_t a, int16_t b);
+int compareRegisterName(const registerLookupTable* table, int16_t a, int16_t b);
+void sortRegisterIds(const registerLookupTable* table, int16_t* ids, int16_t count, int (*compare)(const registerLookupTable*, int16_t, int16_t));
+regoCacheEntry* findCacheEntry(rego_conn* conn, uint16_t reg, uint8_t insert);
+
 /*****************************************************************************
  * Functions
  *****************************************************************************/
 
 /* --- Useful for translating between addresses, names and descriptions --- */
 
+/*
+ * Comparators of register IDs in a table, by address and by name
+ */
+int compareRegisterAddress(const registerLookupTable* table, int16_t a, int16_t b) {
+	return (int) table[a].address - table[b].address;
+}
+
+int compareRegisterName(const registerLookupTable* table, int16_t a, int16_t b) {
+	return strcmp(table[a].name, table[b].name);
+}
+
+/*
+ * Shell sort register IDs by a comparator. Unlike qsort(), the table is
+ * passed to the comparator, so several maps can be sorted at the same time
+ */
+void sortRegisterIds(const registerLookupTable* table, int16_t* ids, int16_t count, int (*compare)(const registerLookupTable*, int16_t, int16_t)) {
+	int16_t gap, i, j, id;
+
+	for (gap = count / 2; gap > 0; gap = gap == 2 ? 1 : gap * 5 / 11) {
+		for (i = gap; i < count; i++) {
+			id = ids[i];
+			for (j = i; j >= gap && compare(table, ids[j - gap], id) > 0; j -= gap) ids[j] = ids[j - gap];
+			ids[j] = id;
+		}
+	}
+}
+
+/*
+ * Fill in the IDs of a register table sorted by address and by name
+ */
+void sortRegisterIndex(const registerLookupTable* table, int16_t count, int16_t* byAddress, int16_t* byName) {
+	int16_t i;
+
+	for (i = 0; i < count; i++) {
+		byAddress[i] = i;
+		byName[i] = i;
+	}
+	sortRegisterIds(table, byAddress, count, compareRegisterAddress);
+	sortRegisterIds(table, byName, count, compareRegisterName);
+}
+
+/*
+ * Sort the indexes of the built-in register map. Done on the first lookup,
+ * call it up front when looking up registers from several threads
+ */
+void buildRegisterIndex() {
+	sortRegisterIndex(builtinRegisters, BUILTIN_REGISTER_COUNT, builtinAddressIndex, builtinNameIndex);
+	addressIndex = builtinAddressIndex;
+	nameIndex = builtinNameIndex;
+}
+
+/*
+ * Replace the register map with table, given with its sorted indexes, or go
+ * back to the built-in map if table is NULL. Register IDs change with the
+ * map, so this is done before any connection is set up
+ */
+void setRegisterMap(const registerLookupTable* table, int16_t count, const int16_t* byAddress, const int16_t* byName) {
+	if (table == NULL) {
+		knownRegisters = builtinRegisters;
+		knownRegisterCount = BUILTIN_REGISTER_COUNT;
+		buildRegisterIndex();
+		return;
+	}
+	knownRegisters = table;
+	knownRegisterCount = count;
+	addressIndex = byAddress;
+	nameIndex = byName;
+}
+
+/*
+ * Get the number of known registers, IDs run from 0 to one less
+ */
+int16_t getKnownRegisterCount() {
+	return knownRegisterCount;
+}
+
 /*
  * Get register ID given a certain name
  */
-int8_t getRegisterIdByName(char* name) {
-	int8_t i, len;
-	len = sizeof(knownRegisters)/sizeof(knownRegisters[0]);
-	for (i = 0; i < len; i++) {
-		if (strcmp(knownRegisters[i].name, name) == 0) return i;
+int16_t getRegisterIdByName(const char* name) {
+	int16_t low = 0, high = knownRegisterCount - 1, mid;
+	int cmp;
+
+	if (nameIndex == NULL) buildRegisterIndex();
+	while (low <= high) {
+		mid = low + (high - low) / 2;
+		cmp = strcmp(knownRegisters[nameIndex[mid]].name, name);
+		if (cmp == 0) return nameIndex[mid];
+		if (cmp < 0) low = mid + 1;
+		else high = mid - 1;
 	}
 	return -1; // No match found
 }
@@ -107,11 +192,15 @@ int8_t getRegisterIdByName(char* name) {
 /*
  * Get register ID given a certain address
  */
-int8_t getRegisterIdByAddress(uint16_t address) {
-	int8_t i, len;
-	len = sizeof(knownRegisters)/sizeof(knownRegisters[0]);
-	for (i = 0; i < len; i++) {
-		if (knownRegisters[i].address == address) return i;
+int16_t getRegisterIdByAddress(uint16_t address) {
+	int16_t low = 0, high = knownRegisterCount - 1, mid;
+
+	if (addressIndex == NULL) buildRegisterIndex();
+	while (low <= high) {
+		mid = low + (high - low) / 2;
+		if (knownRegisters[addressIndex[mid]].address == address) return addressIndex[mid];
+		if (knownRegisters[addressIndex[mid]].address < address) low = mid + 1;
+		else high = mid - 1;
 	}
 	return -1; // No match found
 }
@@ -119,58 +208,261 @@ int8_t getRegisterIdByAddress(uint16_t address) {
 /*
  * Get register Address from the lookup table, given a specific ID
  */
-uint16_t getRegisterAddressById(int8_t id) {
+uint16_t getRegisterAddressById(int16_t id) {
 	return knownRegisters[id].address;
 }
 
 /*
  * Get register Description from the lookup table, given a specific ID
  */
-char* getRegisterDescriptionById(int8_t id) {
+const char* getRegisterDescriptionById(int16_t id) {
 	return knownRegisters[id].description;
 }
 
 /*
  * Get register Name from the lookup table, given a specific ID
  */
-char* getRegisterNameById(int8_t id) {
+const char* getRegisterNameById(int16_t id) {
 	return knownRegisters[id].name;
 }
 
+/*
+ * Get register value type (REG_TYPE_*, without flags) from the lookup table, given a specific ID
+ */
+uint8_t getRegisterTypeById(int16_t id) {
+	return knownRegisters[id].type & REG_TYPE_MASK;
+}
+
+/*
+ * Check whether a register is flagged for Graphite output, given a specific ID
+ */
+uint8_t isGraphiteRegisterById(int16_t id) {
+	return (knownRegisters[id].type & REG_TYPE_GRAPHITE) != 0;
+}
+
+/*
+ * Get register poll interval (seconds) from the lookup table, given a specific ID
+ */
+uint16_t getRegisterIntervalById(int16_t id) {
+	return knownRegisters[id].interval;
+}
+
+/*
+ * Get register poll priority class from the lookup table, given a specific ID
+ */
+uint8_t getRegisterPriorityById(int16_t id) {
+	return knownRegisters[id].priority;
+}
+
+/*
+ * Get register address given a name from the lookup table or a numeric address
+ * Returns 0 on success, -1 if the text could not be interpreted
+ */
+int8_t lookupRegister(char* text, uint16_t* reg) {
+	/* Try to find register by name from lookup table. */
+	int16_t id = getRegisterIdByName(text);
+	if (id >= 0) {
+		*reg = getRegisterAddressById(id);
+		return 0;
+	}
+
+	/* Not in lookup table, try instead to convert text to register address directly */
+	*reg = strtol(text, NULL, 0);
+	return *reg == 0 ? -1 : 0;
+}
+
+/*
+ * Get a short text describing a RESPONSE_* status
+ */
+char* getResponseText(int8_t status) {
+	switch (status) {
+		case RESPONSE_OK:								return "ok";
+		case RESPONSE_TIMEOUT:					return "timeout";
+		case RESPONSE_CHECKSUM_ERROR:		return "checksum error";
+		case RESPONSE_INVALID_LENGTH:		return "invalid length";
+		case RESPONSE_INVALID_ADDRESS:	return "invalid address";
+		default:												return "unknown error";
+	}
+}
+
 /* --- Higher level communications functions towards heatpump --- */
 
 /*
- * Query for an integer value from the heatpump
+ * Delay (ms) before sending a request. Retries back off exponentially, and all
+ * requests are spaced out in proportion to the recent error rate so a noisy
+ * link is given time to settle. The request gap of the port's tuning profile
+ * is always kept after the last response
+ */
+uint32_t getRequestDelay(rego_conn* conn, uint8_t attempt) {
+	uint32_t delay = 0;
+	int64_t since;
+
+	if (attempt > 0) {
+		delay = REGO_RETRY_BACKOFF << (attempt - 1);
+		if (delay > REGO_RETRY_BACKOFF_MAX) delay = REGO_RETRY_BACKOFF_MAX;
+	}
+	if (conn->linkErrorRate > REGO_PACING_THRESHOLD) {
+		delay += (uint32_t) conn->linkErrorRate * REGO_PACING_MAX / 1000;
+	}
+	if (conn->requestGap > 0 && conn->lastReceive) {
+		since = monotonicMillis() - conn->lastReceive;
+		if (since < conn->requestGap && delay < conn->requestGap - since) delay = conn->requestGap - since;
+	}
+	return delay;
+}
+
+/*
+ * Fold the outcome of a transaction into the link error rate
+ */
+void updateLinkQuality(rego_conn* conn, int8_t retval) {
+	conn->linkErrorRate -= conn->linkErrorRate / REGO_LINK_QUALITY_WINDOW;
+	if (retval != RESPONSE_OK) conn->linkErrorRate += 1000 / REGO_LINK_QUALITY_WINDOW;
+}
+
+/*
+ * Get the moving average of failed transactions in 1/1000
+ */
+uint16_t getLinkErrorRate(rego_conn* conn) {
+	return conn->linkErrorRate;
+}
+
+/*
+ * Query for an integer value from the heatpump, waiting for the response
  * Note: For temperature sensors, the value is typically in 1/10 degrees
  */
-int8_t queryRegister(uint16_t reg, int16_t* value) {
-	int8_t retval;
+int8_t queryRegister(rego_conn* conn, uint16_t reg, int16_t* value) {
+	regoCompletion completion;
+	regoAsync async;
+
+	initAsync(&async, conn);
+	submitRegisterRead(&async, reg, NULL, NULL);
+	while (!takeCompletion(&async, &completion)) {
+		// A failing poll would never get to the timeout, give up instead
+		if (waitAsync(&async) < 0) return RESPONSE_TIMEOUT;
+	}
+
+	if (completion.status == RESPONSE_OK) *value = completion.value;
+	return completion.status;
+}
+
+/* --- Register cache --- */
+
+/*
+ * Find the cache slot of a register. Addresses are hashed into the table and
+ * probed linearly. If insert is set and the register is not cached, a free
+ * slot or else the oldest slot probed is returned for it
+ */
+regoCacheEntry* findCacheEntry(rego_conn* conn, uint16_t reg, uint8_t insert) {
+	regoCacheEntry* entry;
+	regoCacheEntry* victim = NULL;
+	uint16_t slot = (reg * 40503u) >> 4;		// Fibonacci hash spreads adjacent addresses
+	uint8_t i;
+
+	for (i = 0; i < REGO_CACHE_PROBES; i++) {
+		entry = &conn->cache[(slot + i) & (REGO_CACHE_SIZE - 1)];
+		if (entry->used && entry->address == reg) return entry;
+		if (!entry->used) {
+			if (victim == NULL || victim->used) victim = entry;
+		} else if (victim == NULL || (victim->used && entry->time < victim->time)) {
+			victim = entry;
+		}
+	}
+	return insert ? victim : NULL;
+}
 
-	buildPacket(DEVICE_HEATPUMP, COMMAND_READ_SYS_REG, reg, 0);
-	if (showPacketsFlag) { puts("Sending packet: "); prettyPrintPacket(); }
-	sendPacket();
-	receivePacket();
-	if (showPacketsFlag) { puts("Received packet: "); prettyPrintPacket(); }
+/*
+ * Default maximum age of a cached register value, by its priority class
+ */
+int32_t defaultCacheTTL(uint16_t reg) {
+	int16_t id = getRegisterIdByAddress(reg);
+	if (id >= 0 && getRegisterPriorityById(id) == REG_PRIO_SETTING) return REGO_CACHE_TTL_SETTING;
+	return REGO_CACHE_TTL_SENSOR;
+}
 
-	return decodeIntPacket(value);
+/*
+ * Store the outcome of a register read in the cache
+ */
+void updateRegisterCache(rego_conn* conn, uint16_t reg, int8_t status, int16_t value) {
+	regoCacheEntry* entry = findCacheEntry(conn, reg, 1);
+
+	entry->address = reg;
+	entry->value = value;
+	entry->status = status;
+	entry->used = 1;
+	entry->time = monotonicMillis();
+
+	if (conn->shm) publishShm(conn->shm, getRegisterIdByAddress(reg), status, value, time(NULL));
+}
+
+/*
+ * Look up a register in the cache without touching the port
+ * Returns the status of the cached read, with the value and its age in ms,
+ * or RESPONSE_TIMEOUT if the register is not cached
+ */
+int8_t getCachedRegister(rego_conn* conn, uint16_t reg, int16_t* value, int32_t* age) {
+	regoCacheEntry* entry = findCacheEntry(conn, reg, 0);
+
+	if (entry == NULL) return RESPONSE_TIMEOUT;
+	*value = entry->value;
+	*age = monotonicMillis() - entry->time;
+	return entry->status;
+}
+
+/*
+ * Get a register value from the cache if it was read successfully at most
+ * maxAge ms ago. REGO_CACHE_DEFAULT_AGE uses the default TTL of the register,
+ * and 0 never uses the cache
+ * Returns 1 if the cached value is fresh enough
+ */
+uint8_t getFreshRegister(rego_conn* conn, uint16_t reg, int16_t* value, int32_t maxAge) {
+	int32_t age;
+
+	if (maxAge < 0) maxAge = defaultCacheTTL(reg);
+	return maxAge > 0 && getCachedRegister(conn, reg, value, &age) == RESPONSE_OK && age <= maxAge;
+}
+
+/*
+ * Query for an integer value, using a cached value if one was read
+ * successfully at most maxAge ms ago, see getFreshRegister()
+ */
+int8_t queryRegisterCached(rego_conn* conn, uint16_t reg, int16_t* value, int32_t maxAge) {
+	if (getFreshRegister(conn, reg, value, maxAge)) return RESPONSE_OK;
+	return queryRegister(conn, reg, value);
+}
+
+/*
+ * Query for one row of the display, decoded with a trailing newline
+ * len = returned number of bytes, including the null terminator
+ */
+int8_t queryDisplayRow(rego_conn* conn, uint8_t row, char* text, uint8_t* len) {
+	regoCompletion completion;
+	regoAsync async;
+
+	initAsync(&async, conn);
+	submitDisplayRowRead(&async, row, NULL, NULL);
+	while (!takeCompletion(&async, &completion)) {
+		// A failing poll would never get to the timeout, give up instead
+		if (waitAsync(&async) < 0) return RESPONSE_TIMEOUT;
+	}
+
+	if (completion.status == RESPONSE_OK) {
+		memcpy(text, completion.text, completion.len);
+		*len = completion.len;
+	}
+	return completion.status;
 }
 
 /*
  * Query for the display
  */
-int8_t queryDisplay(char* text) {
+int8_t queryDisplay(rego_conn* conn, char* text) {
 	int8_t retval;
 	uint8_t i, pos = 0, len;
 
 	// Fetch all four rows
-	for (i = 0; i < 4; i++) {
-		buildPacket(DEVICE_HEATPUMP, COMMAND_READ_DISPLAY, i, 0);
-		if (showPacketsFlag) { puts("Sending packet: "); prettyPrintPacket(); }
-		sendPacket();
-		receivePacket();
-		if (showPacketsFlag) { puts("Received packet: "); prettyPrintPacket(); }
+	for (i = 0; i < REGO_DISPLAY_ROWS; i++) {
 		// Decode onto the receive buffer, separate with the length of each line
-		retval = decodeDisplayPacket(&len, text+pos);
+		retval = queryDisplayRow(conn, i, text+pos, &len);
 		if (retval != RESPONSE_OK) return retval;
 		pos += len-1; // -1 strips off null termination next loop
 	}
@@ -178,74 +470,161 @@ int8_t queryDisplay(char* text) {
 	return retval;
 }
 
+/*
+ * Poll the display forever, the rows selected in rows (bit n for row n) once
+ * every interval ms, and print the rows that changed with the time they were
+ * read. A row that can not be read is reported on stderr, once until it can
+ * be read again, and is then printed again
+ */
+void watchDisplay(rego_conn* conn, uint8_t rows, uint32_t interval) {
+	char last[REGO_DISPLAY_ROWS][REGO_DISPLAY_ROW_SIZE], text[REGO_DISPLAY_ROW_SIZE], line[REGO_OUTPUT_LINE_MAX];
+	uint8_t shown[REGO_DISPLAY_ROWS] = { 0 }, failed[REGO_DISPLAY_ROWS] = { 0 };
+	uint8_t format = conn->output ? conn->output->format : OUTPUT_HUMAN;
+	int8_t retval;
+	uint8_t row, len;
+	int64_t start, elapsed;
+	struct timespec now;
+
+	while (1) {
+		start = monotonicMillis();
+		for (row = 0; row < REGO_DISPLAY_ROWS; row++) {
+			if (!(rows & (1 << row))) continue;
+
+			retval = queryDisplayRow(conn, row, text, &len);
+			if (retval != RESPONSE_OK) {
+				if (!failed[row]) fprintf(stderr, "watchDisplay: row %u: %s\n", row, getResponseText(retval));
+				failed[row] = 1;
+				shown[row] = 0;
+				continue;
+			}
+			failed[row] = 0;
+			if (shown[row] && memcmp(text, last[row], len) == 0) continue;
+
+			memcpy(last[row], text, len);
+			shown[row] = 1;
+			text[len-2] = 0;
+			clock_gettime(CLOCK_REALTIME, &now);
+			fwrite(line, 1, formatDisplayRow(format, line, conn->tag, now.tv_sec, now.tv_nsec / 1000000, row, text), stdout);
+			fflush(stdout);
+		}
+
+		checkStatsDump(conn);
+		elapsed = monotonicMillis() - start;
+		if (elapsed < interval) usleep((interval - elapsed) * 1000);
+	}
+}
+
 /*
  * Wrapper around the queryRegister function that prints the results
  * 
  */
-int8_t printRegister(uint16_t reg) {
+int8_t printRegister(rego_conn* conn, uint16_t reg) {
 	int8_t retval; /* Heatpump return value */
-	int16_t value; /* Heatpump register value */
-
-	/* Query register value from heatpump */
-	retval = queryRegister(reg, &value);
-				
-	/* Check response */				
-	if (retval != RESPONSE_OK) {
-		/* Suppress errors for Graphite output */
-		if (!graphiteOutputFlag) printf("Error %d requesting register %04x.\n", retval, reg);
-		return retval;
-	}
-
-	/* Print info. Additional info if possible */
-	int8_t id = getRegisterIdByAddress(reg);
-	if (id < 0) {
-		/* Suppress Graphite output for unknown registers */
-		if (!graphiteOutputFlag) printf("%04x: %d\n", reg, value);
-	} else if (!graphiteOutputFlag) {
-		switch(knownRegisters[id].type & REG_TYPE_MASK) {
-			case REG_TYPE_BOOL:
-				printf("%s(%04x) - %s: %s\n", getRegisterNameById(id), reg,
-	            	getRegisterDescriptionById(id), value ? "ON" : "OFF");
-				break;
-			case REG_TYPE_TEMP:
-				printf("%s(%04x) - %s: %.1f degrees\n", getRegisterNameById(id), reg,
-	            	getRegisterDescriptionById(id), (float) value / 10);
-				break;
-			case REG_TYPE_FRAC:
-				printf("%s(%04x) - %s: %.1f\n", getRegisterNameById(id), reg,
-	            	getRegisterDescriptionById(id), (float) value / 10);
-				break;
-			default:	
-				printf("%s(%04x) - %s: %d\n", getRegisterNameById(id), reg,
-	            	getRegisterDescriptionById(id), value);				
-		}
-	} else {
-		switch(knownRegisters[id].type & REG_TYPE_MASK) {
-			case REG_TYPE_TEMP:
-			case REG_TYPE_FRAC:
-				printf("%s%s %.1f %u\n", GRAPHITE_PREFIX, getRegisterNameById(id), (float) value / 10, (unsigned)time(NULL));
-				break;
-			default:
-				printf("%s%s %d %u\n", GRAPHITE_PREFIX, getRegisterNameById(id), value, (unsigned)time(NULL));
-		}
+	int16_t value = 0; /* Heatpump register value */
+
+	/* Query register value from heatpump, unless read recently */
+	retval = queryRegisterCached(conn, reg, &value, conn->cacheMaxAge);
+	printRegisterValue(conn, reg, retval, value);
+	return retval;
+}
+
+/*
+ * Decide whether a value is worth outputting in delta mode: when it has moved
+ * past the deadband of its type since it was last output, or has not been
+ * output yet in the current keyframe period. Periods are aligned to the wall
+ * clock, so the first sweep of each period is a full keyframe. Errors, and
+ * registers not in the register map, are always output. The state is kept by
+ * register ID rather than in the cache, so evictions do not reset it
+ */
+uint8_t isDeltaChange(rego_conn* conn, int16_t id, int8_t retval, int16_t value) {
+	regoDeltaEntry* entry;
+	uint32_t keyframe = time(NULL) / conn->deltaKeyframe;
+	int16_t deadband;
+
+	if (retval != RESPONSE_OK || id < 0) return 1;
+	if (conn->delta == NULL) {
+		conn->delta = calloc(getKnownRegisterCount(), sizeof(regoDeltaEntry));
+		if (conn->delta == NULL) return 1;
+	}
+	entry = &conn->delta[id];
+
+	switch (getRegisterTypeById(id)) {
+		case REG_TYPE_TEMP: deadband = REGO_DELTA_DEADBAND_TEMP; break;
+		case REG_TYPE_FRAC: deadband = REGO_DELTA_DEADBAND_FRAC; break;
+		default: deadband = REGO_DELTA_DEADBAND_INT;
 	}
 
-	return RESPONSE_OK;
+	if (entry->emitted && entry->keyframe == keyframe && abs(value - entry->value) <= deadband) return 0;
+
+	entry->value = value;
+	entry->keyframe = keyframe;
+	entry->emitted = 1;
+	return 1;
 }
 
 /*
- * Print all known registers
+ * Free the delta mode state
  */
-void printKnownRegisters() {
-	int8_t i, len;
-	len = sizeof(knownRegisters)/sizeof(knownRegisters[0]);
-	for (i = 0; i < len; i++) {
-		if (!graphiteOutputFlag) {
-			printRegister(knownRegisters[i].address);
-		} else if (knownRegisters[i].type & REG_TYPE_GRAPHITE) {
-			/* For Graphite output, only include registers with flag set */
-			printRegister(knownRegisters[i].address);
-		}
+void closeDelta(rego_conn* conn) {
+	free(conn->delta);
+	conn->delta = NULL;
+}
+
+/*
+ * Print a register value, or the error retrieving it. Output is prefixed with
+ * the connection tag, if set, to tell samples from several heatpumps apart.
+ * Every sample goes to the ring log, if set. With aggregation, only the
+ * aggregates are output, at the end of each window. In delta mode, unchanged
+ * values are left out of the output. With an output sink the
+ * sample is buffered until the sink is flushed, otherwise it is printed right
+ * away in human or Graphite format
+ */
+void printRegisterValue(rego_conn* conn, uint16_t reg, int8_t retval, int16_t value) {
+	char line[REGO_OUTPUT_LINE_MAX];
+	regoSample sample;
+	int16_t id = getRegisterIdByAddress(reg);
+
+	if (conn->log) appendLog(conn->log, time(NULL), reg, retval, value);
+	if (conn->agg && conn->output) {
+		addAggregateSample(conn->agg, conn->output, conn->tag, time(NULL), id, retval, value);
+		return;
 	}
+	if (conn->deltaKeyframe > 0 && !isDeltaChange(conn, id, retval, value)) return;
+
+	if (conn->output) {
+		addOutputSample(conn->output, conn->tag, reg, id, retval, value, 0);
+		return;
+	}
+
+	sample.tag = conn->tag;
+	sample.address = reg;
+	sample.id = id;
+	sample.name = NULL;
+	sample.status = retval;
+	sample.value = value;
+	sample.time = time(NULL);
+	fwrite(line, 1, formatSample(conn->graphiteOutputFlag ? OUTPUT_GRAPHITE : OUTPUT_HUMAN, line, &sample), stdout);
 }
 
+/*
+ * Get the ID of the next known register to include in a sweep, starting
+ * after the given ID (-1 to start from the beginning)
+ * Returns -1 when there are no more registers
+ */
+int16_t nextKnownRegister(rego_conn* conn, int16_t id) {
+	for (id++; id < knownRegisterCount; id++) {
+		/* For Graphite output, only include registers with flag set */
+		if (!conn->graphiteOutputFlag || isGraphiteRegisterById(id)) return id;
+	}
+	return -1;
+}
+
+/*
+ * Print all known registers
+ */
+void printKnownRegisters(rego_conn* conn) {
+	int16_t id;
+	for (id = nextKnownRegister(conn, -1); id >= 0; id = nextKnownRegister(conn, id)) {
+		printRegister(conn, knownRegisters[id].address);
+	}
+}
@@ -0,0 +1,587 @@
+/*
+ * regoDaemon.c
+ *
+ * Long-running mode for the Rego637 heatpump client. Keeps the serial port open
+ * and locked, and serves requests from local clients over a Unix domain socket.
+ *
+ * The protocol is line based, one response line per request line:
+ *   read_register (address) [max age]  ->  OK (address) (value)
+ *   show_display             ->  OK display<TAB>(row 1)<TAB>...<TAB>(row 4)
+ * Failed requests are answered with ERR (reason). Register values read less
+ * than max age ms ago (default depending on the register) come from the cache.
+ *
+ * All serial transactions go through a single queue. A client has at most one
+ * request queued at a time, and a request identical to one already queued is
+ * attached to it rather than queued again, so concurrent readers of the same
+ * register share one serial transaction.
+ *
+ * With a poll schedule, the daemon also polls registers in the background.
+ * Client requests preempt the background polls: a scheduled poll only runs
+ * when no client request is queued.
+ *
+ * Batch mode takes the same request lines from a file or pipe instead, and
+ * also serves the requests that take several transactions:
+ *   read_reg_range (from) (to) [max age]
+ *   read_known_registers [max age]
+ * It answers each request with one line per register or display, then END.
+ * Reads that fail are answered with ERR (address) (reason).
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <regoComm.h>
+#include <regoDaemon.h>
+#include <regoOutput.h>
+#include <regoSched.h>
+#include <regoSerialIO.h>
+#include <regoStats.h>
+
+/*****************************************************************************
+ * Defines
+ *****************************************************************************/
+
+// Requests, as parsed by parseRequestLine()
+#define REQUEST_REGISTER					0
+#define REQUEST_DISPLAY						1
+#define REQUEST_RANGE							2
+#define REQUEST_KNOWN							3
+
+/*****************************************************************************
+ * Types
+ *****************************************************************************/
+
+typedef struct {
+	uint8_t type;												// REQUEST_*
+	uint16_t from;											// Register, or first register of a range
+	uint16_t to;												// Last register of a range
+	int32_t maxAge;											// Oldest cached value accepted (ms), -1 = per register
+} parsedRequest;
+
+typedef struct {
+	int fd;															// Socket, -1 if the slot is unused
+	char line[REGO_DAEMON_LINE_SIZE];		// Unprocessed input
+	uint8_t lineLen;
+	uint8_t pending;										// Waiting for a queued transaction
+} daemonClient;
+
+typedef struct {
+	uint8_t command;										// COMMAND_READ_SYS_REG or COMMAND_READ_DISPLAY
+	uint16_t reg;
+	int32_t maxAge;											// Oldest cached value all its requesters accept (ms)
+	uint32_t waiters;										// Bitmask of client slots waiting for the result
+} daemonRequest;
+
+typedef struct {
+	rego_conn* conn;
+	int listenFd;
+	daemonClient clients[REGO_DAEMON_MAX_CLIENTS];
+	daemonRequest queue[REGO_DAEMON_QUEUE_SIZE];
+	uint8_t queueHead;
+	uint8_t queueCount;
+} daemonState;
+
+/*****************************************************************************
+ * Shared variables
+ *****************************************************************************/
+
+// Set by the signal handler to leave the main loop
+volatile sig_atomic_t daemonStopFlag = 0;
+
+/*****************************************************************************
+ * Internal function declarations
+ *****************************************************************************/
+
+void daemonSignalHandler(int sig);
+const char* parseRequestLine(rego_conn* conn, char* line, parsedRequest* request);
+int openListenSocket(const char* socketPath);
+void acceptClients(daemonState* state);
+void closeClient(daemonState* state, uint8_t slot);
+void sendResponse(daemonState* state, uint8_t slot, const char* text);
+void enqueueRequest(daemonState* state, uint8_t slot, uint8_t command, uint16_t reg, int32_t maxAge);
+void handleRequestLine(daemonState* state, uint8_t slot, char* line);
+void processClientInput(daemonState* state, uint8_t slot);
+void readClient(daemonState* state, uint8_t slot);
+void runQueuedTransaction(daemonState* state);
+void answerRegister(rego_conn* conn, FILE* out, uint16_t reg, int32_t maxAge);
+void answerBatchRequest(rego_conn* conn, FILE* out, char* line);
+
+/*****************************************************************************
+ * Functions
+ *****************************************************************************/
+
+/*
+ * Stop the daemon on SIGINT/SIGTERM
+ */
+void daemonSignalHandler(int sig) {
+	daemonStopFlag = 1;
+}
+
+/*
+ * Parse a request line, which is split up in place
+ * Returns NULL with the request filled in, or the reason the line is invalid,
+ * which is empty for an empty line
+ */
+const char* parseRequestLine(rego_conn* conn, char* line, parsedRequest* request) {
+	char* command = strtok(line, " \t\r\n");
+	char* arg = strtok(NULL, " \t\r\n");
+	char* arg2 = strtok(NULL, " \t\r\n");
+	char* age = NULL;
+
+	if (command == NULL) return "";
+
+	request->maxAge = conn->cacheMaxAge;
+	if (strcmp("read_register", command) == 0) {
+		request->type = REQUEST_REGISTER;
+		if (arg == NULL || lookupRegister(arg, &request->from) < 0) return "invalid register";
+		request->to = request->from;
+		age = arg2;
+	} else if (strcmp("read_reg_range", command) == 0) {
+		request->type = REQUEST_RANGE;
+		if (arg == NULL || arg2 == NULL) return "invalid range";
+		request->from = strtol(arg, NULL, 0);
+		request->to = strtol(arg2, NULL, 0);
+		if (request->from >= request->to || request->from + 0xff < request->to) return "invalid range";
+		age = strtok(NULL, " \t\r\n");
+	} else if (strcmp("read_known_registers", command) == 0) {
+		request->type = REQUEST_KNOWN;
+		age = arg;
+	} else if (strcmp("show_display", command) == 0) {
+		request->type = REQUEST_DISPLAY;
+	} else {
+		return "invalid command";
+	}
+	if (age) request->maxAge = strtol(age, NULL, 0);
+	return NULL;
+}
+
+/*
+ * Create the listening Unix domain socket, replacing a stale socket file.
+ * Anything at the path that is not a socket is left alone, and a socket that
+ * another daemon still accepts on is not taken over
+ */
+int openListenSocket(const char* socketPath) {
+	struct sockaddr_un addr;
+	struct stat st;
+	int fd, probe;
+
+	if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "runDaemon: socket path %s too long\n", socketPath);
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("runDaemon: error creating socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socketPath);
+
+	if (lstat(socketPath, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			fprintf(stderr, "runDaemon: %s exists and is not a socket\n", socketPath);
+			close(fd);
+			return -1;
+		}
+		probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (probe >= 0 && connect(probe, (struct sockaddr*) &addr, sizeof(addr)) == 0) {
+			fprintf(stderr, "runDaemon: another daemon is listening on %s\n", socketPath);
+			close(probe);
+			close(fd);
+			return -1;
+		}
+		if (probe >= 0) close(probe);
+		unlink(socketPath);
+	}
+
+	if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(fd, REGO_DAEMON_MAX_CLIENTS) < 0) {
+		perror("runDaemon: error binding socket");
+		close(fd);
+		return -1;
+	}
+
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	return fd;
+}
+
+/*
+ * Accept all pending connections into free client slots
+ */
+void acceptClients(daemonState* state) {
+	uint8_t slot;
+	int fd;
+
+	while ((fd = accept(state->listenFd, NULL, NULL)) >= 0) {
+		for (slot = 0; slot < REGO_DAEMON_MAX_CLIENTS; slot++) {
+			if (state->clients[slot].fd < 0) break;
+		}
+		if (slot == REGO_DAEMON_MAX_CLIENTS) {
+			write(fd, "ERR too many clients\n", 21);
+			close(fd);
+			continue;
+		}
+
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		state->clients[slot].fd = fd;
+		state->clients[slot].lineLen = 0;
+		state->clients[slot].pending = 0;
+	}
+}
+
+/*
+ * Disconnect a client and withdraw it from any queued request
+ */
+void closeClient(daemonState* state, uint8_t slot) {
+	uint8_t i;
+
+	for (i = 0; i < state->queueCount; i++) {
+		state->queue[(state->queueHead + i) % REGO_DAEMON_QUEUE_SIZE].waiters &= ~(1UL << slot);
+	}
+	close(state->clients[slot].fd);
+	state->clients[slot].fd = -1;
+}
+
+/*
+ * Send a response line. Clients that do not keep up with their responses
+ * are disconnected rather than allowed to stall the daemon
+ */
+void sendResponse(daemonState* state, uint8_t slot, const char* text) {
+	size_t len = strlen(text);
+
+	if (write(state->clients[slot].fd, text, len) != (ssize_t) len) {
+		closeClient(state, slot);
+	}
+}
+
+/*
+ * Queue a transaction for a client, coalescing it with an identical one
+ * already in the queue. The merged request takes the smallest maximum age,
+ * so no client gets an older cached value than it asked for
+ */
+void enqueueRequest(daemonState* state, uint8_t slot, uint8_t command, uint16_t reg, int32_t maxAge) {
+	daemonRequest* request;
+	uint8_t i;
+
+	state->clients[slot].pending = 1;
+	if (command == COMMAND_READ_SYS_REG && maxAge < 0) maxAge = defaultCacheTTL(reg);
+
+	for (i = 0; i < state->queueCount; i++) {
+		request = &state->queue[(state->queueHead + i) % REGO_DAEMON_QUEUE_SIZE];
+		if (request->command == command && request->reg == reg) {
+			if (maxAge < request->maxAge) request->maxAge = maxAge;
+			request->waiters |= 1UL << slot;
+			return;
+		}
+	}
+
+	// Each client has at most one pending request, so the queue cannot overflow
+	request = &state->queue[(state->queueHead + state->queueCount++) % REGO_DAEMON_QUEUE_SIZE];
+	request->command = command;
+	request->reg = reg;
+	request->maxAge = maxAge;
+	request->waiters = 1UL << slot;
+}
+
+/*
+ * Parse a request line and queue it, or answer it directly if malformed
+ */
+void handleRequestLine(daemonState* state, uint8_t slot, char* line) {
+	parsedRequest request;
+	const char* error = parseRequestLine(state->conn, line, &request);
+	char response[64];
+
+	if (error && *error == 0) return;
+
+	// A client request is one transaction, so ranges are left to batch mode
+	if (error == NULL && (request.type == REQUEST_RANGE || request.type == REQUEST_KNOWN)) error = "invalid command";
+	if (error) {
+		snprintf(response, sizeof(response), "ERR %s\n", error);
+		sendResponse(state, slot, response);
+		return;
+	}
+
+	if (request.type == REQUEST_DISPLAY) {
+		enqueueRequest(state, slot, COMMAND_READ_DISPLAY, 0, 0);
+	} else {
+		enqueueRequest(state, slot, COMMAND_READ_SYS_REG, request.from, request.maxAge);
+	}
+}
+
+/*
+ * Handle complete lines in the client's input until a request is queued
+ */
+void processClientInput(daemonState* state, uint8_t slot) {
+	daemonClient* client = &state->clients[slot];
+	char* newline;
+	uint8_t len;
+
+	while (client->fd >= 0 && !client->pending) {
+		newline = memchr(client->line, '\n', client->lineLen);
+		if (newline == NULL) {
+			if (client->lineLen == sizeof(client->line)) {
+				client->lineLen = 0;
+				sendResponse(state, slot, "ERR line too long\n");
+			}
+			return;
+		}
+
+		*newline = 0;
+		len = newline - client->line + 1;
+		handleRequestLine(state, slot, client->line);
+		memmove(client->line, client->line + len, client->lineLen - len);
+		client->lineLen -= len;
+	}
+}
+
+/*
+ * Read available input from a client
+ */
+void readClient(daemonState* state, uint8_t slot) {
+	daemonClient* client = &state->clients[slot];
+	ssize_t n;
+
+	if (client->lineLen == sizeof(client->line)) return;
+	n = read(client->fd, client->line + client->lineLen, sizeof(client->line) - client->lineLen);
+	if (n <= 0) {
+		if (n < 0 && errno == EAGAIN) return;
+		closeClient(state, slot);
+		return;
+	}
+	client->lineLen += n;
+	processClientInput(state, slot);
+}
+
+/*
+ * Run the transaction at the head of the queue and answer everyone waiting for it
+ */
+void runQueuedTransaction(daemonState* state) {
+	daemonRequest request = state->queue[state->queueHead];
+	char text[170], response[200];
+	char* p;
+	int16_t value;
+	int8_t retval;
+	uint8_t slot;
+
+	state->queueHead = (state->queueHead + 1) % REGO_DAEMON_QUEUE_SIZE;
+	state->queueCount--;
+
+	// Everyone waiting has disconnected
+	if (request.waiters == 0) return;
+
+	if (request.command == COMMAND_READ_DISPLAY) {
+		retval = queryDisplay(state->conn, text);
+		if (retval == RESPONSE_OK) {
+			// One row per field, tab separated
+			for (p = text; *p; p++) {
+				if (*p == '\n') *p = p[1] ? '\t' : 0;
+			}
+			snprintf(response, sizeof(response), "OK display\t%s\n", text);
+		}
+	} else {
+		retval = queryRegisterCached(state->conn, request.reg, &value, request.maxAge);
+		if (retval == RESPONSE_OK) snprintf(response, sizeof(response), "OK %04x %d\n", request.reg, value);
+	}
+	if (retval != RESPONSE_OK) snprintf(response, sizeof(response), "ERR %s\n", getResponseText(retval));
+
+	for (slot = 0; slot < REGO_DAEMON_MAX_CLIENTS; slot++) {
+		if (!(request.waiters & (1UL << slot)) || state->clients[slot].fd < 0) continue;
+		state->clients[slot].pending = 0;
+		sendResponse(state, slot, response);
+		processClientInput(state, slot);
+	}
+}
+
+/*
+ * Serve clients on the socket until SIGINT or SIGTERM. The port must already
+ * be open, which also means the port lock is held for the daemon's lifetime.
+ * If sched is not NULL, registers are polled by it while no client is waiting
+ */
+int runDaemon(rego_conn* conn, const char* socketPath, regoSchedule* sched) {
+	struct pollfd pfds[REGO_DAEMON_MAX_CLIENTS + 1];
+	uint8_t slots[REGO_DAEMON_MAX_CLIENTS + 1];
+	struct sigaction sa;
+	daemonState state;
+	uint8_t slot, n, i;
+	int timeout;
+
+	memset(&state, 0, sizeof(state));
+	state.conn = conn;
+	for (slot = 0; slot < REGO_DAEMON_MAX_CLIENTS; slot++) state.clients[slot].fd = -1;
+
+	state.listenFd = openListenSocket(socketPath);
+	if (state.listenFd < 0) return -1;
+
+	// Interrupt poll() on termination, and survive clients hanging up mid-response
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = daemonSignalHandler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	while (!daemonStopFlag) {
+		checkStatsDump(conn);
+
+		pfds[0].fd = state.listenFd;
+		pfds[0].events = POLLIN;
+		n = 1;
+		for (slot = 0; slot < REGO_DAEMON_MAX_CLIENTS; slot++) {
+			if (state.clients[slot].fd < 0) continue;
+			pfds[n].fd = state.clients[slot].fd;
+			// Stop reading from clients whose input buffer is full until it drains
+			pfds[n].events = state.clients[slot].lineLen < REGO_DAEMON_LINE_SIZE ? POLLIN : 0;
+			slots[n++] = slot;
+		}
+
+		// Only block when there is no serial work queued, or until the next scheduled poll
+		timeout = state.queueCount ? 0 : (sched ? getScheduleWait(sched) : -1);
+		if (timeout != 0) {
+			flushOutput(conn->output);
+			fflush(stdout);
+		}
+		if (poll(pfds, n, timeout) < 0) {
+			if (errno == EINTR) continue;
+			perror("runDaemon: error in poll");
+			break;
+		}
+
+		if (pfds[0].revents & POLLIN) acceptClients(&state);
+		for (i = 1; i < n; i++) {
+			if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) readClient(&state, slots[i]);
+		}
+
+		if (state.queueCount) {
+			runQueuedTransaction(&state);
+		} else if (sched) {
+			runScheduledPoll(sched);
+		}
+	}
+
+	for (slot = 0; slot < REGO_DAEMON_MAX_CLIENTS; slot++) {
+		if (state.clients[slot].fd >= 0) close(state.clients[slot].fd);
+	}
+	close(state.listenFd);
+	unlink(socketPath);
+	return 0;
+}
+
+/*
+ * Read a register and write its batch response line
+ */
+void answerRegister(rego_conn* conn, FILE* out, uint16_t reg, int32_t maxAge) {
+	int16_t value;
+	int8_t retval = queryRegisterCached(conn, reg, &value, maxAge);
+
+	if (retval == RESPONSE_OK) fprintf(out, "OK %04x %d\n", reg, value);
+	else fprintf(out, "ERR %04x %s\n", reg, getResponseText(retval));
+}
+
+/*
+ * Run a batch request line, writing its response lines and END
+ */
+void answerBatchRequest(rego_conn* conn, FILE* out, char* line) {
+	parsedRequest request;
+	const char* error = parseRequestLine(conn, line, &request);
+	char text[170];
+	char* p;
+	int16_t id;
+	int8_t retval;
+	uint32_t reg;
+
+	if (error && *error == 0) return;
+
+	if (error) {
+		fprintf(out, "ERR %s\n", error);
+	} else if (request.type == REQUEST_DISPLAY) {
+		retval = queryDisplay(conn, text);
+		if (retval == RESPONSE_OK) {
+			for (p = text; *p; p++) {
+				if (*p == '\n') *p = p[1] ? '\t' : 0;
+			}
+			fprintf(out, "OK display\t%s\n", text);
+		} else {
+			fprintf(out, "ERR display %s\n", getResponseText(retval));
+		}
+	} else if (request.type == REQUEST_KNOWN) {
+		for (id = nextKnownRegister(conn, -1); id >= 0; id = nextKnownRegister(conn, id)) {
+			answerRegister(conn, out, getRegisterAddressById(id), request.maxAge);
+		}
+	} else {
+		for (reg = request.from; reg <= request.to; reg++) answerRegister(conn, out, reg, request.maxAge);
+	}
+	fputs("END\n", out);
+}
+
+/*
+ * Run the requests read from fd, one per line, on the open port until end of
+ * input or SIGINT/SIGTERM. Responses are written to out, which is flushed
+ * whenever all requests read so far are answered, so a script driving this
+ * as a coprocess gets each response as soon as it is complete
+ * Returns 0 at end of input, -1 on error
+ */
+int runBatch(rego_conn* conn, int fd, FILE* out) {
+	char line[REGO_DAEMON_LINE_SIZE];
+	struct sigaction sa;
+	size_t len = 0, used;
+	uint8_t skip = 0;
+	char* newline;
+	ssize_t n;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = daemonSignalHandler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	while (!daemonStopFlag) {
+		newline = memchr(line, '\n', len);
+		if (newline == NULL) {
+			if (len == sizeof(line)) {
+				if (!skip) fputs("ERR line too long\nEND\n", out);
+				skip = 1;
+				len = 0;
+			}
+
+			// Answers go out before waiting for more requests
+			checkStatsDump(conn);
+			if (fflush(out) == EOF) {
+				perror("runBatch: error writing responses");
+				return -1;
+			}
+			n = read(fd, line + len, sizeof(line) - len);
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				perror("runBatch: error reading requests");
+				return -1;
+			}
+			if (n == 0) {
+				// A last line without a newline is still run
+				if (len == 0) break;
+				line[len] = '\n';
+				n = 1;
+			}
+			len += n;
+			continue;
+		}
+
+		*newline = 0;
+		used = newline - line + 1;
+		if (!skip) answerBatchRequest(conn, out, line);
+		skip = 0;
+		memmove(line, line + used, len - used);
+		len -= used;
+	}
+	fflush(out);
+	return 0;
+}
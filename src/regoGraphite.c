@@ -0,0 +1,262 @@
+/*
+ * regoGraphite.c
+ *
+ * Graphite plaintext protocol sender. A sweep of register samples is written
+ * in a single call, over a connection to the carbon server that is kept open
+ * between sweeps. Sweeps that cannot be delivered are spooled to a bounded
+ * file and replayed once the server can be reached again.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>					/* For getaddrinfo() */
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <regoGraphite.h>
+#include <regoSerialIO.h>
+
+/*****************************************************************************
+ * Internal function declarations
+ *****************************************************************************/
+
+int connectGraphite(graphiteSender* sender);
+int sendGraphite(graphiteSender* sender, const char* data, uint32_t len);
+int replaySpoolFile(graphiteSender* sender, const char* path);
+void cutSpoolFile(int fd, off_t offset);
+void spoolSweep(graphiteSender* sender, const char* data, uint32_t len);
+
+/*****************************************************************************
+ * Functions
+ *****************************************************************************/
+
+/*
+ * Set up a sender for target, given as host or host:port. If spoolPath is not
+ * NULL, sweeps are spooled there during outages. Nothing is connected until
+ * the first sweep is sent
+ * Returns 0 on success, -1 if the target or path is too long
+ */
+int initGraphiteSender(graphiteSender* sender, const char* target, const char* spoolPath) {
+	const char* colon = strrchr(target, ':');
+	size_t hostLen = colon ? (size_t) (colon - target) : strlen(target);
+
+	memset(sender, 0, sizeof(*sender));
+	sender->fd = -1;
+	sender->retryInterval = REGO_GRAPHITE_RETRY;
+	sender->spoolMax = REGO_GRAPHITE_SPOOL_MAX;
+
+	if (hostLen >= sizeof(sender->host) || (colon && strlen(colon + 1) >= sizeof(sender->port))) return -1;
+	if (spoolPath && strlen(spoolPath) >= sizeof(sender->spoolPath)) return -1;
+
+	memcpy(sender->host, target, hostLen);
+	strcpy(sender->port, colon ? colon + 1 : REGO_GRAPHITE_DEFAULT_PORT);
+	if (spoolPath) strcpy(sender->spoolPath, spoolPath);
+	return 0;
+}
+
+/*
+ * Close the connection to the server. It is reopened by the next sweep
+ */
+void closeGraphiteSender(graphiteSender* sender) {
+	if (sender->fd >= 0) close(sender->fd);
+	sender->fd = -1;
+}
+
+/*
+ * Make sure there is a live connection to the server. A connection the server
+ * has closed shows up as readable, since carbon never sends anything
+ * Returns 0 when connected, -1 if not, also while waiting to retry
+ */
+int connectGraphite(graphiteSender* sender) {
+	struct addrinfo hints, *res, *ai;
+	struct pollfd pfd;
+	struct timeval tv;
+	socklen_t errLen;
+	int err, fd = -1;
+
+	if (sender->fd >= 0) {
+		pfd.fd = sender->fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 0) == 0) return 0;
+		closeGraphiteSender(sender);
+	}
+	if (monotonicMillis() < sender->retryAt) return -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	err = getaddrinfo(sender->host, sender->port, &hints, &res);
+	if (err != 0) {
+		fprintf(stderr, "sendGraphiteSweep: cannot resolve %s: %s\n", sender->host, gai_strerror(err));
+		sender->retryAt = monotonicMillis() + sender->retryInterval;
+		return -1;
+	}
+
+	// Connect without blocking for longer than the connect timeout
+	for (ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd < 0) continue;
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+
+		err = connect(fd, ai->ai_addr, ai->ai_addrlen) < 0 ? errno : 0;
+		if (err == EINPROGRESS) {
+			pfd.fd = fd;
+			pfd.events = POLLOUT;
+			err = ETIMEDOUT;
+			errLen = sizeof(err);
+			if (poll(&pfd, 1, REGO_GRAPHITE_CONNECT_TIMEOUT) == 1) getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errLen);
+		}
+		if (err != 0) {
+			errno = err;
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+
+	if (fd < 0) {
+		fprintf(stderr, "sendGraphiteSweep: cannot connect to %s:%s: %s\n", sender->host, sender->port, strerror(errno));
+		sender->retryAt = monotonicMillis() + sender->retryInterval;
+		return -1;
+	}
+
+	// Blocking writes from here on, bounded by the send timeout
+	fcntl(fd, F_SETFL, 0);
+	tv.tv_sec = REGO_GRAPHITE_SEND_TIMEOUT / 1000;
+	tv.tv_usec = REGO_GRAPHITE_SEND_TIMEOUT % 1000 * 1000;
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	sender->fd = fd;
+	return 0;
+}
+
+/*
+ * Write all of data to the server, dropping the connection on failure
+ * Returns 0 on success, -1 on failure
+ */
+int sendGraphite(graphiteSender* sender, const char* data, uint32_t len) {
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(sender->fd, data, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "sendGraphiteSweep: error sending to %s:%s: %s\n", sender->host, sender->port, strerror(errno));
+			closeGraphiteSender(sender);
+			return -1;
+		}
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Send the contents of a spool file and remove it. It is sent in chunks of
+ * whole lines, and if a chunk fails the ones delivered before it are cut from
+ * the file, so only that chunk is sent again after reconnecting
+ * Returns 0 on success or if there is no such file, -1 on failure
+ */
+int replaySpoolFile(graphiteSender* sender, const char* path) {
+	char chunk[4096];
+	off_t delivered = 0;
+	ssize_t n, held = 0, len;
+	int fd = open(path, O_RDWR);
+
+	if (fd < 0) return errno == ENOENT ? 0 : -1;
+	while ((n = read(fd, chunk + held, sizeof(chunk) - held)) > 0 || held > 0) {
+		if (n > 0) held += n;
+
+		// Up to the last complete line, unless a line fills the whole chunk or
+		// the file ends without a newline
+		for (len = held; len > 0 && chunk[len - 1] != '\n'; len--);
+		if (len == 0 && n > 0 && held < (ssize_t) sizeof(chunk)) continue;
+		if (len == 0) len = held;
+
+		if (sendGraphite(sender, chunk, len) < 0) {
+			cutSpoolFile(fd, delivered);
+			close(fd);
+			return -1;
+		}
+		delivered += len;
+		held -= len;
+		memmove(chunk, chunk + len, held);
+	}
+	close(fd);
+	unlink(path);
+	return 0;
+}
+
+/*
+ * Drop the first offset bytes of an open spool file, keeping the rest
+ */
+void cutSpoolFile(int fd, off_t offset) {
+	char chunk[4096];
+	off_t from = offset, to = 0;
+	ssize_t n;
+
+	if (offset == 0) return;
+	while ((n = pread(fd, chunk, sizeof(chunk), from)) > 0) {
+		if (pwrite(fd, chunk, n, to) != n) {
+			perror("sendGraphiteSweep: error rewriting spool");
+			return;
+		}
+		from += n;
+		to += n;
+	}
+	if (ftruncate(fd, to) < 0) perror("sendGraphiteSweep: error rewriting spool");
+}
+
+/*
+ * Append a sweep to the spool. The spool is kept in two files, and
+ * when the current one reaches half the bound it replaces the older one, so
+ * the oldest sweeps are dropped once the bound is reached
+ */
+void spoolSweep(graphiteSender* sender, const char* data, uint32_t len) {
+	char oldPath[REGO_GRAPHITE_PATH_SIZE + 2];
+	struct stat st;
+	int fd;
+
+	if (sender->spoolPath[0] == 0) return;
+
+	fd = open(sender->spoolPath, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror("sendGraphiteSweep: error writing spool");
+		if (fd >= 0) close(fd);
+		return;
+	}
+	if (write(fd, data, len) != (ssize_t) len) {
+		// A short write would leave a truncated line for the replay
+		perror("sendGraphiteSweep: error writing spool");
+		if (ftruncate(fd, st.st_size) < 0) perror("sendGraphiteSweep: error rewriting spool");
+		close(fd);
+		return;
+	}
+
+	if (st.st_size + len >= sender->spoolMax / 2) {
+		snprintf(oldPath, sizeof(oldPath), "%s.1", sender->spoolPath);
+		rename(sender->spoolPath, oldPath);
+	}
+	close(fd);
+}
+
+/*
+ * Send a sweep to the server. Spooled sweeps are sent first, oldest first,
+ * so the server sees samples in order
+ * Returns 0 if the sweep was delivered, -1 if it was spooled or dropped
+ */
+int sendGraphiteSweep(graphiteSender* sender, const char* data, uint32_t len) {
+	char oldPath[REGO_GRAPHITE_PATH_SIZE + 2];
+
+	snprintf(oldPath, sizeof(oldPath), "%s.1", sender->spoolPath);
+	if (connectGraphite(sender) < 0
+			|| (sender->spoolPath[0] && (replaySpoolFile(sender, oldPath) < 0 || replaySpoolFile(sender, sender->spoolPath) < 0))
+			|| sendGraphite(sender, data, len) < 0) {
+		spoolSweep(sender, data, len);
+		return -1;
+	}
+	return 0;
+}
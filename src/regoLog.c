@@ -0,0 +1,273 @@
+/*
+ * regoLog.c
+ *
+ * Fixed-size ring log of register samples in a memory-mapped file. Records are
+ * appended in time order to the mapping and synced in batches, after which a
+ * new header marks them valid. Readers binary search the ring by time, so a
+ * query only touches the pages it needs.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>				/* For flock() */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <regoLog.h>
+#include <regoSerialIO.h>
+
+/*****************************************************************************
+ * Internal function declarations
+ *****************************************************************************/
+
+uint32_t logChecksum(regoLogHeader* header);
+int readLogHeader(regoLog* log);
+int writeLogHeader(regoLog* log);
+int syncLogRecords(regoLog* log, uint64_t from, uint64_t to);
+
+/*****************************************************************************
+ * Functions
+ *****************************************************************************/
+
+/*
+ * FNV-1a hash of the header fields before the checksum
+ */
+uint32_t logChecksum(regoLogHeader* header) {
+	const uint8_t* p = (const uint8_t*) header;
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < offsetof(regoLogHeader, checksum); i++) {
+		hash = (hash ^ p[i]) * 16777619u;
+	}
+	return hash;
+}
+
+/*
+ * Pick the newest valid header of the two slots
+ * Returns 0 on success, -1 if neither slot holds a valid header
+ */
+int readLogHeader(regoLog* log) {
+	regoLogHeader slot;
+	uint8_t i, found = 0;
+
+	for (i = 0; i < 2; i++) {
+		memcpy(&slot, log->map + i * REGO_LOG_HEADER_SIZE / 2, sizeof(slot));
+		if (memcmp(slot.magic, REGO_LOG_MAGIC, sizeof(REGO_LOG_MAGIC)) != 0 || slot.checksum != logChecksum(&slot)) continue;
+		if (!found || slot.sequence > log->header.sequence) log->header = slot;
+		found = 1;
+	}
+	return found ? 0 : -1;
+}
+
+/*
+ * Write the header to the older slot and sync it, never touching the newer
+ * one, so a torn write falls back to the previous header
+ * Returns 0 on success, -1 on failure
+ */
+int writeLogHeader(regoLog* log) {
+	log->header.sequence++;
+	log->header.head = log->head;
+	log->header.checksum = logChecksum(&log->header);
+
+	memcpy(log->map + (log->header.sequence % 2) * REGO_LOG_HEADER_SIZE / 2, &log->header, sizeof(log->header));
+	if (msync(log->map, REGO_LOG_HEADER_SIZE, MS_SYNC) < 0) {
+		perror("flushLog: error in msync");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Sync the pages holding records from up to, but not including, to
+ * Returns 0 on success, -1 on failure
+ */
+int syncLogRecords(regoLog* log, uint64_t from, uint64_t to) {
+	long pageSize = sysconf(_SC_PAGESIZE);
+	uint32_t first, last;
+	size_t start, end;
+
+	while (from < to) {
+		// The range is synced in at most two parts, split where the ring wraps
+		first = from % log->header.capacity;
+		last = to - from > log->header.capacity - first ? log->header.capacity : first + (to - from);
+
+		start = REGO_LOG_HEADER_SIZE + (size_t) first * sizeof(regoLogRecord);
+		end = REGO_LOG_HEADER_SIZE + (size_t) last * sizeof(regoLogRecord);
+		start -= start % pageSize;
+		if (msync(log->map + start, end - start, MS_SYNC) < 0) {
+			perror("flushLog: error in msync");
+			return -1;
+		}
+		from += last - first;
+	}
+	return 0;
+}
+
+/*
+ * Open the log at path, creating it with room for capacity records if it does
+ * not exist. The capacity of an existing log is kept. Only one process at a
+ * time can open a log for writing
+ * Returns 0 on success, -1 on failure
+ */
+int openLog(regoLog* log, const char* path, uint32_t capacity, uint8_t writable) {
+	struct stat st;
+	int flags = (writable ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC;
+
+	memset(log, 0, sizeof(*log));
+	log->writable = writable;
+	log->fd = open(path, flags, 0644);
+	if (log->fd < 0) {
+		fprintf(stderr, "openLog: cannot open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (writable && flock(log->fd, LOCK_EX | LOCK_NB) < 0) {
+		fprintf(stderr, "openLog: %s is in use by another process\n", path);
+		close(log->fd);
+		return -1;
+	}
+	if (fstat(log->fd, &st) < 0) goto fail;
+
+	// A new file gets the requested size. The slack of one batch keeps the
+	// records being written from overwriting records the header counts as valid
+	if (st.st_size == 0 && writable) {
+		if (capacity < 2 * REGO_LOG_BATCH_RECORDS) capacity = 2 * REGO_LOG_BATCH_RECORDS;
+		st.st_size = REGO_LOG_HEADER_SIZE + (off_t) capacity * sizeof(regoLogRecord);
+		if (ftruncate(log->fd, st.st_size) < 0) goto fail;
+	}
+	if (st.st_size < REGO_LOG_HEADER_SIZE) {
+		fprintf(stderr, "openLog: %s is not a log file\n", path);
+		goto close;
+	}
+
+	log->mapSize = st.st_size;
+	log->map = mmap(NULL, log->mapSize, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, log->fd, 0);
+	if (log->map == MAP_FAILED) {
+		log->map = NULL;
+		goto fail;
+	}
+
+	if (readLogHeader(log) < 0) {
+		// Only a file this function created is initialized
+		if (!writable || log->map[0] != 0 || log->map[REGO_LOG_HEADER_SIZE / 2] != 0) {
+			fprintf(stderr, "openLog: %s is not a log file\n", path);
+			goto close;
+		}
+		memcpy(log->header.magic, REGO_LOG_MAGIC, sizeof(REGO_LOG_MAGIC));
+		log->header.version = REGO_LOG_VERSION;
+		log->header.recordSize = sizeof(regoLogRecord);
+		log->header.capacity = (log->mapSize - REGO_LOG_HEADER_SIZE) / sizeof(regoLogRecord);
+		if (writeLogHeader(log) < 0) goto close;
+	}
+
+	if (log->header.version != REGO_LOG_VERSION || log->header.recordSize != sizeof(regoLogRecord)
+			|| log->header.capacity <= REGO_LOG_BATCH_RECORDS
+			|| REGO_LOG_HEADER_SIZE + (size_t) log->header.capacity * sizeof(regoLogRecord) > log->mapSize) {
+		fprintf(stderr, "openLog: %s has an unsupported format\n", path);
+		goto close;
+	}
+
+	log->head = log->header.head;
+	if (log->head > 0) log->lastTime = getLogRecord(log, log->head - 1)->time;
+	log->lastFlush = monotonicMillis();
+	return 0;
+
+fail:
+	fprintf(stderr, "openLog: error opening %s: %s\n", path, strerror(errno));
+close:
+	if (log->map) munmap(log->map, log->mapSize);
+	close(log->fd);
+	log->map = NULL;
+	log->fd = -1;
+	return -1;
+}
+
+/*
+ * Sync any pending records and close the log
+ */
+void closeLog(regoLog* log) {
+	if (log->map == NULL) return;
+	flushLog(log);
+	munmap(log->map, log->mapSize);
+	close(log->fd);
+	log->map = NULL;
+	log->fd = -1;
+}
+
+/*
+ * Append a sample. Times are kept non-decreasing, so a clock stepping back
+ * does not break the time order the queries rely on. The records are synced
+ * once a batch is full or the batch interval has passed
+ */
+void appendLog(regoLog* log, uint32_t time, uint16_t address, int8_t status, int16_t value) {
+	regoLogRecord* record;
+
+	if (log->map == NULL || !log->writable) return;
+
+	if (time < log->lastTime) time = log->lastTime;
+	log->lastTime = time;
+
+	record = (regoLogRecord*) (log->map + REGO_LOG_HEADER_SIZE) + log->head % log->header.capacity;
+	memset(record, 0, sizeof(*record));
+	record->time = time;
+	record->address = address;
+	record->status = status;
+	record->value = value;
+	log->head++;
+
+	if (log->head - log->header.head >= REGO_LOG_BATCH_RECORDS
+			|| monotonicMillis() - log->lastFlush >= REGO_LOG_BATCH_INTERVAL * 1000) {
+		flushLog(log);
+	}
+}
+
+/*
+ * Make the records appended since the last sync durable: sync them first,
+ * then the header that makes them valid
+ * Returns 0 on success, -1 on failure
+ */
+int flushLog(regoLog* log) {
+	if (log->map == NULL || !log->writable || log->head == log->header.head) return 0;
+
+	log->lastFlush = monotonicMillis();
+	if (syncLogRecords(log, log->header.head, log->head) < 0) return -1;
+	return writeLogHeader(log);
+}
+
+/*
+ * Get the range of valid records, as indexes from first up to, but not
+ * including, end. The oldest batch worth of slots is left out, as those are
+ * overwritten by the records being appended
+ */
+void getLogRange(regoLog* log, uint64_t* first, uint64_t* end) {
+	uint32_t valid = log->header.capacity - REGO_LOG_BATCH_RECORDS;
+
+	*end = log->writable ? log->head : log->header.head;
+	*first = *end > valid ? *end - valid : 0;
+}
+
+/*
+ * Get the record with the given index, which must be in the valid range
+ */
+regoLogRecord* getLogRecord(regoLog* log, uint64_t index) {
+	return (regoLogRecord*) (log->map + REGO_LOG_HEADER_SIZE) + index % log->header.capacity;
+}
+
+/*
+ * Binary search the valid range for the first record at or after time
+ * Returns the index of the record, or the end of the range if there is none
+ */
+uint64_t findLogTime(regoLog* log, uint32_t time) {
+	uint64_t low, high, mid;
+
+	getLogRange(log, &low, &high);
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (getLogRecord(log, mid)->time < time) low = mid + 1;
+		else high = mid;
+	}
+	return low;
+}
@@ -0,0 +1,382 @@
+/*
+ * regoMap.c
+ *
+ * Register maps loaded from text files, one register per line:
+ *
+ *   address name type flags interval priority description
+ *   0x01fe status.compressor bool graphite 10 status Status kompressor
+ *
+ * A map is compiled into a binary image holding the entries, their indexes
+ * sorted by address and by name, and the strings. The image is cached next
+ * to the text file, and later runs map the cache and use it in place.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <regoComm.h>
+#include <regoMap.h>
+
+/*****************************************************************************
+ * Internal function declarations
+ *****************************************************************************/
+
+int8_t parseMapField(const char* text, const char* const* names, uint8_t count);
+int parseMapLine(char* line, regoMapEntry* entry, char** name, char** description);
+uint32_t addMapString(char** pool, uint32_t* size, uint32_t* allocated, const char* text);
+int64_t getSourceTime(struct stat* st);
+const uint8_t* mapCacheFile(const char* path, struct stat* source, size_t* size);
+void writeMapCache(const char* path, const uint8_t* image, size_t size);
+
+/*****************************************************************************
+ * Shared variables
+ *****************************************************************************/
+
+// Names of REG_TYPE_* and REG_PRIO_* values in map files
+const char* const typeNames[] = { "unknown", "bool", "int", "temp", "frac" };
+const char* const priorityNames[] = { "status", "sensor", "setting" };
+
+/*****************************************************************************
+ * Functions
+ *****************************************************************************/
+
+/*
+ * Look up a field value by name
+ * Returns the index of the name, or -1 if there is no such name
+ */
+int8_t parseMapField(const char* text, const char* const* names, uint8_t count) {
+	uint8_t i;
+	for (i = 0; i < count; i++) {
+		if (strcmp(text, names[i]) == 0) return i;
+	}
+	return -1;
+}
+
+/*
+ * Parse one line of a map file. Name and description point into the line
+ * Returns 1 for a register, 0 for a blank or comment line, -1 if invalid
+ */
+int parseMapLine(char* line, regoMapEntry* entry, char** name, char** description) {
+	char address[16], type[16], flags[16], interval[16], priority[16], *end;
+	int8_t typeId, prioId;
+	long number;
+	int nameStart, nameEnd, descStart = 0;
+
+	line[strcspn(line, "\r\n")] = 0;
+	if (line[strspn(line, " \t")] == 0 || line[strspn(line, " \t")] == '#') return 0;
+
+	if (sscanf(line, "%15s %n%*s%n %15s %15s %15s %15s %n", address, &nameStart, &nameEnd,
+			type, flags, interval, priority, &descStart) < 5 || descStart == 0) return -1;
+	if (nameEnd - nameStart > REGO_MAP_NAME_MAX) return -1;
+
+	memset(entry, 0, sizeof(*entry));
+	number = strtol(address, &end, 0);
+	if (*end || number < 0 || number > 0xffff) return -1;
+	entry->address = number;
+
+	typeId = parseMapField(type, typeNames, sizeof(typeNames) / sizeof(typeNames[0]));
+	prioId = parseMapField(priority, priorityNames, sizeof(priorityNames) / sizeof(priorityNames[0]));
+	if (typeId < 0 || prioId < 0) return -1;
+	entry->type = typeId;
+	entry->priority = prioId;
+
+	if (strcmp(flags, "graphite") == 0) entry->type |= REG_TYPE_GRAPHITE;
+	else if (strcmp(flags, "-") != 0) return -1;
+
+	number = strtol(interval, &end, 0);
+	if (*end || number < 0 || number > 0xffff) return -1;
+	entry->interval = number;
+
+	line[nameEnd] = 0;
+	*name = line + nameStart;
+	*description = line + descStart;
+	return 1;
+}
+
+/*
+ * Append a string to the pool, growing it as needed
+ * Returns the offset of the string, or UINT32_MAX if out of memory
+ */
+uint32_t addMapString(char** pool, uint32_t* size, uint32_t* allocated, const char* text) {
+	uint32_t len = strlen(text) + 1, offset = *size;
+	char* grown;
+
+	if (*size + len > *allocated) {
+		grown = realloc(*pool, *allocated * 2 + len);
+		if (grown == NULL) return UINT32_MAX;
+		*pool = grown;
+		*allocated = *allocated * 2 + len;
+	}
+	memcpy(*pool + offset, text, len);
+	*size += len;
+	return offset;
+}
+
+/*
+ * Compile a text map into a binary image, allocated with malloc(). Errors are
+ * reported with the line they are on
+ * Returns 0 on success, -1 on failure
+ */
+int compileRegisterMap(const char* path, uint8_t** image, size_t* size) {
+	char line[REGO_MAP_LINE_MAX], *name, *description, *pool = NULL;
+	uint32_t poolSize = 0, poolAllocated = 0, count = 0, allocated = 0, lineNo = 0, i;
+	regoMapEntry* entries = NULL, *grown, entry;
+	registerLookupTable* table = NULL;
+	int16_t* byAddress = NULL, *byName = NULL;
+	regoMapHeader* header;
+	struct stat st;
+	FILE* in;
+	int retval = -1;
+
+	in = fopen(path, "r");
+	if (in == NULL || fstat(fileno(in), &st) < 0) {
+		fprintf(stderr, "loadRegisterMap: cannot open %s: %s\n", path, strerror(errno));
+		if (in) fclose(in);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), in)) {
+		lineNo++;
+		switch (parseMapLine(line, &entry, &name, &description)) {
+			case 0:
+				continue;
+			case -1:
+				fprintf(stderr, "loadRegisterMap: %s:%u: invalid register definition\n", path, lineNo);
+				goto done;
+		}
+		if (count == REGO_MAX_KNOWN_REGISTERS) {
+			fprintf(stderr, "loadRegisterMap: %s:%u: too many registers\n", path, lineNo);
+			goto done;
+		}
+		if (count == allocated) {
+			grown = realloc(entries, (allocated * 2 + 64) * sizeof(regoMapEntry));
+			if (grown == NULL) goto oom;
+			entries = grown;
+			allocated = allocated * 2 + 64;
+		}
+		entry.name = addMapString(&pool, &poolSize, &poolAllocated, name);
+		entry.description = addMapString(&pool, &poolSize, &poolAllocated, description);
+		if (entry.name == UINT32_MAX || entry.description == UINT32_MAX) goto oom;
+		entries[count++] = entry;
+	}
+
+	// Sort the indexes, which also brings out duplicate addresses and names
+	table = malloc(count * sizeof(registerLookupTable) + 1);
+	byAddress = malloc(count * sizeof(int16_t) + 1);
+	byName = malloc(count * sizeof(int16_t) + 1);
+	if (table == NULL || byAddress == NULL || byName == NULL) goto oom;
+	for (i = 0; i < count; i++) {
+		table[i].address = entries[i].address;
+		table[i].name = pool + entries[i].name;
+	}
+	sortRegisterIndex(table, count, byAddress, byName);
+	for (i = 1; i < count; i++) {
+		if (table[byAddress[i]].address == table[byAddress[i - 1]].address) {
+			fprintf(stderr, "loadRegisterMap: %s: register %04x is defined twice\n", path, table[byAddress[i]].address);
+			goto done;
+		}
+		if (strcmp(table[byName[i]].name, table[byName[i - 1]].name) == 0) {
+			fprintf(stderr, "loadRegisterMap: %s: name %s is used twice\n", path, table[byName[i]].name);
+			goto done;
+		}
+	}
+
+	// Header, entries, indexes padded to 8 bytes, strings
+	*size = sizeof(regoMapHeader) + count * sizeof(regoMapEntry) + (count * 2 * sizeof(int16_t) + 7) / 8 * 8 + poolSize;
+	*image = calloc(1, *size);
+	if (*image == NULL) goto oom;
+
+	header = (regoMapHeader*) *image;
+	memcpy(header->magic, REGO_MAP_MAGIC, sizeof(REGO_MAP_MAGIC));
+	header->version = REGO_MAP_VERSION;
+	header->count = count;
+	header->sourceSize = st.st_size;
+	header->sourceTime = getSourceTime(&st);
+	header->stringsSize = poolSize;
+	memcpy(*image + sizeof(regoMapHeader), entries, count * sizeof(regoMapEntry));
+	memcpy(*image + sizeof(regoMapHeader) + count * sizeof(regoMapEntry), byAddress, count * sizeof(int16_t));
+	memcpy(*image + sizeof(regoMapHeader) + count * sizeof(regoMapEntry) + count * sizeof(int16_t), byName, count * sizeof(int16_t));
+	memcpy(*image + *size - poolSize, pool, poolSize);
+	retval = 0;
+	goto done;
+
+oom:
+	fprintf(stderr, "loadRegisterMap: out of memory compiling %s\n", path);
+done:
+	fclose(in);
+	free(entries);
+	free(pool);
+	free(table);
+	free(byAddress);
+	free(byName);
+	return retval;
+}
+
+/*
+ * Check a compiled image and make it the register map. The image is used in
+ * place and must stay valid for as long as the map is in use
+ * Returns 0 on success, -1 if the image is invalid or out of memory
+ */
+int useRegisterMapImage(const uint8_t* image, size_t size) {
+	const regoMapHeader* header = (const regoMapHeader*) image;
+	const regoMapEntry* entries;
+	const int16_t* byAddress;
+	const int16_t* byName;
+	const char* strings;
+	registerLookupTable* table;
+	uint32_t i;
+
+	if (size < sizeof(regoMapHeader) || memcmp(header->magic, REGO_MAP_MAGIC, sizeof(REGO_MAP_MAGIC)) != 0
+			|| header->version != REGO_MAP_VERSION || header->count > REGO_MAX_KNOWN_REGISTERS || header->stringsSize == 0
+			|| size != sizeof(regoMapHeader) + header->count * sizeof(regoMapEntry) + (header->count * 2 * sizeof(int16_t) + 7) / 8 * 8 + header->stringsSize) {
+		return -1;
+	}
+
+	entries = (const regoMapEntry*) (image + sizeof(regoMapHeader));
+	byAddress = (const int16_t*) (entries + header->count);
+	byName = byAddress + header->count;
+	strings = (const char*) image + size - header->stringsSize;
+	if (strings[header->stringsSize - 1] != 0) return -1;
+
+	table = malloc(header->count * sizeof(registerLookupTable) + 1);
+	if (table == NULL) return -1;
+	for (i = 0; i < header->count; i++) {
+		if (entries[i].name >= header->stringsSize || entries[i].description >= header->stringsSize
+				|| byAddress[i] < 0 || byAddress[i] >= (int32_t) header->count
+				|| byName[i] < 0 || byName[i] >= (int32_t) header->count) {
+			free(table);
+			return -1;
+		}
+		table[i].address = entries[i].address;
+		table[i].name = strings + entries[i].name;
+		table[i].description = strings + entries[i].description;
+		table[i].type = entries[i].type;
+		table[i].interval = entries[i].interval;
+		table[i].priority = entries[i].priority;
+	}
+
+	setRegisterMap(table, header->count, byAddress, byName);
+	return 0;
+}
+
+/*
+ * Modification time of a text map (ns), telling edits apart even within a
+ * second
+ */
+int64_t getSourceTime(struct stat* st) {
+	return (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+/*
+ * Map the cache file, if it was compiled from the current text map
+ * Returns the mapped image, or NULL if there is no up-to-date cache
+ */
+const uint8_t* mapCacheFile(const char* path, struct stat* source, size_t* size) {
+	const regoMapHeader* header;
+	struct stat st;
+	void* image;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0) return NULL;
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(regoMapHeader)) {
+		close(fd);
+		return NULL;
+	}
+	image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED) return NULL;
+
+	header = image;
+	if ((off_t) header->sourceSize != source->st_size || header->sourceTime != getSourceTime(source)) {
+		munmap(image, st.st_size);
+		return NULL;
+	}
+	*size = st.st_size;
+	return image;
+}
+
+/*
+ * Write the cache file, replacing the old one in one step so that concurrent
+ * runs never see a partial file
+ */
+void writeMapCache(const char* path, const uint8_t* image, size_t size) {
+	char tmpPath[REGO_MAP_LINE_MAX];
+	int fd;
+
+	snprintf(tmpPath, sizeof(tmpPath), "%s.%d", path, (int) getpid());
+	fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || write(fd, image, size) != (ssize_t) size || close(fd) < 0 || rename(tmpPath, path) < 0) {
+		fprintf(stderr, "loadRegisterMap: cannot write cache %s: %s\n", path, strerror(errno));
+		if (fd >= 0) unlink(tmpPath);
+	}
+}
+
+/*
+ * Load the register map in the text file at path, replacing the built-in map.
+ * The compiled map is cached in path.cache, which is used as long as the text
+ * file is unchanged
+ * Returns 0 on success, -1 on failure
+ */
+int loadRegisterMap(const char* path) {
+	char cachePath[REGO_MAP_LINE_MAX];
+	const uint8_t* cached;
+	uint8_t* image;
+	struct stat source;
+	size_t size;
+
+	if (stat(path, &source) < 0) {
+		fprintf(stderr, "loadRegisterMap: cannot open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (strlen(path) + sizeof(REGO_MAP_CACHE_SUFFIX) + 12 > sizeof(cachePath)) {
+		fprintf(stderr, "loadRegisterMap: path too long\n");
+		return -1;
+	}
+	snprintf(cachePath, sizeof(cachePath), "%s%s", path, REGO_MAP_CACHE_SUFFIX);
+
+	cached = mapCacheFile(cachePath, &source, &size);
+	if (cached) {
+		if (useRegisterMapImage(cached, size) == 0) return 0;
+		munmap((void*) cached, size);
+	}
+
+	if (compileRegisterMap(path, &image, &size) < 0) return -1;
+	writeMapCache(cachePath, image, size);
+	if (useRegisterMapImage(image, size) < 0) {
+		fprintf(stderr, "loadRegisterMap: %s has no registers\n", path);
+		free(image);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Print one register as a line of a map file. Type may carry REG_TYPE_GRAPHITE
+ */
+void printMapEntry(FILE* out, uint16_t address, const char* name, uint8_t type, uint16_t interval, uint8_t priority, const char* description) {
+	uint8_t baseType = type & REG_TYPE_MASK;
+
+	fprintf(out, "0x%04x %s %s %s %u %s %s\n", address, name,
+		baseType < sizeof(typeNames) / sizeof(typeNames[0]) ? typeNames[baseType] : "unknown",
+		type & REG_TYPE_GRAPHITE ? "graphite" : "-", interval,
+		priority < sizeof(priorityNames) / sizeof(priorityNames[0]) ? priorityNames[priority] : "setting", description);
+}
+
+/*
+ * Print the register map in use as a map file
+ */
+void printRegisterMap(FILE* out) {
+	int16_t id;
+
+	fprintf(out, "# address name type flags interval priority description\n");
+	for (id = 0; id < getKnownRegisterCount(); id++) {
+		printMapEntry(out, getRegisterAddressById(id), getRegisterNameById(id),
+			getRegisterTypeById(id) | (isGraphiteRegisterById(id) ? REG_TYPE_GRAPHITE : 0),
+			getRegisterIntervalById(id), getRegisterPriorityById(id), getRegisterDescriptionById(id));
+	}
+}
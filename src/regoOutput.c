@@ -0,0 +1,537 @@
+/*
+ * regoOutput.c
+ *
+ * Output sinks for register values. Each format has a formatter that renders
+ * a sample into a caller supplied buffer without stdio or floating point, as
+ * values in tenths are printed in fixed point. Samples of a sweep are
+ * collected in one preallocated buffer and written out with a single call.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <regoComm.h>
+#include <regoGraphite.h>
+#include <regoOutput.h>
+
+/*****************************************************************************
+ * Defines
+ *****************************************************************************/
+
+#define GRAPHITE_PREFIX			"heatpump."		// Prefix for Graphite output
+#define INFLUX_MEASUREMENT	"heatpump"		// Measurement name for InfluxDB output
+
+// Longest parts of a rendered sample, so it always fits in REGO_OUTPUT_LINE_MAX
+#define TAG_MAX							31
+#define NAME_MAX						64
+#define DESCRIPTION_MAX			80
+
+/*****************************************************************************
+ * Types
+ *****************************************************************************/
+
+typedef uint16_t (*sampleFormatter)(char* dst, regoSample* sample);
+
+typedef struct {
+	const char* name;									// Name used with --output
+	sampleFormatter format;
+	const char* header;								// Written before the first sample, NULL if none
+} outputSink;
+
+/*****************************************************************************
+ * Internal function declarations
+ *****************************************************************************/
+
+uint16_t textLength(const char* text, uint16_t max);
+char* appendText(char* p, const char* text, uint16_t max);
+char* appendEscaped(char* p, const char* text, uint16_t max, const char* special);
+char* appendJson(char* p, const char* text, uint16_t max);
+char* appendUInt(char* p, uint32_t number);
+char* appendInt(char* p, int32_t number);
+char* appendTenths(char* p, int16_t number);
+char* appendHex(char* p, uint16_t number);
+char* appendValue(char* p, regoSample* sample);
+const char* getSampleName(regoSample* sample);
+uint8_t getSampleType(regoSample* sample);
+void addSample(regoOutput* out, regoSample* sample);
+uint16_t formatHuman(char* dst, regoSample* sample);
+uint16_t formatGraphite(char* dst, regoSample* sample);
+uint16_t formatInflux(char* dst, regoSample* sample);
+uint16_t formatJson(char* dst, regoSample* sample);
+uint16_t formatCsv(char* dst, regoSample* sample);
+
+/*****************************************************************************
+ * Shared variables
+ *****************************************************************************/
+
+outputSink outputSinks[OUTPUT_FORMATS] = {
+	{"human", formatHuman, NULL},
+	{"graphite", formatGraphite, NULL},
+	{"influx", formatInflux, NULL},
+	{"json", formatJson, NULL},
+	{"csv", formatCsv, "time,tag,address,name,value,status\n"},
+};
+
+/*****************************************************************************
+ * Functions
+ *****************************************************************************/
+
+/* --- Fixed-point rendering helpers, all return the position after the text --- */
+
+/*
+ * Length of text, at most max bytes and backed off so a UTF-8 character is not cut
+ */
+uint16_t textLength(const char* text, uint16_t max) {
+	uint16_t len = 0;
+
+	while (len < max && text[len]) len++;
+	while (len > 0 && (text[len] & 0xc0) == 0x80) len--;
+	return len;
+}
+
+/*
+ * Append at most max bytes of text
+ */
+char* appendText(char* p, const char* text, uint16_t max) {
+	uint16_t len = textLength(text, max);
+
+	memcpy(p, text, len);
+	return p + len;
+}
+
+/*
+ * Append at most max bytes of text, escaping the special characters with a backslash
+ */
+char* appendEscaped(char* p, const char* text, uint16_t max, const char* special) {
+	const char* end = text + textLength(text, max);
+
+	for (; text < end; text++) {
+		if (strchr(special, *text)) *p++ = '\\';
+		*p++ = *text;
+	}
+	return p;
+}
+
+/*
+ * Append at most max bytes of text as the inside of a JSON string, escaping
+ * quotes and backslashes with a backslash and control characters as \u00XX.
+ * At most twice max bytes are written, so an escape that does not fit ends
+ * the text
+ */
+char* appendJson(char* p, const char* text, uint16_t max) {
+	static const char hex[] = "0123456789abcdef";
+	char* end = p + 2 * max;
+	uint16_t i, len = textLength(text, max);
+	uint8_t c;
+
+	for (i = 0; i < len; i++) {
+		c = text[i];
+		if (p + (c < 0x20 ? 6 : c == '"' || c == '\\' ? 2 : 1) > end) {
+			while (i > 0 && (text[i] & 0xc0) == 0x80) {		// Drop the start of a cut UTF-8 character
+				i--;
+				p--;
+			}
+			break;
+		}
+		if (c < 0x20) {
+			memcpy(p, "\\u00", 4);
+			p[4] = hex[c >> 4];
+			p[5] = hex[c & 0xf];
+			p += 6;
+		} else {
+			if (c == '"' || c == '\\') *p++ = '\\';
+			*p++ = c;
+		}
+	}
+	return p;
+}
+
+/*
+ * Append an unsigned decimal number
+ */
+char* appendUInt(char* p, uint32_t number) {
+	char digits[10];
+	uint8_t n = 0;
+
+	do {
+		digits[n++] = '0' + number % 10;
+		number /= 10;
+	} while (number);
+	while (n) *p++ = digits[--n];
+	return p;
+}
+
+/*
+ * Append a signed decimal number
+ */
+char* appendInt(char* p, int32_t number) {
+	if (number < 0) {
+		*p++ = '-';
+		return appendUInt(p, -(int64_t) number);
+	}
+	return appendUInt(p, number);
+}
+
+/*
+ * Append a number given in tenths with one decimal, e.g. -52 as -5.2
+ */
+char* appendTenths(char* p, int16_t number) {
+	uint32_t magnitude = number < 0 ? -(int32_t) number : number;
+
+	if (number < 0) *p++ = '-';
+	p = appendUInt(p, magnitude / 10);
+	*p++ = '.';
+	*p++ = '0' + magnitude % 10;
+	return p;
+}
+
+/*
+ * Append a register address as four hex digits
+ */
+char* appendHex(char* p, uint16_t number) {
+	static const char hex[] = "0123456789abcdef";
+	int8_t shift;
+
+	for (shift = 12; shift >= 0; shift -= 4) *p++ = hex[(number >> shift) & 0xf];
+	return p;
+}
+
+/*
+ * Append the value of a sample, in tenths for temperatures and fractions
+ */
+char* appendValue(char* p, regoSample* sample) {
+	uint8_t type = getSampleType(sample);
+
+	if (type == REG_TYPE_TEMP || type == REG_TYPE_FRAC) return appendTenths(p, sample->value);
+	return appendInt(p, sample->value);
+}
+
+/*
+ * Get the name of a sample, that of the series or of the register
+ * Returns the name, or NULL for an unknown register
+ */
+const char* getSampleName(regoSample* sample) {
+	if (sample->name) return sample->name;
+	return sample->id >= 0 ? getRegisterNameById(sample->id) : NULL;
+}
+
+/*
+ * Get the REG_TYPE_* of the value of a sample
+ */
+uint8_t getSampleType(regoSample* sample) {
+	if (sample->name) return sample->type;
+	return sample->id >= 0 ? getRegisterTypeById(sample->id) : REG_TYPE_UNKNOWN;
+}
+
+/* --- Formatters, each renders one sample and returns its length --- */
+
+/*
+ * Human readable: name, address, description and value with unit
+ */
+uint16_t formatHuman(char* dst, regoSample* sample) {
+	char* p = appendText(dst, sample->tag, TAG_MAX);
+
+	if (sample->tag[0]) p = appendText(p, ": ", 2);
+
+	if (sample->status != RESPONSE_OK) {
+		p = appendText(p, "Error ", 6);
+		p = appendInt(p, sample->status);
+		p = appendText(p, " requesting register ", 21);
+		p = appendHex(p, sample->address);
+		p = appendText(p, ".", 1);
+	} else if (sample->name) {
+		p = appendText(p, sample->name, NAME_MAX);
+		p = appendText(p, ": ", 2);
+		p = appendValue(p, sample);
+	} else if (sample->id < 0) {
+		p = appendHex(p, sample->address);
+		p = appendText(p, ": ", 2);
+		p = appendInt(p, sample->value);
+	} else {
+		p = appendText(p, getRegisterNameById(sample->id), NAME_MAX);
+		*p++ = '(';
+		p = appendHex(p, sample->address);
+		p = appendText(p, ") - ", 4);
+		p = appendText(p, getRegisterDescriptionById(sample->id), DESCRIPTION_MAX);
+		p = appendText(p, ": ", 2);
+		switch (getRegisterTypeById(sample->id)) {
+			case REG_TYPE_BOOL:
+				p = appendText(p, sample->value ? "ON" : "OFF", 3);
+				break;
+			case REG_TYPE_TEMP:
+				p = appendTenths(p, sample->value);
+				p = appendText(p, " degrees", 8);
+				break;
+			default:
+				p = appendValue(p, sample);
+		}
+	}
+
+	*p++ = '\n';
+	return p - dst;
+}
+
+/*
+ * Graphite plaintext: heatpump.[tag.]name value time
+ * Errors and unknown registers are left out
+ */
+uint16_t formatGraphite(char* dst, regoSample* sample) {
+	char* p = dst;
+
+	if (sample->status != RESPONSE_OK || getSampleName(sample) == NULL) return 0;
+
+	p = appendText(p, GRAPHITE_PREFIX, sizeof(GRAPHITE_PREFIX));
+	if (sample->tag[0]) {
+		p = appendText(p, sample->tag, TAG_MAX);
+		*p++ = '.';
+	}
+	p = appendText(p, getSampleName(sample), NAME_MAX);
+	*p++ = ' ';
+	p = appendValue(p, sample);
+	*p++ = ' ';
+	p = appendUInt(p, sample->time);
+	*p++ = '\n';
+	return p - dst;
+}
+
+/*
+ * InfluxDB line protocol: heatpump,register=name[,port=tag] value=v time
+ * Integer values are typed as such, and errors are left out
+ */
+uint16_t formatInflux(char* dst, regoSample* sample) {
+	uint8_t type = getSampleType(sample);
+	char* p = dst;
+
+	if (sample->status != RESPONSE_OK) return 0;
+
+	p = appendText(p, INFLUX_MEASUREMENT ",register=", sizeof(INFLUX_MEASUREMENT ",register="));
+	if (getSampleName(sample)) {
+		p = appendEscaped(p, getSampleName(sample), NAME_MAX, " ,=");
+	} else {
+		p = appendHex(p, sample->address);
+	}
+	if (sample->tag[0]) {
+		p = appendText(p, ",port=", 6);
+		p = appendEscaped(p, sample->tag, TAG_MAX, " ,=");
+	}
+	p = appendText(p, " value=", 7);
+	p = appendValue(p, sample);
+	if (type != REG_TYPE_TEMP && type != REG_TYPE_FRAC) *p++ = 'i';
+	*p++ = ' ';
+	p = appendUInt(p, sample->time);
+	p = appendText(p, "000000000\n", 10);		// Seconds to nanoseconds
+	return p - dst;
+}
+
+/*
+ * JSON lines: {"time":t,"tag":"tag","address":"0209","name":"name","value":v,"status":1}
+ * The value is null if the read failed
+ */
+uint16_t formatJson(char* dst, regoSample* sample) {
+	char* p = appendText(dst, "{\"time\":", 8);
+
+	p = appendUInt(p, sample->time);
+	if (sample->tag[0]) {
+		p = appendText(p, ",\"tag\":\"", 8);
+		p = appendJson(p, sample->tag, TAG_MAX);
+		*p++ = '"';
+	}
+	p = appendText(p, ",\"address\":\"", 12);
+	p = appendHex(p, sample->address);
+	*p++ = '"';
+	if (getSampleName(sample)) {
+		p = appendText(p, ",\"name\":\"", 9);
+		p = appendJson(p, getSampleName(sample), NAME_MAX);
+		*p++ = '"';
+	}
+	p = appendText(p, ",\"value\":", 9);
+	p = sample->status == RESPONSE_OK ? appendValue(p, sample) : appendText(p, "null", 4);
+	p = appendText(p, ",\"status\":", 10);
+	p = appendInt(p, sample->status);
+	p = appendText(p, "}\n", 2);
+	return p - dst;
+}
+
+/*
+ * CSV: time,tag,address,name,value,status
+ * The value is empty if the read failed
+ */
+uint16_t formatCsv(char* dst, regoSample* sample) {
+	char* p = appendUInt(dst, sample->time);
+
+	*p++ = ',';
+	p = appendText(p, sample->tag, TAG_MAX);
+	*p++ = ',';
+	p = appendHex(p, sample->address);
+	*p++ = ',';
+	if (getSampleName(sample)) p = appendText(p, getSampleName(sample), NAME_MAX);
+	*p++ = ',';
+	if (sample->status == RESPONSE_OK) p = appendValue(p, sample);
+	*p++ = ',';
+	p = appendInt(p, sample->status);
+	*p++ = '\n';
+	return p - dst;
+}
+
+/* --- Display rows --- */
+
+/*
+ * Render a display row read at sec.ms (Unix time), as a JSON object in JSON
+ * output and otherwise as a line of time, tag, row and text
+ */
+uint16_t formatDisplayRow(uint8_t format, char* dst, const char* tag, uint32_t sec, uint16_t ms, uint8_t row, const char* text) {
+	char* p = dst;
+
+	if (format == OUTPUT_JSON) p = appendText(p, "{\"time\":", 8);
+	p = appendUInt(p, sec);
+	*p++ = '.';
+	*p++ = '0' + ms / 100;
+	*p++ = '0' + ms / 10 % 10;
+	*p++ = '0' + ms % 10;
+
+	if (format == OUTPUT_JSON) {
+		if (tag[0]) {
+			p = appendText(p, ",\"tag\":\"", 8);
+			p = appendJson(p, tag, TAG_MAX);
+			*p++ = '"';
+		}
+		p = appendText(p, ",\"row\":", 7);
+		p = appendUInt(p, row);
+		p = appendText(p, ",\"text\":\"", 9);
+		p = appendJson(p, text, REGO_DISPLAY_ROW_SIZE);
+		p = appendText(p, "\"}\n", 3);
+		return p - dst;
+	}
+
+	*p++ = ' ';
+	if (tag[0]) {
+		p = appendText(p, tag, TAG_MAX);
+		*p++ = ' ';
+	}
+	p = appendUInt(p, row);
+	*p++ = ' ';
+	p = appendText(p, text, REGO_DISPLAY_ROW_SIZE);
+	*p++ = '\n';
+	return p - dst;
+}
+
+/* --- Output sink --- */
+
+/*
+ * Set up an output sink writing to stdout
+ */
+void initOutput(regoOutput* out, uint8_t format) {
+	out->format = format < OUTPUT_FORMATS ? format : OUTPUT_HUMAN;
+	out->headerDone = 0;
+	out->graphite = NULL;
+	out->sweepTime = 0;
+	out->len = 0;
+}
+
+/*
+ * Look up an output format by name
+ * Returns the OUTPUT_* format, or -1 if there is no such format
+ */
+int8_t getOutputFormatByName(const char* name) {
+	int8_t i;
+	for (i = 0; i < OUTPUT_FORMATS; i++) {
+		if (strcmp(outputSinks[i].name, name) == 0) return i;
+	}
+	return -1;
+}
+
+/*
+ * Render a sample in the given format into dst, which must hold at least
+ * REGO_OUTPUT_LINE_MAX bytes. The text is not null terminated
+ * Returns the length of the text, 0 if the format leaves the sample out
+ */
+uint16_t formatSample(uint8_t format, char* dst, regoSample* sample) {
+	return outputSinks[format].format(dst, sample);
+}
+
+/*
+ * Render a sample into the sweep buffer. Samples of a sweep share the
+ * timestamp of the first one, unless sampleTime is given (not 0)
+ */
+void addOutputSample(regoOutput* out, const char* tag, uint16_t address, int16_t id, int8_t status, int16_t value, uint32_t sampleTime) {
+	regoSample sample;
+
+	sample.tag = tag;
+	sample.address = address;
+	sample.id = id;
+	sample.name = NULL;
+	sample.type = REG_TYPE_UNKNOWN;
+	sample.status = status;
+	sample.value = value;
+	sample.time = sampleTime;
+	addSample(out, &sample);
+}
+
+/*
+ * Render a value of a named series, such as an aggregate, into the sweep
+ * buffer. Address is that of the underlying register, 0 if there is none
+ */
+void addOutputSeries(regoOutput* out, const char* tag, uint16_t address, const char* name, uint8_t type, int16_t value, uint32_t sampleTime) {
+	regoSample sample;
+
+	sample.tag = tag;
+	sample.address = address;
+	sample.id = -1;
+	sample.name = name;
+	sample.type = type;
+	sample.status = RESPONSE_OK;
+	sample.value = value;
+	sample.time = sampleTime;
+	addSample(out, &sample);
+}
+
+/*
+ * Render a sample into the sweep buffer, after the header if not yet written
+ */
+void addSample(regoOutput* out, regoSample* sample) {
+	const char* header = outputSinks[out->format].header;
+
+	if (out->len + REGO_OUTPUT_LINE_MAX > sizeof(out->buffer)) flushOutput(out);
+	if (out->len == 0) out->sweepTime = time(NULL);
+	if (header && !out->headerDone) {
+		out->len += appendText(out->buffer + out->len, header, REGO_OUTPUT_LINE_MAX) - (out->buffer + out->len);
+		out->headerDone = 1;
+	}
+
+	if (sample->time == 0) sample->time = out->sweepTime;
+	out->len += formatSample(out->format, out->buffer + out->len, sample);
+}
+
+/*
+ * Write out the samples of the sweep, anything printed through stdio first
+ * Returns 0 on success, -1 if the samples could not be delivered
+ */
+int flushOutput(regoOutput* out) {
+	uint32_t pos = 0;
+	ssize_t n;
+	int retval = 0;
+
+	if (out == NULL || out->len == 0) return 0;
+
+	if (out->format == OUTPUT_GRAPHITE && out->graphite) {
+		retval = sendGraphiteSweep(out->graphite, out->buffer, out->len);
+	} else {
+		fflush(stdout);
+		while (pos < out->len) {
+			n = write(STDOUT_FILENO, out->buffer + pos, out->len - pos);
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				perror("flushOutput: error in write");
+				retval = -1;
+				break;
+			}
+			pos += n;
+		}
+	}
+
+	out->len = 0;
+	return retval;
+}
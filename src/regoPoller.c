@@ -0,0 +1,163 @@
+/*
+ * regoPoller.c
+ *
+ * Concurrent poller for several Rego637 heatpump controllers. Each port has one
+ * transaction in flight at a time, driven by its own request queue, so retries,
+ * pacing and the register cache work as for a single port. All ports are
+ * driven from a single epoll loop, so polling N heatpumps takes about as long
+ * as polling one.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <regoAsync.h>
+#include <regoComm.h>
+#include <regoPoller.h>
+#include <regoSerialIO.h>
+
+/*****************************************************************************
+ * Types
+ *****************************************************************************/
+
+typedef struct {
+	rego_conn* conn;
+	regoAsync async;				// Request queue of the port
+	uint16_t* regs;
+	uint16_t regCount;
+	uint16_t next;					// Index of the next register to read
+	uint8_t done;						// All registers read, or the port failed
+	uint8_t removed;				// Taken out of the epoll set
+} pollerPort;
+
+/*****************************************************************************
+ * Internal function declarations
+ *****************************************************************************/
+
+void advancePort(pollerPort* port);
+void finishPortRead(const regoCompletion* completion, void* context);
+void removePort(int ep, pollerPort* port);
+
+/*****************************************************************************
+ * Functions
+ *****************************************************************************/
+
+/*
+ * Print the registers of the port that are fresh in the cache, and submit the
+ * read of the first one that is not, or mark the port done
+ */
+void advancePort(pollerPort* port) {
+	int16_t value;
+
+	while (port->next < port->regCount) {
+		if (!getFreshRegister(port->conn, port->regs[port->next], &value, port->conn->cacheMaxAge)) {
+			submitRegisterRead(&port->async, port->regs[port->next], finishPortRead, port);
+			return;
+		}
+		printRegisterValue(port->conn, port->regs[port->next], RESPONSE_OK, value);
+		port->next++;
+	}
+	port->done = 1;
+}
+
+/*
+ * Report a register read after its retries and move on to the next register
+ */
+void finishPortRead(const regoCompletion* completion, void* context) {
+	pollerPort* port = context;
+
+	printRegisterValue(port->conn, completion->reg, completion->status, completion->value);
+	port->next++;
+	advancePort(port);
+}
+
+/*
+ * Take a port that is done out of the epoll set, so input on it no longer
+ * wakes up the loop
+ */
+void removePort(int ep, pollerPort* port) {
+	epoll_ctl(ep, EPOLL_CTL_DEL, port->conn->fd, NULL);
+	port->removed = 1;
+}
+
+/*
+ * Read the given registers from all connections concurrently and print the
+ * values, tagged with each connection's tag
+ * Returns 0 on success, -1 if the event loop failed
+ */
+int runPoller(rego_conn* conns, uint8_t count, uint16_t* regs, uint16_t regCount) {
+	pollerPort ports[REGO_MAX_PORTS];
+	struct epoll_event ev, events[REGO_MAX_PORTS];
+	int ep, n, timeout, wait, active;
+	uint8_t i;
+
+	if (count > REGO_MAX_PORTS) count = REGO_MAX_PORTS;
+
+	ep = epoll_create(REGO_MAX_PORTS);
+	if (ep < 0) {
+		perror("runPoller: error in epoll_create");
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		ports[i].conn = &conns[i];
+		ports[i].regs = regs;
+		ports[i].regCount = regCount;
+		ports[i].next = 0;
+		ports[i].done = 0;
+		ports[i].removed = 0;
+		initAsync(&ports[i].async, &conns[i]);
+
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		if (epoll_ctl(ep, EPOLL_CTL_ADD, conns[i].fd, &ev) < 0) {
+			perror("runPoller: error in epoll_ctl");
+			close(ep);
+			return -1;
+		}
+		advancePort(&ports[i]);
+	}
+
+	while (1) {
+		// Ports finished or failed leave the epoll set, the others are advanced,
+		// which also drops input arriving while no response is pending
+		active = 0;
+		timeout = -1;
+		for (i = 0; i < count; i++) {
+			if (ports[i].removed) continue;
+			if (!ports[i].done) processAsync(&ports[i].async);
+			if (ports[i].done) {
+				removePort(ep, &ports[i]);
+				continue;
+			}
+
+			// Sleep until the earliest response deadline or send time
+			active = 1;
+			wait = getAsyncTimeout(&ports[i].async);
+			if (wait >= 0 && (timeout < 0 || wait < timeout)) timeout = wait;
+		}
+		if (!active) break;
+
+		n = epoll_wait(ep, events, count, timeout);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror("runPoller: error in epoll_wait");
+			close(ep);
+			return -1;
+		}
+
+		// A port that hung up or failed would wake the loop forever
+		while (n-- > 0) {
+			i = events[n].data.u32;
+			if (events[n].events & (EPOLLHUP | EPOLLERR)) {
+				fprintf(stderr, "runPoller: %s: port hung up or failed\n", conns[i].portName);
+				ports[i].done = 1;
+			}
+		}
+	}
+
+	close(ep);
+	return 0;
+}
@@ -0,0 +1,398 @@
+/*
+ * regoScan.c
+ *
+ * Discovery scan of the 16-bit register space, for mapping controllers whose
+ * registers are not known. Each address is probed once with a response
+ * timeout learned from the addresses that respond, so unresponsive addresses
+ * do not cost the full timeout. Later passes read the responsive addresses
+ * again to see which values vary. Progress is checkpointed to a file so an
+ * interrupted scan can be resumed, and the result is printed as a candidate
+ * register map.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <regoComm.h>
+#include <regoMap.h>
+#include <regoScan.h>
+
+/*****************************************************************************
+ * Shared variables
+ *****************************************************************************/
+
+// Set by the signal handler to checkpoint and stop the scan
+volatile sig_atomic_t scanStopFlag = 0;
+
+/*****************************************************************************
+ * Internal function declarations
+ *****************************************************************************/
+
+void scanSignalHandler(int sig);
+int parseScanRanges(regoScan* scan, const char* text);
+uint8_t inScanRanges(regoScan* scan, uint16_t address);
+int loadScan(regoScan* scan);
+void learnScanTiming(regoScan* scan, uint32_t latency);
+int probeScanAddress(regoScan* scan, rego_conn* conn, uint16_t address, int8_t* status, int16_t* value);
+
+/*****************************************************************************
+ * Functions
+ *****************************************************************************/
+
+/*
+ * Stop the scan on SIGINT/SIGTERM
+ */
+void scanSignalHandler(int sig) {
+	scanStopFlag = 1;
+}
+
+/*
+ * Parse a comma separated list of addresses and address ranges, e.g.
+ * 0x0000-0x02ff,0x1000, or all for the whole register space
+ * Returns 0 on success, -1 if the list is invalid
+ */
+int parseScanRanges(regoScan* scan, const char* text) {
+	regoScanHeader* h = &scan->header;
+	unsigned long from, to;
+	char* end;
+
+	if (strcmp(text, "all") == 0) text = "0x0000-0xffff";
+	h->rangeCount = 0;
+	while (*text) {
+		from = strtoul(text, &end, 0);
+		to = from;
+		if (end == text) return -1;
+		if (*end == '-') {
+			text = end + 1;
+			to = strtoul(text, &end, 0);
+			if (end == text) return -1;
+		}
+		if (from > to || to > 0xffff || h->rangeCount == REGO_SCAN_MAX_RANGES) return -1;
+		if (*end != ',' && *end != 0) return -1;
+
+		h->rangeFrom[h->rangeCount] = from;
+		h->rangeTo[h->rangeCount++] = to;
+		text = *end == ',' ? end + 1 : end;
+	}
+	return h->rangeCount > 0 ? 0 : -1;
+}
+
+/*
+ * Check whether an address is in the scanned ranges
+ */
+uint8_t inScanRanges(regoScan* scan, uint16_t address) {
+	uint32_t i;
+	for (i = 0; i < scan->header.rangeCount; i++) {
+		if (address >= scan->header.rangeFrom[i] && address <= scan->header.rangeTo[i]) return 1;
+	}
+	return 0;
+}
+
+/*
+ * Set up a scan of the given ranges, or resume the one checkpointed in
+ * statePath if there is one. A resumed scan keeps its ranges, but makes the
+ * number of passes given now
+ * Returns 0 for a new scan, 1 for a resumed one, -1 on failure
+ */
+int initScan(regoScan* scan, const char* ranges, uint16_t passes, const char* statePath) {
+	int retval;
+
+	memset(scan, 0, sizeof(*scan));
+	scan->statePath = statePath;
+	scan->passInterval = REGO_SCAN_PASS_INTERVAL;
+	scan->entries = calloc(REGO_SCAN_ADDRESSES, sizeof(regoScanEntry));
+	if (scan->entries == NULL) {
+		fprintf(stderr, "initScan: out of memory\n");
+		return -1;
+	}
+
+	retval = statePath ? loadScan(scan) : 0;
+	if (retval < 0) {
+		freeScan(scan);
+		return -1;
+	}
+	if (retval == 0) {
+		if (parseScanRanges(scan, ranges) < 0) {
+			fprintf(stderr, "initScan: invalid address ranges %s\n", ranges);
+			freeScan(scan);
+			return -1;
+		}
+		memcpy(scan->header.magic, REGO_SCAN_MAGIC, sizeof(scan->header.magic));
+		scan->header.version = REGO_SCAN_VERSION;
+		scan->header.pass = 1;
+		scan->header.minTimeout = REGO_SCAN_MIN_TIMEOUT;
+	}
+	scan->header.passes = passes;
+	return retval;
+}
+
+/*
+ * Release the memory of the scan
+ */
+void freeScan(regoScan* scan) {
+	free(scan->entries);
+	scan->entries = NULL;
+}
+
+/*
+ * Read the checkpoint file, if it exists
+ * Returns 1 if a scan was loaded, 0 if there is no checkpoint, -1 if it is invalid
+ */
+int loadScan(regoScan* scan) {
+	size_t entriesSize = REGO_SCAN_ADDRESSES * sizeof(regoScanEntry);
+	int fd = open(scan->statePath, O_RDONLY);
+
+	if (fd < 0) {
+		if (errno == ENOENT) return 0;
+		fprintf(stderr, "initScan: cannot open %s: %s\n", scan->statePath, strerror(errno));
+		return -1;
+	}
+	if (read(fd, &scan->header, sizeof(scan->header)) != sizeof(scan->header)
+			|| read(fd, scan->entries, entriesSize) != (ssize_t) entriesSize
+			|| memcmp(scan->header.magic, REGO_SCAN_MAGIC, sizeof(scan->header.magic)) != 0
+			|| scan->header.version != REGO_SCAN_VERSION || scan->header.rangeCount == 0
+			|| scan->header.rangeCount > REGO_SCAN_MAX_RANGES || scan->header.next > REGO_SCAN_ADDRESSES) {
+		fprintf(stderr, "initScan: %s is not a scan checkpoint\n", scan->statePath);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	return 1;
+}
+
+/*
+ * Write the checkpoint file, replacing the old one in one step so that an
+ * interruption never leaves a partial file
+ * Returns 0 on success, -1 on failure
+ */
+int saveScan(regoScan* scan) {
+	char tmpPath[REGO_MAP_LINE_MAX];
+	size_t entriesSize = REGO_SCAN_ADDRESSES * sizeof(regoScanEntry);
+	int fd;
+
+	if (scan->statePath == NULL) return 0;
+	snprintf(tmpPath, sizeof(tmpPath), "%s.%d", scan->statePath, (int) getpid());
+	fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || write(fd, &scan->header, sizeof(scan->header)) != sizeof(scan->header)
+			|| write(fd, scan->entries, entriesSize) != (ssize_t) entriesSize
+			|| fsync(fd) < 0 || close(fd) < 0 || rename(tmpPath, scan->statePath) < 0) {
+		fprintf(stderr, "saveScan: cannot write %s: %s\n", scan->statePath, strerror(errno));
+		if (fd >= 0) unlink(tmpPath);
+		return -1;
+	}
+	scan->lastCheckpoint = time(NULL);
+	return 0;
+}
+
+/*
+ * Response timeout to probe with (ms). Until enough addresses have responded,
+ * the full timeout of the connection is used
+ */
+int getScanTimeout(regoScan* scan) {
+	regoScanHeader* h = &scan->header;
+	int timeout;
+
+	if (h->rttSamples < REGO_SCAN_LEARN_SAMPLES) return scan->maxTimeout;
+	timeout = (h->srtt + 4 * h->rttvar + 999) / 1000;
+	if (timeout < (int) h->minTimeout) timeout = h->minTimeout;
+	return timeout < scan->maxTimeout ? timeout : scan->maxTimeout;
+}
+
+/*
+ * Fold the round trip time of a response (us) into the smoothed mean and
+ * deviation, with the gains of TCP (1/8 and 1/4)
+ */
+void learnScanTiming(regoScan* scan, uint32_t latency) {
+	regoScanHeader* h = &scan->header;
+	int32_t err;
+
+	if (h->rttSamples++ == 0) {
+		h->srtt = latency;
+		h->rttvar = latency / 2;
+		return;
+	}
+	err = (int32_t) latency - (int32_t) h->srtt;
+	h->srtt += err / 8;
+	h->rttvar += ((err < 0 ? -err : err) - (int32_t) h->rttvar) / 4;
+}
+
+/*
+ * Read one address. Silence is the usual answer of an unused address, so a
+ * clean timeout with no input marks it unresponsive after one probe, and only
+ * replies that arrived partial, corrupt or late are retried as usual. A
+ * response that starts or arrives after the timeout means the timeout is too
+ * short for this controller, so its floor is raised to twice the timeout
+ * before the retry
+ * Returns 0 with the status and value of the read, or -1 if the port failed
+ */
+int probeScanAddress(regoScan* scan, rego_conn* conn, uint16_t address, int8_t* status, int16_t* value) {
+	struct pollfd pfd = { .fd = conn->fd, .events = POLLIN };
+	uint8_t attempt = 0;
+	int32_t wait;
+
+	do {
+		if (attempt > 0) flushInput(conn);
+		conn->responseTimeout = getScanTimeout(scan);
+		if (startTransaction(conn, COMMAND_READ_SYS_REG, address) < 0) return -1;
+		while (!continueTransaction(conn)) {
+			wait = getTimeLeft(conn);
+			if (poll(&pfd, 1, wait > 0 ? wait : 0) < 0 && errno != EINTR) return -1;
+		}
+		*status = decodeIntPacket(conn, value);
+
+		if (*status == RESPONSE_OK) {
+			learnScanTiming(scan, getLastLatency(conn));
+			break;
+		}
+		if (conn->len == 0 && poll(&pfd, 1, 0) <= 0) break;
+		if (*status == RESPONSE_TIMEOUT || *status == RESPONSE_INVALID_LENGTH) {
+			scan->lateResponses++;
+			scan->header.minTimeout = conn->responseTimeout * 2 < scan->maxTimeout ? conn->responseTimeout * 2 : scan->maxTimeout;
+		}
+	} while (attempt++ < conn->maxRetries && !scanStopFlag);
+
+	return 0;
+}
+
+/*
+ * Record the outcome of probing an address in the current pass
+ */
+void addScanSample(regoScan* scan, uint16_t address, int8_t status, int16_t value) {
+	regoScanEntry* entry = &scan->entries[address];
+
+	entry->pass = scan->header.pass;
+	entry->status = status;
+	if (status != RESPONSE_OK) return;
+
+	if (entry->reads == 0) {
+		entry->first = value;
+		entry->min = value;
+		entry->max = value;
+	} else {
+		if (value != entry->last && entry->changes < UINT16_MAX) entry->changes++;
+		if (value < entry->min) entry->min = value;
+		if (value > entry->max) entry->max = value;
+	}
+	entry->last = value;
+	if (entry->reads < UINT16_MAX) entry->reads++;
+}
+
+/*
+ * Run the scan until all passes are made or it is interrupted. Progress is
+ * checkpointed regularly, reported on stderr, and on SIGINT/SIGTERM
+ * Returns 0 when done, 1 if interrupted, -1 if the port failed
+ */
+int runScan(regoScan* scan, rego_conn* conn) {
+	regoScanHeader* h = &scan->header;
+	struct sigaction sa, oldInt, oldTerm;
+	time_t passStart = 0;
+	int8_t status = RESPONSE_TIMEOUT;
+	int16_t value = 0;
+	int retval = 0;
+
+	scan->maxTimeout = conn->responseTimeout;
+	scan->lastCheckpoint = time(NULL);
+	scanStopFlag = 0;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = scanSignalHandler;
+	sigaction(SIGINT, &sa, &oldInt);
+	sigaction(SIGTERM, &sa, &oldTerm);
+
+	while (h->pass <= h->passes && !scanStopFlag && retval == 0) {
+		// Passes are spaced out so that slowly changing values get to vary
+		if (h->next == 0) {
+			while (passStart && time(NULL) < passStart + (time_t) scan->passInterval && !scanStopFlag) sleep(1);
+			passStart = time(NULL);
+		}
+
+		for (; h->next < REGO_SCAN_ADDRESSES && !scanStopFlag; h->next++) {
+			if (h->pass == 1 ? !inScanRanges(scan, h->next) : scan->entries[h->next].reads == 0) continue;
+
+			if (time(NULL) - scan->lastCheckpoint >= REGO_SCAN_CHECKPOINT) {
+				fprintf(stderr, "runScan: pass %u/%u at %04x, timeout %d ms, %u late responses\n",
+					h->pass, h->passes, h->next, getScanTimeout(scan), scan->lateResponses);
+				saveScan(scan);
+			}
+			if (probeScanAddress(scan, conn, h->next, &status, &value) < 0) {
+				printConnError(conn);
+				retval = -1;
+				break;
+			}
+			addScanSample(scan, h->next, status, value);
+		}
+		if (h->next == REGO_SCAN_ADDRESSES) {
+			h->pass++;
+			h->next = 0;
+		}
+	}
+
+	conn->responseTimeout = scan->maxTimeout;
+	sigaction(SIGINT, &oldInt, NULL);
+	sigaction(SIGTERM, &oldTerm, NULL);
+	saveScan(scan);
+	return retval < 0 ? -1 : scanStopFlag ? 1 : 0;
+}
+
+/*
+ * Print the responsive addresses as a candidate register map. Registers in
+ * the map in use keep their definitions, others get a name from their
+ * address, and a type and priority guessed from the values seen: values of
+ * both 0 and 1 are taken for a bool, values that varied for a status flag or
+ * a sensor, and constant values for a setting
+ */
+void printScanMap(regoScan* scan, FILE* out) {
+	regoScanHeader* h = &scan->header;
+	regoScanEntry* entry;
+	char name[16], description[REGO_MAP_LINE_MAX];
+	uint32_t address, probed = 0, responsive = 0, i;
+	uint8_t type, priority;
+	uint16_t interval;
+	int16_t id;
+
+	for (address = 0; address < REGO_SCAN_ADDRESSES; address++) {
+		if (scan->entries[address].pass) probed++;
+		if (scan->entries[address].reads) responsive++;
+	}
+
+	fprintf(out, "# Candidate register map from a scan of");
+	for (i = 0; i < h->rangeCount; i++) fprintf(out, "%s 0x%04x-0x%04x", i ? "," : "", h->rangeFrom[i], h->rangeTo[i]);
+	fprintf(out, "\n# %u passes made, %u of %u addresses probed responded, timeout %d ms\n",
+		h->pass - 1, responsive, probed, getScanTimeout(scan));
+	fprintf(out, "# address name type flags interval priority description\n");
+
+	for (address = 0; address < REGO_SCAN_ADDRESSES; address++) {
+		entry = &scan->entries[address];
+		if (entry->reads == 0) continue;
+
+		id = getRegisterIdByAddress(address);
+		if (id >= 0) {
+			snprintf(description, sizeof(description), "%s (seen %d to %d, %u changes in %u reads)",
+				getRegisterDescriptionById(id), entry->min, entry->max, entry->changes, entry->reads);
+			printMapEntry(out, address, getRegisterNameById(id),
+				getRegisterTypeById(id) | (isGraphiteRegisterById(id) ? REG_TYPE_GRAPHITE : 0),
+				getRegisterIntervalById(id), getRegisterPriorityById(id), description);
+			continue;
+		}
+
+		type = entry->min == 0 && entry->max == 1 ? REG_TYPE_BOOL : REG_TYPE_UNKNOWN;
+		if (entry->changes == 0) {
+			priority = REG_PRIO_SETTING;
+			interval = 0;
+		} else if (type == REG_TYPE_BOOL) {
+			priority = REG_PRIO_STATUS;
+			interval = 10;
+		} else {
+			priority = REG_PRIO_SENSOR;
+			interval = 60;
+		}
+		snprintf(name, sizeof(name), "reg%04x", address);
+		snprintf(description, sizeof(description), "Seen %d to %d, %u changes in %u reads",
+			entry->min, entry->max, entry->changes, entry->reads);
+		printMapEntry(out, address, name, type, interval, priority, description);
+	}
+}
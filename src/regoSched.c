@@ -0,0 +1,260 @@
+/*
+ * regoSched.c
+ *
+ * Poll scheduler for the Rego637 heatpump client. Every known register is
+ * polled at its own interval, so fast-moving status flags and sensors are
+ * read often while settings are only read now and then.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h> /* For usleep() */
+
+#include <regoComm.h>
+#include <regoOutput.h>
+#include <regoSched.h>
+#include <regoSerialIO.h>
+#include <regoStats.h>
+
+/*****************************************************************************
+ * Internal function declarations
+ *****************************************************************************/
+
+void heapSiftUp(regoSchedule* sched, uint8_t prio, uint16_t pos);
+void heapSiftDown(regoSchedule* sched, uint8_t prio, uint16_t pos);
+void updateTransactionTime(regoSchedule* sched, uint32_t latency);
+
+/*****************************************************************************
+ * Functions
+ *****************************************************************************/
+
+/*
+ * Move a heap element towards the root until its parent is due earlier
+ */
+void heapSiftUp(regoSchedule* sched, uint8_t prio, uint16_t pos) {
+	uint16_t* heap = sched->heap[prio];
+	uint16_t parent, tmp;
+
+	while (pos > 0) {
+		parent = (pos - 1) / 2;
+		if (sched->entries[heap[parent]].due <= sched->entries[heap[pos]].due) break;
+		tmp = heap[parent]; heap[parent] = heap[pos]; heap[pos] = tmp;
+		pos = parent;
+	}
+}
+
+/*
+ * Move a heap element towards the leaves until both children are due later
+ */
+void heapSiftDown(regoSchedule* sched, uint8_t prio, uint16_t pos) {
+	uint16_t* heap = sched->heap[prio];
+	uint16_t len = sched->heapLen[prio];
+	uint16_t child, tmp;
+
+	while ((child = 2 * pos + 1) < len) {
+		if (child + 1 < len && sched->entries[heap[child + 1]].due < sched->entries[heap[child]].due) child++;
+		if (sched->entries[heap[pos]].due <= sched->entries[heap[child]].due) break;
+		tmp = heap[child]; heap[child] = heap[pos]; heap[pos] = tmp;
+		pos = child;
+	}
+}
+
+/*
+ * Build a schedule of all known registers that have a poll interval, honouring
+ * the same selection as read_known_registers
+ * Returns 0 on success, -1 if out of memory
+ */
+int initSchedule(regoSchedule* sched, rego_conn* conn) {
+	int64_t now = monotonicMillis();
+	schedEntry* entry;
+	uint8_t prio;
+	int16_t id;
+
+	sched->conn = conn;
+	sched->count = 0;
+	sched->avgTransaction = 0;
+	sched->overloadWarned = 0;
+	for (prio = 0; prio < REG_PRIO_COUNT; prio++) sched->heapLen[prio] = 0;
+
+	for (id = nextKnownRegister(conn, -1); id >= 0; id = nextKnownRegister(conn, id)) {
+		if (getRegisterIntervalById(id) > 0) sched->count++;
+	}
+
+	sched->entries = malloc((sched->count + 1) * sizeof(schedEntry));
+	if (sched->entries == NULL) return -1;
+	for (prio = 0; prio < REG_PRIO_COUNT; prio++) {
+		sched->heap[prio] = malloc((sched->count + 1) * sizeof(uint16_t));
+		if (sched->heap[prio] == NULL) return -1;
+	}
+
+	sched->count = 0;
+	for (id = nextKnownRegister(conn, -1); id >= 0; id = nextKnownRegister(conn, id)) {
+		if (getRegisterIntervalById(id) == 0) continue;
+
+		entry = &sched->entries[sched->count];
+		entry->address = getRegisterAddressById(id);
+		entry->interval = getRegisterIntervalById(id) * 1000;
+		entry->due = now;
+
+		prio = getRegisterPriorityById(id);
+		if (prio >= REG_PRIO_COUNT) prio = REG_PRIO_COUNT - 1;
+		sched->heap[prio][sched->heapLen[prio]] = sched->count++;
+		heapSiftUp(sched, prio, sched->heapLen[prio]++);
+	}
+
+	return 0;
+}
+
+/*
+ * Release the memory held by a schedule
+ */
+void freeSchedule(regoSchedule* sched) {
+	uint8_t prio;
+
+	free(sched->entries);
+	for (prio = 0; prio < REG_PRIO_COUNT; prio++) free(sched->heap[prio]);
+}
+
+/*
+ * Milliseconds until the next poll is due, 0 if one is already due or -1 if
+ * nothing is scheduled
+ */
+int32_t getScheduleWait(regoSchedule* sched) {
+	int64_t now = monotonicMillis(), wait = -1, due;
+	uint8_t prio;
+
+	for (prio = 0; prio < REG_PRIO_COUNT; prio++) {
+		if (sched->heapLen[prio] == 0) continue;
+		due = sched->entries[sched->heap[prio][0]].due - now;
+		if (due < 0) due = 0;
+		if (wait < 0 || due < wait) wait = due;
+	}
+
+	return wait;
+}
+
+/*
+ * Fold a transaction time into the moving average, and warn once if the
+ * schedule turns out not to fit in the link capacity
+ */
+void updateTransactionTime(regoSchedule* sched, uint32_t latency) {
+	if (sched->avgTransaction == 0) {
+		sched->avgTransaction = latency;
+	} else {
+		sched->avgTransaction += ((int32_t) latency - (int32_t) sched->avgTransaction) / 8;
+	}
+
+	if (!sched->overloadWarned && getScheduleLoad(sched) > 1000) {
+		fprintf(stderr, "Poll schedule needs %u.%u%% of the link capacity, polls will be late.\n",
+			getScheduleLoad(sched) / 10, getScheduleLoad(sched) % 10);
+		sched->overloadWarned = 1;
+	}
+}
+
+/*
+ * Poll and print the most urgent due register: the earliest due entry of the
+ * most urgent priority class that has one
+ * Returns 1 if a register was polled, 0 if nothing was due
+ */
+uint8_t runScheduledPoll(regoSchedule* sched) {
+	int64_t now = monotonicMillis();
+	schedEntry* entry;
+	int16_t value = 0;
+	int8_t retval;
+	uint8_t prio;
+
+	for (prio = 0; prio < REG_PRIO_COUNT; prio++) {
+		if (sched->heapLen[prio] && sched->entries[sched->heap[prio][0]].due <= now) break;
+	}
+	if (prio == REG_PRIO_COUNT) return 0;
+
+	entry = &sched->entries[sched->heap[prio][0]];
+	retval = queryRegister(sched->conn, entry->address, &value);
+	printRegisterValue(sched->conn, entry->address, retval, value);
+	updateTransactionTime(sched, getLastLatency(sched->conn));
+
+	// Keep the phase, but skip polls missed while the link was overloaded
+	entry->due += entry->interval;
+	now = monotonicMillis();
+	if (entry->due <= now) entry->due = now + entry->interval;
+	heapSiftDown(sched, prio, 0);
+
+	return 1;
+}
+
+/*
+ * Poll registers according to the schedule until the process is terminated
+ */
+void runSchedule(regoSchedule* sched) {
+	int32_t wait;
+
+	while ((wait = getScheduleWait(sched)) >= 0) {
+		if (wait > 0) {
+			flushOutput(sched->conn->output);
+			fflush(stdout);
+			usleep(wait * 1000);
+		}
+		runScheduledPoll(sched);
+		checkStatsDump(sched->conn);
+	}
+}
+
+/*
+ * Time a number of transactions to learn how long one takes on this link
+ */
+void measureLinkCapacity(regoSchedule* sched, uint8_t samples) {
+	int16_t value;
+	uint8_t i;
+
+	if (sched->count == 0) return;
+	for (i = 0; i < samples; i++) {
+		queryRegister(sched->conn, sched->entries[i % sched->count].address, &value);
+		updateTransactionTime(sched, getLastLatency(sched->conn));
+	}
+}
+
+/*
+ * Share of the link capacity the schedule needs, in 1/1000, based on the
+ * measured transaction time. Over 1000 means the schedule does not fit
+ */
+uint32_t getScheduleLoad(regoSchedule* sched) {
+	uint64_t load = 0;
+	uint16_t i;
+
+	// Sum in parts per million, transaction time is in us and intervals in ms
+	for (i = 0; i < sched->count; i++) {
+		load += (uint64_t) sched->avgTransaction * 1000 / sched->entries[i].interval;
+	}
+	return load / 1000;
+}
+
+/*
+ * Print the schedule and whether it fits in the measured link capacity
+ */
+void printScheduleReport(regoSchedule* sched) {
+	static const char* prioNames[REG_PRIO_COUNT] = { "status", "sensor", "setting" };
+	uint32_t rate[REG_PRIO_COUNT] = { 0 }, total = 0, load = getScheduleLoad(sched);
+	uint16_t count[REG_PRIO_COUNT] = { 0 };
+	uint8_t prio;
+	uint16_t i;
+
+	for (prio = 0; prio < REG_PRIO_COUNT; prio++) {
+		for (i = 0; i < sched->heapLen[prio]; i++) {
+			count[prio]++;
+			// Polls per hour
+			rate[prio] += 3600000 / sched->entries[sched->heap[prio][i]].interval;
+		}
+		total += rate[prio];
+		if (count[prio]) printf("%-11s %3u registers, %6u polls/hour\n", prioNames[prio], count[prio], rate[prio]);
+	}
+
+	printf("Schedule: %u polls/hour (%u.%02u polls/s)\n", total, total / 3600, total % 3600 * 100 / 3600);
+	if (sched->avgTransaction == 0) {
+		printf("Link capacity: unknown\n");
+		return;
+	}
+	printf("Link capacity: %u polls/s (%u us per transaction)\n",
+		1000000 / sched->avgTransaction, sched->avgTransaction);
+	printf("Utilization: %u.%u%% - %s\n", load / 10, load % 10,
+		load <= 1000 ? "schedule fits" : "schedule does NOT fit, polls will be late");
+}
@@ -6,81 +6,155 @@
 
 #include <errno.h>			/* For error handling */
 #include <fcntl.h>			/* For serial port locking */
+#include <poll.h>				/* For waiting on response bytes */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <termios.h>		/* For setting non-canonical I/O mode */
+#include <time.h>				/* For clock_gettime() */
+#include <unistd.h>
 
+#include <regoCapture.h>
 #include <regoSerialIO.h>
 #include <regoComm.h>
 
 /*****************************************************************************
- * Defines
+ * Types
  *****************************************************************************/
 
-// Buffer settings
-#define REGO_COM_BUF_SIZE	43
+/*
+ * UTF-8 encoding of an LCD character
+ */
+typedef struct {
+	uint8_t len;
+	char bytes[3];
+} lcdChar;
 
 /*****************************************************************************
  * Shared variables
  *****************************************************************************/
 
-// Packet buffer for the rego communications both send and receive
-struct {
-  char buffer[REGO_COM_BUF_SIZE];
-  uint8_t len;
-} regoPacket;
-
-// File descriptor for the serial port
-int fd;
+// LCD characters by code. The LCD shows M and m for J and j, and the upper
+// half is ISO-8859-1, taking two bytes in UTF-8
+const lcdChar lcdCharset[256] = {
+	{1, "\x00"}, {1, "\x01"}, {1, "\x02"}, {1, "\x03"}, {1, "\x04"}, {1, "\x05"}, {1, "\x06"}, {1, "\x07"},
+	{1, "\x08"}, {1, "\x09"}, {1, "\x0a"}, {1, "\x0b"}, {1, "\x0c"}, {1, "\x0d"}, {1, "\x0e"}, {1, "\x0f"},
+	{1, "\x10"}, {1, "\x11"}, {1, "\x12"}, {1, "\x13"}, {1, "\x14"}, {1, "\x15"}, {1, "\x16"}, {1, "\x17"},
+	{1, "\x18"}, {1, "\x19"}, {1, "\x1a"}, {1, "\x1b"}, {1, "\x1c"}, {1, "\x1d"}, {1, "\x1e"}, {1, "\x1f"},
+	{1, " "}, {1, "!"}, {1, "\""}, {1, "#"}, {1, "$"}, {1, "%"}, {1, "&"}, {1, "'"},
+	{1, "("}, {1, ")"}, {1, "*"}, {1, "+"}, {1, ","}, {1, "-"}, {1, "."}, {1, "/"},
+	{1, "0"}, {1, "1"}, {1, "2"}, {1, "3"}, {1, "4"}, {1, "5"}, {1, "6"}, {1, "7"},
+	{1, "8"}, {1, "9"}, {1, ":"}, {1, ";"}, {1, "<"}, {1, "="}, {1, ">"}, {1, "?"},
+	{1, "@"}, {1, "A"}, {1, "B"}, {1, "C"}, {1, "D"}, {1, "E"}, {1, "F"}, {1, "G"},
+	{1, "H"}, {1, "I"}, {1, "M"}, {1, "K"}, {1, "L"}, {1, "M"}, {1, "N"}, {1, "O"},
+	{1, "P"}, {1, "Q"}, {1, "R"}, {1, "S"}, {1, "T"}, {1, "U"}, {1, "V"}, {1, "W"},
+	{1, "X"}, {1, "Y"}, {1, "Z"}, {1, "["}, {1, "\\"}, {1, "]"}, {1, "^"}, {1, "_"},
+	{1, "`"}, {1, "a"}, {1, "b"}, {1, "c"}, {1, "d"}, {1, "e"}, {1, "f"}, {1, "g"},
+	{1, "h"}, {1, "i"}, {1, "m"}, {1, "k"}, {1, "l"}, {1, "m"}, {1, "n"}, {1, "o"},
+	{1, "p"}, {1, "q"}, {1, "r"}, {1, "s"}, {1, "t"}, {1, "u"}, {1, "v"}, {1, "w"},
+	{1, "x"}, {1, "y"}, {1, "z"}, {1, "{"}, {1, "|"}, {1, "}"}, {1, "~"}, {1, "\x7f"},
+	{2, "\xc2\x80"}, {2, "\xc2\x81"}, {2, "\xc2\x82"}, {2, "\xc2\x83"}, {2, "\xc2\x84"}, {2, "\xc2\x85"}, {2, "\xc2\x86"}, {2, "\xc2\x87"},
+	{2, "\xc2\x88"}, {2, "\xc2\x89"}, {2, "\xc2\x8a"}, {2, "\xc2\x8b"}, {2, "\xc2\x8c"}, {2, "\xc2\x8d"}, {2, "\xc2\x8e"}, {2, "\xc2\x8f"},
+	{2, "\xc2\x90"}, {2, "\xc2\x91"}, {2, "\xc2\x92"}, {2, "\xc2\x93"}, {2, "\xc2\x94"}, {2, "\xc2\x95"}, {2, "\xc2\x96"}, {2, "\xc2\x97"},
+	{2, "\xc2\x98"}, {2, "\xc2\x99"}, {2, "\xc2\x9a"}, {2, "\xc2\x9b"}, {2, "\xc2\x9c"}, {2, "\xc2\x9d"}, {2, "\xc2\x9e"}, {2, "\xc2\x9f"},
+	{2, "\xc2\xa0"}, {2, "\xc2\xa1"}, {2, "\xc2\xa2"}, {2, "\xc2\xa3"}, {2, "\xc2\xa4"}, {2, "\xc2\xa5"}, {2, "\xc2\xa6"}, {2, "\xc2\xa7"},
+	{2, "\xc2\xa8"}, {2, "\xc2\xa9"}, {2, "\xc2\xaa"}, {2, "\xc2\xab"}, {2, "\xc2\xac"}, {2, "\xc2\xad"}, {2, "\xc2\xae"}, {2, "\xc2\xaf"},
+	{2, "\xc2\xb0"}, {2, "\xc2\xb1"}, {2, "\xc2\xb2"}, {2, "\xc2\xb3"}, {2, "\xc2\xb4"}, {2, "\xc2\xb5"}, {2, "\xc2\xb6"}, {2, "\xc2\xb7"},
+	{2, "\xc2\xb8"}, {2, "\xc2\xb9"}, {2, "\xc2\xba"}, {2, "\xc2\xbb"}, {2, "\xc2\xbc"}, {2, "\xc2\xbd"}, {2, "\xc2\xbe"}, {2, "\xc2\xbf"},
+	{2, "\xc3\x80"}, {2, "\xc3\x81"}, {2, "\xc3\x82"}, {2, "\xc3\x83"}, {2, "\xc3\x84"}, {2, "\xc3\x85"}, {2, "\xc3\x86"}, {2, "\xc3\x87"},
+	{2, "\xc3\x88"}, {2, "\xc3\x89"}, {2, "\xc3\x8a"}, {2, "\xc3\x8b"}, {2, "\xc3\x8c"}, {2, "\xc3\x8d"}, {2, "\xc3\x8e"}, {2, "\xc3\x8f"},
+	{2, "\xc3\x90"}, {2, "\xc3\x91"}, {2, "\xc3\x92"}, {2, "\xc3\x93"}, {2, "\xc3\x94"}, {2, "\xc3\x95"}, {2, "\xc3\x96"}, {2, "\xc3\x97"},
+	{2, "\xc3\x98"}, {2, "\xc3\x99"}, {2, "\xc3\x9a"}, {2, "\xc3\x9b"}, {2, "\xc3\x9c"}, {2, "\xc3\x9d"}, {2, "\xc3\x9e"}, {2, "\xc3\x9f"},
+	{2, "\xc3\xa0"}, {2, "\xc3\xa1"}, {2, "\xc3\xa2"}, {2, "\xc3\xa3"}, {2, "\xc3\xa4"}, {2, "\xc3\xa5"}, {2, "\xc3\xa6"}, {2, "\xc3\xa7"},
+	{2, "\xc3\xa8"}, {2, "\xc3\xa9"}, {2, "\xc3\xaa"}, {2, "\xc3\xab"}, {2, "\xc3\xac"}, {2, "\xc3\xad"}, {2, "\xc3\xae"}, {2, "\xc3\xaf"},
+	{2, "\xc3\xb0"}, {2, "\xc3\xb1"}, {2, "\xc3\xb2"}, {2, "\xc3\xb3"}, {2, "\xc3\xb4"}, {2, "\xc3\xb5"}, {2, "\xc3\xb6"}, {2, "\xc3\xb7"},
+	{2, "\xc3\xb8"}, {2, "\xc3\xb9"}, {2, "\xc3\xba"}, {2, "\xc3\xbb"}, {2, "\xc3\xbc"}, {2, "\xc3\xbd"}, {2, "\xc3\xbe"}, {2, "\xc3\xbf"},
+};
 
 /*****************************************************************************
  * Internal function declarations
  *****************************************************************************/
 
-int16_t decodeInt(char* buffer);
 void encodeInt(char* buffer, int16_t number);
 uint8_t decodeText(char* buffer, char* text);
 char checksum(char* buffer, uint8_t len);
+uint32_t elapsedMicros(struct timespec* since);
+void rxRingPush(rego_conn* conn, char* data, uint8_t len);
+uint8_t extractFrame(rego_conn* conn, uint8_t expectedLen);
+int readAvailable(rego_conn* conn);
+void completeReceive(rego_conn* conn, uint8_t expectedLen);
 
 /*****************************************************************************
  * Functions
  *****************************************************************************/
 
 /*
- * Open serial port
+ * Initialize a connection handle with default settings. Must be called before
+ * the handle is used
  */
-void openSerialPort() {
-  char *portname = PORT_NAME;
-  fd = open(portname, O_RDWR | O_NOCTTY | O_SYNC);
-  if (fd < 0) {
-    perror("openSerialPort: error opening port");
-    exit(EXIT_FAILURE);
-  }
+void initConnection(rego_conn* conn) {
+	memset(conn, 0, sizeof(*conn));
+	conn->fd = -1;
+	conn->responseTimeout = REGO_RESPONSE_TIMEOUT;
+	conn->maxRetries = REGO_DEFAULT_RETRIES;
+	conn->cacheMaxAge = REGO_CACHE_DEFAULT_AGE;
+}
 
-  // Make sure we close port on program termination
-  atexit(closeSerialPort);
+/*
+ * Record a failed system call in the connection error state
+ */
+void setConnError(rego_conn* conn, const char* context) {
+	conn->lastErrno = errno;
+	conn->errorContext = context;
+}
 
-  // Set serial parameters
-  setSerialParams();
+/*
+ * Print the last system call error of the connection, like perror()
+ */
+void printConnError(rego_conn* conn) {
+	fprintf(stderr, "%s: %s\n", conn->errorContext ? conn->errorContext : "regoClient",
+		strerror(conn->lastErrno));
+}
+
+/*
+ * Open serial port
+ * Returns 0 on success, -1 with the connection error state set on failure
+ */
+int openSerialPort(rego_conn* conn, const char* portName) {
+	snprintf(conn->portName, sizeof(conn->portName), "%s", portName ? portName : PORT_NAME);
+	conn->fd = open(conn->portName, O_RDWR | O_NOCTTY | O_SYNC | O_CLOEXEC);
+	if (conn->fd < 0) {
+		setConnError(conn, "openSerialPort: error opening port");
+		return -1;
+	}
+
+	// Set serial parameters
+	if (setSerialParams(conn) < 0) {
+		closeSerialPort(conn);
+		return -1;
+	}
+	return 0;
 }
 
 /*
  * Close serial port
  */
-void closeSerialPort() {
-  close(fd);
+void closeSerialPort(rego_conn* conn) {
+	if (conn->fd >= 0) close(conn->fd);
+	conn->fd = -1;
 }
 
 /*
  * Set serial parameters
  */
-int setSerialParams() {
+int setSerialParams(rego_conn* conn) {
 	struct termios settings;
+	struct timespec lockStart;
 	struct flock fl;
 
-	if (tcgetattr(fd, &settings) < 0) {
-		perror("setSerialParams: error in tcgetattr");
-	    exit(EXIT_FAILURE);
+	if (tcgetattr(conn->fd, &settings) < 0) {
+		setConnError(conn, "setSerialParams: error in tcgetattr");
+		return -1;
 	}
 
 	//cfsetispeed(&settings, B19200);	// Set 19200 baud input rate. Not needed for ACM device?
@@ -93,12 +167,13 @@ int setSerialParams() {
 	settings.c_cflag &= ~(CSIZE | PARENB);
 	settings.c_cflag |= CS8;
 
-	settings.c_cc[VMIN] = 42;					// Largest datagram is 42 characters (in read)
-	settings.c_cc[VTIME] = 1;					// Wait 1/10 second before returning
+	/* Let read() return whatever is available, receivePacket() waits with poll() */
+	settings.c_cc[VMIN] = 0;
+	settings.c_cc[VTIME] = 0;
 
-	if (tcsetattr(fd, TCSANOW, &settings) < 0) {
-		perror("setSerialParams: error in tcsetattr");
-	    exit(EXIT_FAILURE);
+	if (tcsetattr(conn->fd, TCSANOW, &settings) < 0) {
+		setConnError(conn, "setSerialParams: error in tcsetattr");
+		return -1;
 	}
 
 	/* Set a write lock on the serial port. If the port is locked, wait for access */
@@ -108,11 +183,13 @@ int setSerialParams() {
 	fl.l_len = 0;        		/* length, 0 = to EOF           */
 	fl.l_pid = getpid(); 		/* our PID                      */
 
-	/* Implement a waiting lock. Exit if interrupted */
-	if (fcntl(fd, F_SETLKW, &fl) < 0) {
-		perror("setSerialParams: fcntl did not acquire lock");
-	    exit(EXIT_FAILURE);
+	/* Implement a waiting lock. Fail if interrupted */
+	clock_gettime(CLOCK_MONOTONIC, &lockStart);
+	if (fcntl(conn->fd, F_SETLKW, &fl) < 0) {
+		setConnError(conn, "setSerialParams: fcntl did not acquire lock");
+		return -1;
 	}
+	conn->lockWait += elapsedMicros(&lockStart);
 
 	return 0;
 }
@@ -141,33 +218,14 @@ void encodeInt(char* buffer, int16_t number) {
  * This needs to be used! 20 characters _may_ take up more than 22 bytes!
  */
 uint8_t decodeText(char* buffer, char* text) {
+	const lcdChar* c;
 	uint8_t i, j = 0;
-	unsigned char temp;
 
-	// Extract the 20 chars from the buffer
+	// Extract the 20 chars from the buffer, remapped from LCD to UTF-8
 	for (i = 0; i < 40; i+=2) {
-		text[j] = buffer[i] << 4 | buffer[i+1];
-
-		// Remap certain characters from LCD to UTF-8
-		switch (text[j]) {
-			case 'J':
-				text[j] = 'M';			
-				break;
-
-			case 'j':
-				text[j] = 'm';
-				break;
-		}
-
-		// *Magic* to convert high chars from ISO-8859-1 (single-byte)
-		// to UTF-8 (double-byte)
-		if (text[j] & 0x80) {
-			temp = text[j];
-			text[j++] = 0xc2 + (temp > 0xbf);
-			text[j] = (temp & 0x3f) + 0x80;
-		}
-
-		j++;
+		c = &lcdCharset[(uint8_t) (buffer[i] << 4 | buffer[i+1])];
+		memcpy(text + j, c->bytes, c->len);
+		j += c->len;
 	}
 
 	// Terminate with newline and null character
@@ -192,67 +250,306 @@ char checksum(char* buffer, uint8_t len) {
  * Build a 9 byte TX packet
  * Return value is packet length
  */
-uint8_t buildPacket(uint8_t device, uint8_t command, uint16_t reg, uint16_t data) {
-	regoPacket.buffer[0] = device;
-	regoPacket.buffer[1] = command;
-	encodeInt(regoPacket.buffer+2, reg);
-	encodeInt(regoPacket.buffer+5, data);
-	regoPacket.buffer[8] = checksum(regoPacket.buffer+2, 6);
-
-	regoPacket.len = 9;
-	return regoPacket.len;
+uint8_t buildPacket(rego_conn* conn, uint8_t device, uint8_t command, uint16_t reg, uint16_t data) {
+	conn->buffer[0] = device;
+	conn->buffer[1] = command;
+	encodeInt(conn->buffer+2, reg);
+	encodeInt(conn->buffer+5, data);
+	conn->buffer[8] = checksum(conn->buffer+2, 6);
+
+	conn->len = 9;
+	return conn->len;
 }
 
 /*
  * Pretty print a packet
  */
-void prettyPrintPacket() {
+void prettyPrintPacket(rego_conn* conn) {
 	uint8_t i;
 	printf("[ ");
-	for (i = 0; i < regoPacket.len; i++) {
+	for (i = 0; i < conn->len; i++) {
 		if ((i % 10 == 0) && (i > 0)) printf("\n  ");
-		printf("%02x ", regoPacket.buffer[i] & 0xff);
+		printf("%02x ", conn->buffer[i] & 0xff);
 	}
 	printf("]\n");
 }
 
 /*
- * Receive packet into buffer
+ * Microseconds elapsed on the monotonic clock since the given time
+ */
+uint32_t elapsedMicros(struct timespec* since) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000000 + (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+/*
+ * Current monotonic time in milliseconds
+ */
+int64_t monotonicMillis() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * Current monotonic time in microseconds
  */
-uint8_t receivePacket() {
-  regoPacket.len = read(fd, regoPacket.buffer, REGO_COM_BUF_SIZE);
-  return regoPacket.len;
+uint64_t monotonicMicros() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/*
+ * Expected response length for a command
+ */
+uint8_t responseLength(uint8_t command) {
+	switch (command) {
+		case COMMAND_READ_DISPLAY:
+			return REGO_LEN_DISPLAY_RESPONSE;
+		default:
+			return REGO_LEN_INT_RESPONSE;
+	}
+}
+
+/*
+ * Append received bytes to the ring buffer. Oldest bytes are overwritten if full
+ */
+void rxRingPush(rego_conn* conn, char* data, uint8_t len) {
+	uint8_t i;
+	for (i = 0; i < len; i++) {
+		conn->ring[conn->ringHead++ & REGO_RX_RING_MASK] = data[i];
+	}
+	if ((uint16_t) (conn->ringHead - conn->ringTail) > REGO_RX_RING_SIZE) {
+		conn->discardedBytes += (uint16_t) (conn->ringHead - conn->ringTail) - REGO_RX_RING_SIZE;
+		conn->ringTail = conn->ringHead - REGO_RX_RING_SIZE;
+	}
+}
+
+/*
+ * Try to extract a frame of the expected length from the ring buffer
+ * Skips garbage up to the next DEVICE_ME header. A header followed by a bad
+ * checksum is treated as a false start and the search resumes at the next byte,
+ * leaving the rejected frame in the packet buffer so the caller can report it.
+ * Returns 1 if a valid frame was copied to the packet buffer, 0 if more bytes are needed
+ */
+uint8_t extractFrame(rego_conn* conn, uint8_t expectedLen) {
+	uint8_t i;
+	char frame[REGO_COM_BUF_SIZE];
+
+	while (1) {
+		// Resynchronize on the header byte
+		while (conn->ringTail != conn->ringHead && conn->ring[conn->ringTail & REGO_RX_RING_MASK] != DEVICE_ME) {
+			conn->ringTail++;
+			conn->discardedBytes++;
+		}
+		if ((uint16_t) (conn->ringHead - conn->ringTail) < expectedLen) return 0;
+
+		for (i = 0; i < expectedLen; i++) {
+			frame[i] = conn->ring[(conn->ringTail + i) & REGO_RX_RING_MASK];
+		}
+
+		if (checksum(frame+1, expectedLen-2) == frame[expectedLen-1] || conn->ignoreChecksumsFlag) {
+			memcpy(conn->buffer, frame, expectedLen);
+			conn->len = expectedLen;
+			conn->ringTail += expectedLen;
+			return 1;
+		}
+
+		// False start, keep the rejected frame for diagnostics and resume after it
+		memcpy(conn->buffer, frame, expectedLen);
+		conn->len = expectedLen;
+		conn->ringTail++;
+		conn->discardedBytes++;
+	}
+}
+
+/*
+ * Read whatever input is available into the ring buffer without blocking
+ * Returns the number of bytes read, or -1 on error or if the port hung up
+ */
+int readAvailable(rego_conn* conn) {
+	struct pollfd pfd = { .fd = conn->fd, .events = POLLIN };
+	char chunk[REGO_COM_BUF_SIZE];
+	ssize_t n;
+
+	n = read(conn->fd, chunk, sizeof(chunk));
+	if (n < 0) {
+		if (errno == EINTR || errno == EAGAIN) return 0;
+		setConnError(conn, "receivePacket: error in read");
+		return -1;
+	}
+
+	// A port that hung up (USB adapter unplugged, pty closed) polls readable
+	// but reads nothing, which would spin the caller until its deadline
+	if (n == 0 && poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR))) {
+		errno = EIO;
+		setConnError(conn, "receivePacket: port hung up");
+		return -1;
+	}
+	if (n > 0 && conn->firstByteLatency == 0) conn->firstByteLatency = elapsedMicros(&conn->sendTime) | 1;
+	rxRingPush(conn, chunk, n);
+	return n;
+}
+
+/*
+ * Finish receiving a response. If no valid or rejected frame was found,
+ * whatever partial frame arrived is left in the packet buffer for decoding
+ */
+void completeReceive(rego_conn* conn, uint8_t expectedLen) {
+	uint8_t i;
+
+	if (conn->len == 0) {
+		conn->len = conn->ringHead - conn->ringTail;
+		if (conn->len > expectedLen) conn->len = expectedLen;
+		for (i = 0; i < conn->len; i++) {
+			conn->buffer[i] = conn->ring[(conn->ringTail + i) & REGO_RX_RING_MASK];
+		}
+	}
+
+	conn->lastLatency = elapsedMicros(&conn->sendTime);
+	conn->lastReceive = monotonicMillis();
+	if (conn->capture) captureFrame(conn->capture, REGO_CAPTURE_RECEIVED, conn->buffer, conn->len);
+}
+
+/*
+ * Receive packet of expected length into buffer
+ * Bytes are reassembled across partial reads and stray bytes before the frame
+ * header are skipped. Returns as soon as a valid frame is complete, or once
+ * conn->responseTimeout milliseconds have passed since sendPacket(). On timeout
+ * the packet buffer holds the last rejected frame or the partial frame received.
+ */
+uint8_t receivePacket(rego_conn* conn, uint8_t expectedLen) {
+	struct pollfd pfd = { .fd = conn->fd, .events = POLLIN };
+	int32_t remaining;
+	int n;
+
+	if (expectedLen > REGO_COM_BUF_SIZE) expectedLen = REGO_COM_BUF_SIZE;
+	conn->len = 0;
+
+	while (!extractFrame(conn, expectedLen)) {
+		remaining = getTimeLeft(conn);
+		if (remaining <= 0) break;
+
+		n = poll(&pfd, 1, remaining);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			setConnError(conn, "receivePacket: error in poll");
+			break;
+		} else if (n == 0) {
+			break;
+		}
+
+		if (readAvailable(conn) < 0) break;
+	}
+
+	completeReceive(conn, expectedLen);
+	return conn->len;
+}
+
+/*
+ * Milliseconds left until the response to the last sendPacket() is overdue
+ */
+int32_t getTimeLeft(rego_conn* conn) {
+	return conn->responseTimeout - (int32_t) (elapsedMicros(&conn->sendTime) / 1000);
+}
+
+/*
+ * Start a transaction without waiting for the response. The caller waits for
+ * the port to become readable, or for getTimeLeft() to run out, and then calls
+ * continueTransaction()
+ * Returns 0 on success, -1 if the request could not be sent
+ */
+int startTransaction(rego_conn* conn, uint8_t command, uint16_t reg) {
+	buildPacket(conn, DEVICE_HEATPUMP, command, reg, 0);
+	if (conn->showPacketsFlag) { puts("Sending packet: "); prettyPrintPacket(conn); }
+	conn->expectedLen = responseLength(command);
+	if (sendPacket(conn) < 0) {
+		conn->len = 0;
+		return -1;
+	}
+	conn->len = 0;
+	return 0;
+}
+
+/*
+ * Advance a transaction started with startTransaction() without blocking
+ * Returns 1 when the transaction is complete and the response can be decoded,
+ * which also happens when it has timed out, or 0 if still waiting
+ */
+uint8_t continueTransaction(rego_conn* conn) {
+	if (!extractFrame(conn, conn->expectedLen)) {
+		if (readAvailable(conn) >= 0 && !extractFrame(conn, conn->expectedLen) && getTimeLeft(conn) > 0) {
+			return 0;
+		}
+	}
+
+	completeReceive(conn, conn->expectedLen);
+	if (conn->showPacketsFlag) { puts("Received packet: "); prettyPrintPacket(conn); }
+	return 1;
+}
+
+/*
+ * Discard any stale input, both in the ring buffer and in the kernel queue
+ */
+void flushInput(rego_conn* conn) {
+	tcflush(conn->fd, TCIFLUSH);
+	conn->ringTail = conn->ringHead;
+}
+
+/*
+ * Number of bytes skipped so far while resynchronizing on frame headers
+ */
+uint32_t getDiscardedBytes(rego_conn* conn) {
+	return conn->discardedBytes;
 }
 
 /*
  * Send packet already in buffer
  */
-void sendPacket() {
-	write(fd, regoPacket.buffer, regoPacket.len);
+int sendPacket(rego_conn* conn) {
+	// Responses never outlive their request, anything left over is stale
+	conn->ringTail = conn->ringHead;
+	conn->firstByteLatency = 0;
+	clock_gettime(CLOCK_MONOTONIC, &conn->sendTime);
+	if (conn->capture) captureFrame(conn->capture, REGO_CAPTURE_SENT, conn->buffer, conn->len);
+	if (write(conn->fd, conn->buffer, conn->len) != conn->len) {
+		setConnError(conn, "sendPacket: error in write");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Round trip time in microseconds of the last sendPacket()/receivePacket()
+ */
+uint32_t getLastLatency(rego_conn* conn) {
+	return conn->lastLatency;
 }
 
 /*
  * Decode a received response packet containing an integer
  */
-int8_t decodeIntPacket(int16_t* value) {
-	if (regoPacket.len == 0) {
+int8_t decodeIntPacket(rego_conn* conn, int16_t* value) {
+	if (conn->len == 0) {
 		return RESPONSE_TIMEOUT;
-	} else if (regoPacket.len != 5) {
+	} else if (conn->len != 5) {
 		return RESPONSE_INVALID_LENGTH;
 	}
-	if (regoPacket.buffer[0] != DEVICE_ME) {
+	if (conn->buffer[0] != DEVICE_ME) {
 		return RESPONSE_INVALID_ADDRESS;
 	}
-	if (checksum(regoPacket.buffer+1, 3) != regoPacket.buffer[4]) {
-		if (ignoreChecksumsFlag) {
-			printf("Checksum error: %02x != %02x\n", checksum(regoPacket.buffer+1, 3), regoPacket.buffer[4]);
+	if (checksum(conn->buffer+1, 3) != conn->buffer[4]) {
+		if (conn->ignoreChecksumsFlag) {
+			printf("Checksum error: %02x != %02x\n", checksum(conn->buffer+1, 3), conn->buffer[4]);
 		} else {
 			return RESPONSE_CHECKSUM_ERROR;
 		}
 	}
 
 	// Packet is valid, decode data
-	*value = decodeInt(regoPacket.buffer+1);
+	*value = decodeInt(conn->buffer+1);
 	return RESPONSE_OK;
 }
 
@@ -261,25 +558,25 @@ int8_t decodeIntPacket(int16_t* value) {
  * len = returned number of bytes
  * text = char array to decode into 
  */
-int8_t decodeDisplayPacket(uint8_t* len, char* text) {
-	if (regoPacket.len == 0) {
+int8_t decodeDisplayPacket(rego_conn* conn, uint8_t* len, char* text) {
+	if (conn->len == 0) {
 		return RESPONSE_TIMEOUT;
-	} else if (regoPacket.len != 42) {
+	} else if (conn->len != 42) {
 		return RESPONSE_INVALID_LENGTH;
 	}
-	if (regoPacket.buffer[0] != DEVICE_ME) {
+	if (conn->buffer[0] != DEVICE_ME) {
 		return RESPONSE_INVALID_ADDRESS;
 	}
-	if (checksum(regoPacket.buffer+1, 40) != regoPacket.buffer[41]) {
-		if (ignoreChecksumsFlag) {
-			printf("Checksum error: %02x != %02x\n", checksum(regoPacket.buffer+1, 40), regoPacket.buffer[41]);
+	if (checksum(conn->buffer+1, 40) != conn->buffer[41]) {
+		if (conn->ignoreChecksumsFlag) {
+			printf("Checksum error: %02x != %02x\n", checksum(conn->buffer+1, 40), conn->buffer[41]);
 		} else {
 			return RESPONSE_CHECKSUM_ERROR;
 		}
 	}
 
 	// Packet is valid, decode data
-	*len = decodeText(regoPacket.buffer+1, text);
+	*len = decodeText(conn->buffer+1, text);
 	return RESPONSE_OK;
 }
 
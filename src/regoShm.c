@@ -0,0 +1,220 @@
+/*
+ * regoShm.c
+ *
+ * Snapshot of the latest value of every known register in a POSIX shared
+ * memory segment, so local consumers can read current values without taking
+ * the serial port. The publisher guards the entries with a seqlock: readers
+ * copy them without any locking and retry if a write overlapped the copy, so
+ * any number of readers cost the publisher nothing.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>				/* For flock() */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <regoComm.h>
+#include <regoShm.h>
+
+/*****************************************************************************
+ * Internal function declarations
+ *****************************************************************************/
+
+void beginShmWrite(regoShm* shm);
+void endShmWrite(regoShm* shm);
+
+/*****************************************************************************
+ * Functions
+ *****************************************************************************/
+
+/*
+ * Make the sequence odd before writing entries. The release fence keeps the
+ * entry stores from being seen before the odd sequence
+ */
+void beginShmWrite(regoShm* shm) {
+	__atomic_store_n(&shm->header->sequence, shm->header->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/*
+ * Make the sequence even again once the entries are written
+ */
+void endShmWrite(regoShm* shm) {
+	__atomic_store_n(&shm->header->sequence, shm->header->sequence + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Open the segment with the given name, such as "/regoClient". The publisher
+ * creates it if needed and fills in the registers of the register map, and
+ * only one process at a time can publish to a segment. Readers need the
+ * segment to exist
+ * Returns 0 on success, -1 on failure
+ */
+int openShm(regoShm* shm, const char* name, uint8_t writable) {
+	struct stat st;
+	size_t size;
+	int16_t id;
+
+	memset(shm, 0, sizeof(*shm));
+	shm->writable = writable;
+	shm->fd = shm_open(name, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+	if (shm->fd < 0) {
+		fprintf(stderr, "openShm: cannot open %s: %s\n", name, strerror(errno));
+		return -1;
+	}
+	if (writable && flock(shm->fd, LOCK_EX | LOCK_NB) < 0) {
+		fprintf(stderr, "openShm: %s is in use by another process\n", name);
+		close(shm->fd);
+		shm->fd = -1;
+		return -1;
+	}
+	if (fstat(shm->fd, &st) < 0) goto fail;
+
+	// The segment is never shrunk, as readers may have the old size mapped
+	size = sizeof(regoShmHeader) + (size_t) getKnownRegisterCount() * sizeof(regoShmEntry);
+	if (writable && (size_t) st.st_size < size) {
+		if (ftruncate(shm->fd, size) < 0) goto fail;
+		st.st_size = size;
+	}
+	if ((size_t) st.st_size < sizeof(regoShmHeader)) {
+		fprintf(stderr, "openShm: %s is not a register snapshot\n", name);
+		goto close;
+	}
+
+	shm->mapSize = st.st_size;
+	shm->map = mmap(NULL, shm->mapSize, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, shm->fd, 0);
+	if (shm->map == MAP_FAILED) {
+		shm->map = NULL;
+		goto fail;
+	}
+	shm->header = (regoShmHeader*) shm->map;
+	shm->entries = (regoShmEntry*) (shm->map + sizeof(regoShmHeader));
+	shm->capacity = (shm->mapSize - sizeof(regoShmHeader)) / sizeof(regoShmEntry);
+
+	if (writable) {
+		// A publisher killed while writing left the sequence odd. The sequence
+		// carries on from the old one, so a reader spanning the restart retries
+		if (shm->header->sequence & 1) shm->header->sequence++;
+		beginShmWrite(shm);
+		memcpy(shm->header->magic, REGO_SHM_MAGIC, sizeof(REGO_SHM_MAGIC));
+		shm->header->version = REGO_SHM_VERSION;
+		shm->header->entrySize = sizeof(regoShmEntry);
+		shm->header->count = getKnownRegisterCount();
+		shm->header->capacity = shm->capacity;
+		shm->header->pid = getpid();
+		memset(shm->entries, 0, shm->capacity * sizeof(regoShmEntry));
+		for (id = 0; id < getKnownRegisterCount(); id++) {
+			snprintf(shm->entries[id].name, REGO_SHM_NAME_SIZE, "%s", getRegisterNameById(id));
+			shm->entries[id].address = getRegisterAddressById(id);
+			shm->entries[id].type = getRegisterTypeById(id);
+			shm->entries[id].status = RESPONSE_TIMEOUT;
+		}
+		endShmWrite(shm);
+	} else if (memcmp(shm->header->magic, REGO_SHM_MAGIC, sizeof(REGO_SHM_MAGIC)) != 0
+			|| shm->header->version != REGO_SHM_VERSION || shm->header->entrySize != sizeof(regoShmEntry)) {
+		fprintf(stderr, "openShm: %s has an unsupported format\n", name);
+		goto close;
+	}
+	return 0;
+
+fail:
+	fprintf(stderr, "openShm: error opening %s: %s\n", name, strerror(errno));
+close:
+	if (shm->map) munmap(shm->map, shm->mapSize);
+	close(shm->fd);
+	shm->map = NULL;
+	shm->fd = -1;
+	return -1;
+}
+
+/*
+ * Unmap the segment. It is left in place, so readers still get the last
+ * values, and their read times tell how old they are
+ */
+void closeShm(regoShm* shm) {
+	if (shm->map == NULL) return;
+	munmap(shm->map, shm->mapSize);
+	close(shm->fd);
+	shm->map = NULL;
+	shm->fd = -1;
+}
+
+/*
+ * Publish a read of the register with the given ID. A failed read only
+ * updates the status and read time, keeping the last good value
+ */
+void publishShm(regoShm* shm, int16_t id, int8_t status, int16_t value, uint32_t time) {
+	regoShmEntry* entry;
+
+	if (shm->map == NULL || !shm->writable || id < 0 || (uint32_t) id >= shm->header->count) return;
+
+	entry = &shm->entries[id];
+	beginShmWrite(shm);
+	entry->status = status;
+	entry->readTime = time;
+	if (status == RESPONSE_OK) {
+		entry->value = value;
+		entry->valueTime = time;
+	}
+	endShmWrite(shm);
+}
+
+/*
+ * Copy a consistent snapshot of up to max entries
+ * Returns the number of entries copied, -1 if the publisher kept writing
+ */
+int readShmSnapshot(regoShm* shm, regoShmEntry* entries, uint32_t max) {
+	uint32_t sequence, count, tries;
+
+	if (shm->map == NULL) return -1;
+
+	for (tries = 0; tries < REGO_SHM_READ_TRIES; tries++) {
+		sequence = __atomic_load_n(&shm->header->sequence, __ATOMIC_ACQUIRE);
+		if (sequence & 1) continue;
+
+		// The count is only trusted as far as the entries mapped here
+		count = shm->header->count;
+		if (count > shm->capacity) count = shm->capacity;
+		if (count > max) count = max;
+		memcpy(entries, shm->entries, count * sizeof(regoShmEntry));
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&shm->header->sequence, __ATOMIC_RELAXED) == sequence) return count;
+	}
+	return -1;
+}
+
+/*
+ * Copy a consistent snapshot of the entry of one register
+ * Returns 1 if found, 0 if the register is not in the segment, -1 if the
+ * publisher kept writing
+ */
+int readShmRegister(regoShm* shm, uint16_t address, regoShmEntry* entry) {
+	uint32_t sequence, count, i, tries;
+	uint8_t found;
+
+	if (shm->map == NULL) return -1;
+
+	for (tries = 0; tries < REGO_SHM_READ_TRIES; tries++) {
+		sequence = __atomic_load_n(&shm->header->sequence, __ATOMIC_ACQUIRE);
+		if (sequence & 1) continue;
+
+		count = shm->header->count;
+		if (count > shm->capacity) count = shm->capacity;
+		found = 0;
+		for (i = 0; i < count; i++) {
+			if (shm->entries[i].address != address) continue;
+			memcpy(entry, &shm->entries[i], sizeof(regoShmEntry));
+			found = 1;
+			break;
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&shm->header->sequence, __ATOMIC_RELAXED) == sequence) return found;
+	}
+	return -1;
+}
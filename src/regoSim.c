@@ -0,0 +1,370 @@
+/*
+ * regoSim.c
+ *
+ * Rego637 heatpump controller simulator. Opens a pseudo-terminal and answers
+ * register and display requests on it like the controller does, so the client
+ * can be tested and benchmarked without hardware. Faults such as slow, split,
+ * truncated or corrupted responses can be injected at configurable rates.
+ *
+ * The path of the pseudo-terminal is printed on stdout when ready, and the
+ * client is pointed at it with --port.
+ */
+
+#define _XOPEN_SOURCE 600		/* For posix_openpt() etc */
+#define _DEFAULT_SOURCE			/* For cfmakeraw() */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+/*****************************************************************************
+ * Defines
+ *****************************************************************************/
+
+// Rego constants, as seen from the controller
+#define DEVICE_ME               0x01
+#define DEVICE_HEATPUMP         0x81
+#define COMMAND_READ_SYS_REG    0x02
+#define COMMAND_READ_DISPLAY		0x20
+
+#define REQUEST_LEN							9
+#define DISPLAY_ROWS						4
+#define DISPLAY_COLS						20
+
+/*****************************************************************************
+ * Shared variables
+ *****************************************************************************/
+
+// Register image, indexed by address
+int16_t registers[0x10000];
+
+// LCD contents, raw display characters
+char display[DISPLAY_ROWS][DISPLAY_COLS];
+
+// Fault injection settings, set from the command line
+int latency = 0;				// Delay before each response (ms)
+int splitSize = 0;			// Write responses in chunks of this size, 0 = whole
+int dropRate = 0;				// Chance (%) to drop a byte from a response
+int corruptRate = 0;		// Chance (%) to corrupt a response checksum
+int garbageRate = 0;		// Chance (%) of stray bytes before a response
+int silentRate = 0;			// Chance (%) not to respond at all
+
+// Request counter, reported on exit
+unsigned long requests = 0;
+
+volatile sig_atomic_t stopFlag = 0;
+
+/*****************************************************************************
+ * Functions
+ *****************************************************************************/
+
+void printUsage(char* cmd) {
+	printf("Usage: %s [options]\n"
+	       "\nAvailable options:\n"
+	       "             --link (path) - Also make the pseudo-terminal available at path\n"
+	       "        --registers (file) - Load register image, lines of 'address value'\n"
+	       "        --set (addr=value) - Set a single register\n"
+	       "          --display (file) - Load LCD contents, 4 lines of up to 20 chars\n"
+	       "            --latency (ms) - Delay before each response\n"
+	       "            --split (size) - Write responses in chunks of size bytes, 1 ms apart\n"
+	       "             --drop (rate) - Chance in %% to drop a byte from a response\n"
+	       "          --corrupt (rate) - Chance in %% to corrupt a response checksum\n"
+	       "          --garbage (rate) - Chance in %% of stray bytes before a response\n"
+	       "           --silent (rate) - Chance in %% to not respond at all\n"
+	       "                --seed (n) - Seed for fault injection\n", cmd);
+}
+
+void stopHandler(int sig) {
+	stopFlag = 1;
+}
+
+/*
+ * Chance in percent
+ */
+int chance(int rate) {
+	return rate > 0 && rand() % 100 < rate;
+}
+
+/*
+ * Encode a 16-bit integer as three 7-bit bytes
+ */
+void encodeInt(char* buffer, int16_t number) {
+	buffer[2] = number & 0x7f;
+	number >>= 7;
+	buffer[1] = number & 0x7f;
+	number >>= 7;
+	buffer[0] = number & 0x03;
+}
+
+/*
+ * Decode three 7-bit bytes to a 16-bit integer
+ */
+uint16_t decodeInt(char* buffer) {
+	return (buffer[0] << 14) | (buffer[1] << 7) | buffer[2];
+}
+
+/*
+ * XOR checksum
+ */
+char checksum(char* buffer, int len) {
+	char sum = 0;
+	while (len--) sum ^= *buffer++;
+	return sum;
+}
+
+/*
+ * Default register image and display, loosely resembling a running heatpump
+ */
+void loadDefaults() {
+	int row;
+
+	registers[0x0000] = 40;		// Heat curve 4.0
+	registers[0x0021] = 200;	// Room temperature setting 20.0
+	registers[0x01fd] = 1;		// Ground loop pump on
+	registers[0x01fe] = 1;		// Compressor on
+	registers[0x0204] = 1;		// Heat carrier pump on
+	registers[0x0209] = 312;	// GT1 31.2
+	registers[0x020a] = -52;	// GT2 -5.2
+	registers[0x020d] = 211;	// GT5 21.1
+	registers[0x020e] = 754;	// GT6 75.4
+	registers[0x020f] = 356;	// GT8 35.6
+	registers[0x0210] = 298;	// GT9 29.8
+	registers[0x0211] = 14;		// GT10 1.4
+	registers[0x0212] = -19;	// GT11 -1.9
+	registers[0x0213] = 493;	// GT3 49.3
+
+	for (row = 0; row < DISPLAY_ROWS; row++) memset(display[row], ' ', DISPLAY_COLS);
+	memcpy(display[0], "Rego 637 simulator", 18);
+	memcpy(display[1], "GT1 31.2 C", 10);
+	memcpy(display[2], "Kompressor p\xe5", 13);
+	memcpy(display[3], "Larm: inga", 10);
+}
+
+/*
+ * Load a register image, one 'address value' pair per line
+ */
+int loadRegisters(char* path) {
+	char line[64];
+	long address, value;
+	FILE* f = fopen(path, "r");
+
+	if (f == NULL) {
+		perror("loadRegisters: error opening register file");
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%li %li", &address, &value) == 2) registers[address & 0xffff] = value;
+	}
+	fclose(f);
+	return 0;
+}
+
+/*
+ * Load LCD contents, one row per line
+ */
+int loadDisplay(char* path) {
+	char line[64];
+	size_t len;
+	int row = 0;
+	FILE* f = fopen(path, "r");
+
+	if (f == NULL) {
+		perror("loadDisplay: error opening display file");
+		return -1;
+	}
+	for (row = 0; row < DISPLAY_ROWS; row++) memset(display[row], ' ', DISPLAY_COLS);
+	for (row = 0; row < DISPLAY_ROWS && fgets(line, sizeof(line), f); row++) {
+		len = strcspn(line, "\r\n");
+		memcpy(display[row], line, len > DISPLAY_COLS ? DISPLAY_COLS : len);
+	}
+	fclose(f);
+	return 0;
+}
+
+/*
+ * Open the master side of a pseudo-terminal in raw mode
+ * The slave side is kept open too, so the master does not see a hangup
+ * between client runs
+ */
+int openPty(int* slaveFd) {
+	struct termios settings;
+	int fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+	if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0) {
+		perror("openPty: error creating pseudo-terminal");
+		return -1;
+	}
+
+	*slaveFd = open(ptsname(fd), O_RDWR | O_NOCTTY);
+	if (*slaveFd < 0) {
+		perror("openPty: error opening pseudo-terminal slave");
+		return -1;
+	}
+
+	tcgetattr(*slaveFd, &settings);
+	cfmakeraw(&settings);
+	tcsetattr(*slaveFd, TCSANOW, &settings);
+	return fd;
+}
+
+/*
+ * Write a response, applying the configured faults
+ */
+void sendResponse(int fd, char* response, int len) {
+	char garbage[3] = { 0x55, DEVICE_ME, 0x7f };
+	int pos, chunk;
+
+	if (chance(silentRate)) return;
+	if (latency) usleep(latency * 1000);
+
+	if (chance(corruptRate)) response[len-1] ^= 0x10;
+	if (chance(dropRate)) {
+		pos = rand() % len;
+		memmove(response + pos, response + pos + 1, len - pos - 1);
+		len--;
+	}
+	if (chance(garbageRate)) write(fd, garbage, 1 + rand() % sizeof(garbage));
+
+	for (pos = 0; pos < len; pos += chunk) {
+		chunk = splitSize > 0 ? splitSize : len;
+		if (chunk > len - pos) chunk = len - pos;
+		write(fd, response + pos, chunk);
+		if (pos + chunk < len) usleep(1000);
+	}
+}
+
+/*
+ * Answer a complete, valid request
+ */
+void handleRequest(int fd, char* request) {
+	char response[42];
+	uint16_t reg = decodeInt(request + 2);
+	int i, row;
+
+	requests++;
+	response[0] = DEVICE_ME;
+
+	switch (request[1]) {
+		case COMMAND_READ_SYS_REG:
+			encodeInt(response + 1, registers[reg]);
+			response[4] = checksum(response + 1, 3);
+			sendResponse(fd, response, 5);
+			break;
+
+		case COMMAND_READ_DISPLAY:
+			row = reg % DISPLAY_ROWS;
+			for (i = 0; i < DISPLAY_COLS; i++) {
+				response[1 + 2*i] = (display[row][i] >> 4) & 0x0f;
+				response[2 + 2*i] = display[row][i] & 0x0f;
+			}
+			response[41] = checksum(response + 1, 40);
+			sendResponse(fd, response, 42);
+			break;
+	}
+}
+
+int main(int argc, char** argv) {
+	char buffer[256], *eq;
+	char* linkPath = NULL;
+	struct sigaction sa;
+	int fd, slaveFd, c, len = 0, n;
+
+	loadDefaults();
+
+	while (1) {
+		static struct option long_options[] = {
+			{"link", required_argument, 0, 'l'},
+			{"registers", required_argument, 0, 'r'},
+			{"set", required_argument, 0, 's'},
+			{"display", required_argument, 0, 'd'},
+			{"latency", required_argument, 0, 'L'},
+			{"split", required_argument, 0, 'S'},
+			{"drop", required_argument, 0, 'D'},
+			{"corrupt", required_argument, 0, 'C'},
+			{"garbage", required_argument, 0, 'G'},
+			{"silent", required_argument, 0, 'Q'},
+			{"seed", required_argument, 0, 'x'},
+			{"help", no_argument, 0, 'h'},
+			{0, 0, 0, 0}
+		};
+		c = getopt_long(argc, argv, "", long_options, NULL);
+		if (c == -1) break;
+
+		switch (c) {
+			case 'l': linkPath = optarg; break;
+			case 'r': if (loadRegisters(optarg) < 0) exit(EXIT_FAILURE); break;
+			case 's':
+				eq = strchr(optarg, '=');
+				if (eq == NULL) {
+					printf("Invalid register setting %s.\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				registers[strtol(optarg, NULL, 0) & 0xffff] = strtol(eq + 1, NULL, 0);
+				break;
+			case 'd': if (loadDisplay(optarg) < 0) exit(EXIT_FAILURE); break;
+			case 'L': latency = atoi(optarg); break;
+			case 'S': splitSize = atoi(optarg); break;
+			case 'D': dropRate = atoi(optarg); break;
+			case 'C': corruptRate = atoi(optarg); break;
+			case 'G': garbageRate = atoi(optarg); break;
+			case 'Q': silentRate = atoi(optarg); break;
+			case 'x': srand(atoi(optarg)); break;
+			case 'h': printUsage(argv[0]); exit(0);
+			default: printUsage(argv[0]); exit(EXIT_FAILURE);
+		}
+	}
+
+	fd = openPty(&slaveFd);
+	if (fd < 0) exit(EXIT_FAILURE);
+
+	if (linkPath) {
+		unlink(linkPath);
+		if (symlink(ptsname(fd), linkPath) < 0) {
+			perror("regoSim: error creating link");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stopHandler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	printf("%s\n", ptsname(fd));
+	fflush(stdout);
+
+	while (!stopFlag) {
+		n = read(fd, buffer + len, sizeof(buffer) - len);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror("regoSim: error in read");
+			break;
+		}
+		len += n;
+
+		// Frame requests on the header byte and checksum, skipping anything else
+		while (len >= REQUEST_LEN) {
+			if (buffer[0] == (char) DEVICE_HEATPUMP && checksum(buffer + 2, 6) == buffer[8]) {
+				handleRequest(fd, buffer);
+				n = REQUEST_LEN;
+			} else {
+				n = 1;
+			}
+			memmove(buffer, buffer + n, len - n);
+			len -= n;
+		}
+	}
+
+	if (linkPath) unlink(linkPath);
+	fprintf(stderr, "regoSim: %lu requests served\n", requests);
+	close(slaveFd);
+	close(fd);
+	return 0;
+}
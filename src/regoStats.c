@@ -0,0 +1,239 @@
+/*
+ * regoStats.c
+ *
+ * Transaction instrumentation for the Rego637 heatpump controller. Records
+ * response latencies as log2 histograms, per command type and per register,
+ * and counts failed transactions by cause. Collection is off unless
+ * enableStats() has been called for the connection.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <regoComm.h>
+#include <regoSerialIO.h>
+#include <regoStats.h>
+
+/*****************************************************************************
+ * Shared variables
+ *****************************************************************************/
+
+volatile sig_atomic_t statsDumpRequested = 0;
+
+/*****************************************************************************
+ * Internal function declarations
+ *****************************************************************************/
+
+uint8_t bucketIndex(uint32_t micros);
+uint32_t bucketLowerBound(uint8_t bucket);
+void histogramAdd(regoHistogram* hist, uint32_t micros);
+uint32_t histogramPercentile(regoHistogram* hist, uint8_t percent);
+void printLatencyStats(FILE* out, const char* label, regoLatencyStats* stats);
+void printHistogram(FILE* out, regoHistogram* hist);
+
+/*****************************************************************************
+ * Functions
+ *****************************************************************************/
+
+/*
+ * Start collecting statistics for the connection
+ * Returns 0 on success, -1 if out of memory
+ */
+int enableStats(rego_conn* conn) {
+	regoStats* stats;
+
+	if (conn->stats == NULL) {
+		stats = calloc(1, sizeof(regoStats));
+		if (stats == NULL) return -1;
+		stats->regCount = getKnownRegisterCount();
+		stats->reg = calloc(stats->regCount + 1, sizeof(regoLatencyStats));
+		if (stats->reg == NULL) {
+			free(stats);
+			return -1;
+		}
+		stats->since = monotonicMillis();
+		conn->stats = stats;
+	}
+	return 0;
+}
+
+/*
+ * Stop collecting statistics and release them
+ */
+void freeStats(rego_conn* conn) {
+	if (conn->stats) free(conn->stats->reg);
+	free(conn->stats);
+	conn->stats = NULL;
+}
+
+/*
+ * Histogram bucket of a latency. Below 4 us every value has its own bucket,
+ * above that the two bits after the leading one pick the sub-bucket
+ */
+uint8_t bucketIndex(uint32_t micros) {
+	uint8_t msb;
+	uint32_t bucket;
+
+	if (micros < REGO_STATS_SUB_BUCKETS) return micros;
+	msb = 31 - __builtin_clz(micros);
+	bucket = (msb - 1) * REGO_STATS_SUB_BUCKETS + ((micros >> (msb - 2)) & (REGO_STATS_SUB_BUCKETS - 1));
+	return bucket < REGO_STATS_BUCKETS ? bucket : REGO_STATS_BUCKETS - 1;
+}
+
+/*
+ * Smallest latency (us) counted in a bucket
+ */
+uint32_t bucketLowerBound(uint8_t bucket) {
+	uint8_t msb = bucket / REGO_STATS_SUB_BUCKETS + 1;
+
+	if (bucket < REGO_STATS_SUB_BUCKETS) return bucket;
+	return (uint32_t) (REGO_STATS_SUB_BUCKETS + bucket % REGO_STATS_SUB_BUCKETS) << (msb - 2);
+}
+
+/*
+ * Add a sample to a histogram
+ */
+void histogramAdd(regoHistogram* hist, uint32_t micros) {
+	hist->buckets[bucketIndex(micros)]++;
+	hist->count++;
+	hist->sum += micros;
+	if (micros > hist->max) hist->max = micros;
+}
+
+/*
+ * Upper bound (us) of the bucket holding the given percentile, limited to
+ * the slowest sample
+ */
+uint32_t histogramPercentile(regoHistogram* hist, uint8_t percent) {
+	uint32_t rank = ((uint64_t) hist->count * percent + 99) / 100, seen = 0;
+	uint8_t bucket;
+
+	if (hist->count == 0) return 0;
+	for (bucket = 0; bucket < REGO_STATS_BUCKETS - 1; bucket++) {
+		seen += hist->buckets[bucket];
+		if (seen >= rank) break;
+	}
+	if (bucket == REGO_STATS_BUCKETS - 1 || bucketLowerBound(bucket + 1) - 1 > hist->max) return hist->max;
+	return bucketLowerBound(bucket + 1) - 1;
+}
+
+/*
+ * Record the outcome of one transaction attempt, called once the response has
+ * been decoded. The completion latency is only recorded for valid responses,
+ * failures are counted by cause instead
+ */
+void recordTransaction(rego_conn* conn, uint8_t command, uint16_t reg, int8_t status) {
+	regoStats* stats = conn->stats;
+	regoLatencyStats* cmd;
+	regoLatencyStats* regStats = NULL;
+	int16_t id;
+
+	if (stats == NULL) return;
+
+	stats->transactions++;
+	if (status != RESPONSE_OK && status >= RESPONSE_INVALID_ADDRESS) stats->errors[-status]++;
+
+	if (command == COMMAND_READ_DISPLAY) {
+		cmd = &stats->command[REGO_STATS_CMD_DISPLAY];
+	} else {
+		cmd = &stats->command[REGO_STATS_CMD_REGISTER];
+		id = getRegisterIdByAddress(reg);
+		regStats = &stats->reg[id >= 0 && id < stats->regCount ? id : stats->regCount];
+	}
+
+	if (conn->firstByteLatency) {
+		histogramAdd(&cmd->firstByte, conn->firstByteLatency);
+		if (regStats) histogramAdd(&regStats->firstByte, conn->firstByteLatency);
+	}
+	if (status == RESPONSE_OK) {
+		histogramAdd(&cmd->complete, conn->lastLatency);
+		if (regStats) histogramAdd(&regStats->complete, conn->lastLatency);
+	}
+}
+
+/*
+ * Print one line of latency figures
+ */
+void printLatencyStats(FILE* out, const char* label, regoLatencyStats* stats) {
+	fprintf(out, "%-44.44s %7u %7u %7u %7u %7u %7u %8u\n", label,
+		stats->complete.count,
+		histogramPercentile(&stats->firstByte, 50), histogramPercentile(&stats->firstByte, 99),
+		histogramPercentile(&stats->complete, 50), histogramPercentile(&stats->complete, 99),
+		stats->complete.count ? (uint32_t) (stats->complete.sum / stats->complete.count) : 0,
+		stats->complete.max);
+}
+
+/*
+ * Print the non-empty buckets of a histogram
+ */
+void printHistogram(FILE* out, regoHistogram* hist) {
+	uint8_t bucket;
+
+	for (bucket = 0; bucket < REGO_STATS_BUCKETS; bucket++) {
+		if (hist->buckets[bucket] == 0) continue;
+		if (bucket == REGO_STATS_BUCKETS - 1) {
+			fprintf(out, "    %8u us and up  %7u\n", bucketLowerBound(bucket), hist->buckets[bucket]);
+		} else {
+			fprintf(out, "    %8u - %8u us %7u\n", bucketLowerBound(bucket), bucketLowerBound(bucket + 1) - 1, hist->buckets[bucket]);
+		}
+	}
+}
+
+/*
+ * Print the statistics collected for the connection
+ */
+void printStats(rego_conn* conn, FILE* out) {
+	static const char* commandNames[REGO_STATS_COMMANDS] = { "register reads", "display reads" };
+	regoStats* stats = conn->stats;
+	char label[64];
+	int64_t elapsed;
+	int16_t i;
+
+	if (stats == NULL) return;
+	elapsed = monotonicMillis() - stats->since;
+
+	fprintf(out, "Statistics for %s over %lld.%03lld s\n", conn->portName,
+		(long long) (elapsed / 1000), (long long) (elapsed % 1000));
+	fprintf(out, "Transactions: %u, timeouts: %u, checksum errors: %u, invalid length: %u, invalid address: %u\n",
+		stats->transactions, stats->errors[-RESPONSE_TIMEOUT], stats->errors[-RESPONSE_CHECKSUM_ERROR],
+		stats->errors[-RESPONSE_INVALID_LENGTH], stats->errors[-RESPONSE_INVALID_ADDRESS]);
+	fprintf(out, "Port lock wait: %u us, bytes discarded: %u\n", conn->lockWait, getDiscardedBytes(conn));
+
+	fprintf(out, "\n%-44s %7s %7s %7s %7s %7s %7s %8s\n", "Latency (us)", "ok",
+		"1st p50", "1st p99", "p50", "p99", "mean", "max");
+	for (i = 0; i < REGO_STATS_COMMANDS; i++) {
+		if (stats->command[i].firstByte.count) printLatencyStats(out, commandNames[i], &stats->command[i]);
+	}
+	for (i = 0; i <= stats->regCount; i++) {
+		if (stats->reg[i].firstByte.count == 0) continue;
+		if (i == stats->regCount) {
+			snprintf(label, sizeof(label), "  other registers");
+		} else {
+			snprintf(label, sizeof(label), "  %04x %s", getRegisterAddressById(i), getRegisterNameById(i));
+		}
+		printLatencyStats(out, label, &stats->reg[i]);
+	}
+
+	for (i = 0; i < REGO_STATS_COMMANDS; i++) {
+		if (stats->command[i].complete.count == 0) continue;
+		fprintf(out, "\nCompletion latency of %s:\n", commandNames[i]);
+		printHistogram(out, &stats->command[i].complete);
+	}
+	fflush(out);
+}
+
+/*
+ * Signal handler requesting a statistics dump, e.g. for SIGUSR1
+ */
+void statsSignalHandler(int sig) {
+	statsDumpRequested = 1;
+}
+
+/*
+ * Print the statistics to stderr if a dump has been requested
+ */
+void checkStatsDump(rego_conn* conn) {
+	if (!statsDumpRequested) return;
+	statsDumpRequested = 0;
+	printStats(conn, stderr);
+}
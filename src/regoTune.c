@@ -0,0 +1,290 @@
+/*
+ * regoTune.c
+ *
+ * Tuning of the serial transport. A profile sets the line rate, the driver's
+ * low latency mode, a quiet gap between a response and the next request, and
+ * the response timeout. The calibration measures the round trip times and
+ * errors of each combination on the port, picks the fastest one that is
+ * reliable, and profiles are kept per port in a text file that later runs
+ * load when they open the port.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/serial.h>		/* For ASYNC_LOW_LATENCY */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <regoComm.h>
+#include <regoSerialIO.h>
+#include <regoTune.h>
+
+/*****************************************************************************
+ * Internal function declarations
+ *****************************************************************************/
+
+uint8_t isBetterProfile(uint8_t reliable, uint64_t cost, uint16_t errors, uint8_t bestReliable, uint64_t bestCost, uint16_t bestErrors);
+void restorePort(rego_conn* conn, const struct termios* settings, int lowLatency);
+
+/*****************************************************************************
+ * Functions
+ *****************************************************************************/
+
+/*
+ * Apply a profile to an open port
+ * Returns 0 on success, -1 with the connection error state set if the port
+ * does not support a setting
+ */
+int applySerialProfile(rego_conn* conn, const regoSerialProfile* profile) {
+	struct serial_struct serial;
+	struct termios settings;
+
+	if (profile->baud) {
+		if (profile->baud != REGO_TUNE_BAUD) {
+			errno = EINVAL;
+			setConnError(conn, "applySerialProfile: unsupported baud rate");
+			return -1;
+		}
+		if (tcgetattr(conn->fd, &settings) < 0 || cfsetispeed(&settings, B19200) < 0
+				|| cfsetospeed(&settings, B19200) < 0 || tcsetattr(conn->fd, TCSANOW, &settings) < 0) {
+			setConnError(conn, "applySerialProfile: error setting baud rate");
+			return -1;
+		}
+	}
+
+	// Only real serial drivers have the low latency flag, ptys and some USB
+	// adapters do not
+	if (ioctl(conn->fd, TIOCGSERIAL, &serial) < 0) {
+		if (profile->lowLatency) {
+			setConnError(conn, "applySerialProfile: low latency mode not supported");
+			return -1;
+		}
+	} else if (((serial.flags & ASYNC_LOW_LATENCY) != 0) != profile->lowLatency) {
+		serial.flags ^= ASYNC_LOW_LATENCY;
+		if (ioctl(conn->fd, TIOCSSERIAL, &serial) < 0) {
+			setConnError(conn, "applySerialProfile: error setting low latency mode");
+			return -1;
+		}
+	}
+
+	conn->requestGap = profile->gap;
+	if (profile->timeout) conn->responseTimeout = profile->timeout;
+	return 0;
+}
+
+/*
+ * Compare a measured profile with the best so far. Reliable profiles beat
+ * unreliable ones, the fastest reliable one wins, and among unreliable ones
+ * the one with the fewest errors
+ * Returns 1 if the profile is better
+ */
+uint8_t isBetterProfile(uint8_t reliable, uint64_t cost, uint16_t errors, uint8_t bestReliable, uint64_t bestCost, uint16_t bestErrors) {
+	if (reliable != bestReliable) return reliable;
+	if (reliable) return cost < bestCost;
+	return errors < bestErrors || (errors == bestErrors && cost < bestCost);
+}
+
+/*
+ * Put back the line settings and low latency flag a port had before it was
+ * calibrated. lowLatency is -1 if the driver has no such flag
+ */
+void restorePort(rego_conn* conn, const struct termios* settings, int lowLatency) {
+	struct serial_struct serial;
+
+	tcsetattr(conn->fd, TCSANOW, settings);
+	if (lowLatency < 0 || ioctl(conn->fd, TIOCGSERIAL, &serial) < 0) return;
+	if (((serial.flags & ASYNC_LOW_LATENCY) != 0) != lowLatency) {
+		serial.flags ^= ASYNC_LOW_LATENCY;
+		ioctl(conn->fd, TIOCSSERIAL, &serial);
+	}
+}
+
+/*
+ * Measure each profile with the given number of reads of the first register
+ * of the map, and a quarter as many reads of display rows, and apply the best
+ * one. The timeout of the best profile allows four times its slowest round
+ * trip, which is that of a display row, as its response is the longest. A
+ * table of the measurements is written to report
+ * Returns 0 if a reliable profile was found, 1 if only unreliable ones were,
+ * or -1 if the port could not be measured at all
+ */
+int calibratePort(rego_conn* conn, uint16_t reads, regoSerialProfile* best, FILE* report) {
+	static const uint16_t gaps[] = { 0, 10, 50 };
+	regoSerialProfile profile;
+	struct serial_struct serial;
+	struct termios original;
+	uint64_t start, elapsed, cost, sum, bestCost = 0;
+	uint32_t max, displayMax;
+	uint16_t i, errors, bestErrors = 0, reg = getRegisterAddressById(0);
+	uint16_t displayReads = reads / 4 + 1, total = reads + displayReads;
+	char text[REGO_DISPLAY_ROW_SIZE];
+	uint8_t len;
+	uint8_t rate, lowLatency, gap, reliable, bestReliable = 0, found = 0;
+	int maxRetries = conn->maxRetries, responseTimeout = conn->responseTimeout, originalLowLatency = -1;
+	int16_t value;
+
+	if (tcgetattr(conn->fd, &original) < 0) {
+		setConnError(conn, "calibratePort: error in tcgetattr");
+		return -1;
+	}
+	if (ioctl(conn->fd, TIOCGSERIAL, &serial) == 0) originalLowLatency = (serial.flags & ASYNC_LOW_LATENCY) != 0;
+
+	fprintf(report, "   baud  low latency  gap (ms)  errors  mean (us)   max (us)  display (us)  per read (us)\n");
+	for (rate = 0; rate < 2; rate++) {
+		for (lowLatency = 0; lowLatency < 2; lowLatency++) {
+			for (gap = 0; gap < sizeof(gaps) / sizeof(gaps[0]); gap++) {
+				memset(&profile, 0, sizeof(profile));
+				profile.baud = rate ? REGO_TUNE_BAUD : 0;
+				profile.lowLatency = lowLatency;
+				profile.gap = gaps[gap];
+
+				// Each profile starts from the port's own settings
+				tcsetattr(conn->fd, TCSANOW, &original);
+				fprintf(report, "%7s  %11s  %8u  ", rate ? "19200" : "as is", lowLatency ? "on" : "off", profile.gap);
+				if (applySerialProfile(conn, &profile) < 0) {
+					fprintf(report, "not supported\n");
+					continue;
+				}
+
+				// Reads without retries, from a clean line and no pacing
+				// left over from the previous profile
+				conn->maxRetries = 0;
+				conn->responseTimeout = responseTimeout;
+				conn->linkErrorRate = 0;
+				flushInput(conn);
+				errors = 0;
+				sum = 0;
+				max = 0;
+				displayMax = 0;
+				start = monotonicMicros();
+				for (i = 0; i < reads; i++) {
+					if (queryRegister(conn, reg, &value) != RESPONSE_OK) {
+						errors++;
+						continue;
+					}
+					sum += conn->lastLatency;
+					if (conn->lastLatency > max) max = conn->lastLatency;
+				}
+				for (i = 0; i < displayReads; i++) {
+					if (queryDisplayRow(conn, i % REGO_DISPLAY_ROWS, text, &len) != RESPONSE_OK) {
+						errors++;
+						continue;
+					}
+					if (conn->lastLatency > displayMax) displayMax = conn->lastLatency;
+				}
+				elapsed = monotonicMicros() - start;
+
+				if (errors == total) {
+					fprintf(report, "%6u          -          -             -              -\n", errors);
+					cost = UINT64_MAX;
+				} else {
+					cost = elapsed / (total - errors);
+					fprintf(report, "%6u  %9llu  %9u  %12u  %13llu\n", errors,
+						(unsigned long long) (reads > errors ? sum / (reads - errors) : 0), max, displayMax,
+						(unsigned long long) cost);
+				}
+
+				reliable = (uint32_t) errors * 1000 <= (uint32_t) total * REGO_TUNE_MAX_ERROR_RATE;
+				if (!found || isBetterProfile(reliable, cost, errors, bestReliable, bestCost, bestErrors)) {
+					*best = profile;
+					best->timeout = 4 * (displayMax > max ? displayMax : max) / 1000 + 1;
+					if (best->timeout < REGO_TUNE_MIN_TIMEOUT) best->timeout = REGO_TUNE_MIN_TIMEOUT;
+					if (best->timeout > responseTimeout) best->timeout = responseTimeout;
+					bestReliable = reliable;
+					bestCost = cost;
+					bestErrors = errors;
+					found = 1;
+				}
+			}
+		}
+	}
+
+	// The best profile is applied on top of the port's own settings, and if it
+	// can not be, the port is left as it was found
+	conn->maxRetries = maxRetries;
+	conn->responseTimeout = responseTimeout;
+	restorePort(conn, &original, originalLowLatency);
+	if (!found || bestErrors == total) return -1;
+	if (applySerialProfile(conn, best) < 0) {
+		restorePort(conn, &original, originalLowLatency);
+		return -1;
+	}
+	return bestReliable ? 0 : 1;
+}
+
+/*
+ * Look up the profile of a port in the profile file. Lines hold the port path
+ * followed by baud=, low_latency=, gap= and timeout= settings, and lines
+ * starting with # are comments
+ * Returns 1 if the port has a profile, 0 if not, -1 if the file can not be read
+ */
+int loadSerialProfile(const char* path, const char* portName, regoSerialProfile* profile) {
+	char line[REGO_PROFILE_LINE_MAX];
+	char* token;
+	FILE* in;
+	int found = 0;
+
+	in = fopen(path, "r");
+	if (in == NULL) {
+		if (errno == ENOENT) return 0;
+		fprintf(stderr, "loadSerialProfile: cannot open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	while (!found && fgets(line, sizeof(line), in)) {
+		token = strtok(line, " \t\r\n");
+		if (token == NULL || token[0] == '#' || strcmp(token, portName) != 0) continue;
+
+		memset(profile, 0, sizeof(*profile));
+		while ((token = strtok(NULL, " \t\r\n")) != NULL) {
+			if (strncmp(token, "baud=", 5) == 0) profile->baud = strtoul(token + 5, NULL, 0);
+			else if (strncmp(token, "low_latency=", 12) == 0) profile->lowLatency = strtoul(token + 12, NULL, 0) != 0;
+			else if (strncmp(token, "gap=", 4) == 0) profile->gap = strtoul(token + 4, NULL, 0);
+			else if (strncmp(token, "timeout=", 8) == 0) profile->timeout = strtoul(token + 8, NULL, 0);
+			else fprintf(stderr, "loadSerialProfile: %s: unknown setting %s\n", path, token);
+		}
+		found = 1;
+	}
+	fclose(in);
+	return found;
+}
+
+/*
+ * Store the profile of a port in the profile file, replacing its old profile
+ * and keeping those of other ports. The file is replaced in one step
+ * Returns 0 on success, -1 on failure
+ */
+int saveSerialProfile(const char* path, const char* portName, const regoSerialProfile* profile) {
+	char tmpPath[REGO_PROFILE_LINE_MAX], line[REGO_PROFILE_LINE_MAX], name[REGO_PORT_NAME_SIZE];
+	FILE* in;
+	FILE* out;
+
+	snprintf(tmpPath, sizeof(tmpPath), "%s.%d", path, (int) getpid());
+	out = fopen(tmpPath, "w");
+	if (out == NULL) {
+		fprintf(stderr, "saveSerialProfile: cannot write %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	in = fopen(path, "r");
+	if (in) {
+		while (fgets(line, sizeof(line), in)) {
+			if (sscanf(line, "%63s", name) == 1 && strcmp(name, portName) == 0) continue;
+			fputs(line, out);
+		}
+		fclose(in);
+	}
+	fprintf(out, "%s baud=%u low_latency=%u gap=%u timeout=%u\n", portName, profile->baud, profile->lowLatency,
+		profile->gap, profile->timeout);
+
+	if (fflush(out) == EOF || fsync(fileno(out)) < 0 || fclose(out) == EOF || rename(tmpPath, path) < 0) {
+		fprintf(stderr, "saveSerialProfile: cannot write %s: %s\n", path, strerror(errno));
+		unlink(tmpPath);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,238 @@
+/*
+ * regoWatch.c
+ *
+ * Fast polling of the bool status registers, such as status.alarm and
+ * status.compressor, for reacting to their edges within seconds instead of a
+ * sweep interval. Only the bool registers are read, and a change becomes an
+ * edge once it has persisted for the debounce time. Each edge is output as a
+ * sample, appended to the ring log and can run a hook command, at most so
+ * many per minute.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <regoComm.h>
+#include <regoLog.h>
+#include <regoOutput.h>
+#include <regoStats.h>
+#include <regoWatch.h>
+
+/*****************************************************************************
+ * Internal function declarations
+ *****************************************************************************/
+
+uint8_t takeHookToken(regoWatch* watch, int64_t now);
+void runHook(regoWatch* watch, uint16_t bit, uint8_t value, uint32_t edgeTime);
+void emitEdge(regoWatch* watch, uint16_t bit, uint8_t value, uint32_t edgeTime);
+
+/*****************************************************************************
+ * Functions
+ *****************************************************************************/
+
+/*
+ * Set up a watcher of all bool registers in the register map. hookRate 0
+ * runs the hook on every edge, otherwise it is at most REGO_WATCH_HOOK_RATE_MAX
+ * Returns 0 on success, -1 if the map has no bool registers, -2 if out of memory
+ */
+int initWatch(regoWatch* watch, rego_conn* conn, uint32_t debounce, const char* hook, uint32_t hookRate) {
+	int16_t id;
+
+	memset(watch, 0, sizeof(*watch));
+	watch->conn = conn;
+	watch->debounce = debounce;
+	watch->hook = hook;
+	watch->hookRate = hookRate;
+	watch->hookTokens = hookRate * 1000;
+	watch->hookRefill = monotonicMillis();
+
+	for (id = 0; id < getKnownRegisterCount(); id++) {
+		if (getRegisterTypeById(id) == REG_TYPE_BOOL) watch->count++;
+	}
+	if (watch->count == 0) return -1;
+
+	watch->words = (watch->count + 63) / 64;
+	watch->ids = malloc(watch->count * sizeof(int16_t));
+	watch->pendingSince = calloc(watch->count, sizeof(int64_t));
+	watch->state = calloc(watch->words * 5, sizeof(uint64_t));
+	if (watch->ids == NULL || watch->pendingSince == NULL || watch->state == NULL) {
+		freeWatch(watch);
+		return -2;
+	}
+	watch->known = watch->state + watch->words;
+	watch->pending = watch->known + watch->words;
+	watch->reading = watch->pending + watch->words;
+	watch->valid = watch->reading + watch->words;
+
+	watch->count = 0;
+	for (id = 0; id < getKnownRegisterCount(); id++) {
+		if (getRegisterTypeById(id) == REG_TYPE_BOOL) watch->ids[watch->count++] = id;
+	}
+	return 0;
+}
+
+/*
+ * Release the memory of the watcher
+ */
+void freeWatch(regoWatch* watch) {
+	free(watch->ids);
+	free(watch->pendingSince);
+	free(watch->state);
+	watch->ids = NULL;
+	watch->pendingSince = NULL;
+	watch->state = NULL;
+}
+
+/*
+ * Take a token from the hook bucket, which fills up at hookRate per minute
+ * Returns 1 if the hook may run
+ */
+uint8_t takeHookToken(regoWatch* watch, int64_t now) {
+	uint64_t tokens;
+
+	if (watch->hookRate == 0) return 1;
+	tokens = watch->hookTokens + (uint64_t) (now - watch->hookRefill) * watch->hookRate / 60;
+	watch->hookTokens = tokens > watch->hookRate * 1000 ? watch->hookRate * 1000 : tokens;
+	watch->hookRefill = now;
+
+	if (watch->hookTokens < 1000) return 0;
+	watch->hookTokens -= 1000;
+	return 1;
+}
+
+/*
+ * Run the hook command in the background, with the edge in its environment:
+ * REGO_TAG, REGO_ADDRESS, REGO_REGISTER, REGO_VALUE and REGO_TIME. The port,
+ * sockets, log and capture are opened close-on-exec, and the shared snapshot
+ * is by shm_open(), so a hook that leaves a process behind holds none of
+ * their locks
+ */
+void runHook(regoWatch* watch, uint16_t bit, uint8_t value, uint32_t edgeTime) {
+	char number[16];
+	pid_t pid;
+
+	if (!takeHookToken(watch, monotonicMillis())) {
+		if (watch->hooksSuppressed++ == 0) fprintf(stderr, "runHook: more than %u edges per minute, skipping hooks\n", watch->hookRate);
+		return;
+	}
+	if (watch->hooksSuppressed) {
+		fprintf(stderr, "runHook: %u hooks skipped\n", watch->hooksSuppressed);
+		watch->hooksSuppressed = 0;
+	}
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		perror("runHook: error in fork");
+		return;
+	}
+	if (pid > 0) return;
+
+	setenv("REGO_TAG", watch->conn->tag, 1);
+	snprintf(number, sizeof(number), "0x%04x", getRegisterAddressById(watch->ids[bit]));
+	setenv("REGO_ADDRESS", number, 1);
+	setenv("REGO_REGISTER", getRegisterNameById(watch->ids[bit]), 1);
+	setenv("REGO_VALUE", value ? "1" : "0", 1);
+	snprintf(number, sizeof(number), "%u", edgeTime);
+	setenv("REGO_TIME", number, 1);
+	execl("/bin/sh", "sh", "-c", watch->hook, (char*) NULL);
+	_exit(127);
+}
+
+/*
+ * Report an edge: output it as a sample, log it and run the hook
+ */
+void emitEdge(regoWatch* watch, uint16_t bit, uint8_t value, uint32_t edgeTime) {
+	rego_conn* conn = watch->conn;
+	uint16_t address = getRegisterAddressById(watch->ids[bit]);
+
+	watch->edges++;
+	if (conn->log) appendLog(conn->log, edgeTime, address, RESPONSE_OK, value);
+	if (conn->output) addOutputSample(conn->output, conn->tag, address, watch->ids[bit], RESPONSE_OK, value, edgeTime);
+	if (watch->hook) runHook(watch, bit, value, edgeTime);
+}
+
+/*
+ * Fold the states read in a round (reading, for the registers set in valid)
+ * into the debounced states. The first state read of a register is taken as
+ * is, later changes are edges once they have been read for debounce ms.
+ * Edges are timed from the first read of the new state
+ * Returns the number of edges
+ */
+uint16_t applyWatchRound(regoWatch* watch, int64_t now) {
+	uint64_t first, diff, started, bits;
+	uint16_t w, bit, edges = 0;
+	uint8_t b;
+
+	for (w = 0; w < watch->words; w++) {
+		first = watch->valid[w] & ~watch->known[w];
+		watch->state[w] = (watch->state[w] & ~first) | (watch->reading[w] & first);
+		watch->known[w] |= first;
+
+		// Registers read in the other state start or stay pending, those read
+		// back in their state are not pending any more
+		diff = (watch->reading[w] ^ watch->state[w]) & watch->valid[w];
+		started = diff & ~watch->pending[w];
+		watch->pending[w] = (watch->pending[w] & ~watch->valid[w]) | diff;
+		for (bits = started; bits; bits &= bits - 1) {
+			watch->pendingSince[w * 64 + __builtin_ctzll(bits)] = now;
+		}
+
+		for (bits = watch->pending[w]; bits; bits &= bits - 1) {
+			b = __builtin_ctzll(bits);
+			bit = w * 64 + b;
+			if (now - watch->pendingSince[bit] < watch->debounce) continue;
+
+			watch->state[w] ^= 1ULL << b;
+			watch->pending[w] &= ~(1ULL << b);
+			emitEdge(watch, bit, (watch->state[w] >> b) & 1, time(NULL) - (now - watch->pendingSince[bit]) / 1000);
+			edges++;
+		}
+	}
+	return edges;
+}
+
+/*
+ * Read all watched registers once and report their edges
+ * Returns the number of edges
+ */
+uint16_t pollWatch(regoWatch* watch) {
+	uint16_t bit;
+	int16_t value;
+
+	memset(watch->reading, 0, watch->words * sizeof(uint64_t));
+	memset(watch->valid, 0, watch->words * sizeof(uint64_t));
+	for (bit = 0; bit < watch->count; bit++) {
+		if (queryRegister(watch->conn, getRegisterAddressById(watch->ids[bit]), &value) != RESPONSE_OK) continue;
+		watch->valid[bit / 64] |= 1ULL << (bit % 64);
+		if (value) watch->reading[bit / 64] |= 1ULL << (bit % 64);
+	}
+	return applyWatchRound(watch, monotonicMillis());
+}
+
+/*
+ * Poll the watched registers every interval ms until the process is
+ * terminated, writing out the edges of each round as they are found
+ */
+void runWatch(regoWatch* watch, uint32_t interval) {
+	int64_t start, elapsed;
+
+	while (1) {
+		start = monotonicMillis();
+		if (pollWatch(watch) && watch->conn->output) {
+			flushOutput(watch->conn->output);
+			fflush(stdout);
+		}
+		checkStatsDump(watch->conn);
+
+		// Reap the hooks that have finished
+		while (waitpid(-1, NULL, WNOHANG) > 0);
+
+		elapsed = monotonicMillis() - start;
+		if (elapsed < interval) usleep((interval - elapsed) * 1000);
+	}
+}
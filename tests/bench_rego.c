@@ -0,0 +1,216 @@
+/*
+ * Benchmark driver, run with 'make bench'
+ *
+ * Runs the client library against tests/regoSim and prints one JSON object
+ * per line, so results can be collected and compared across commits:
+ *
+ *   {"bench":"register","n":...,"p50_us":...,"p99_us":...,"max_us":...,"ops_per_s":...}
+ *   {"bench":"sweep","registers":...,"sweeps":...,"p50_us":...,"p99_us":...,"max_us":...,"regs_per_s":...}
+ *   {"bench":"display","n":...,"p50_us":...,"p99_us":...,"max_us":...,"fetches_per_s":...}
+ *   {"bench":"recovery","fault_pct":...,"drop_pct":...,"corrupt_pct":...,"silent_pct":...,"n":...,"ok":...,...}
+ *
+ * fault_pct is the sum of the three fault rates injected.
+ * Latencies are wall clock per call, including retries. The number of
+ * iterations can be given as the first argument.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "regoComm.h"
+#include "regoSerialIO.h"
+#include "simHelper.h"
+
+#define BENCH_REGISTER      0x0209
+#define BENCH_DEFAULT_N     500
+#define BENCH_SWEEPS        20
+
+/* Latency summary of one benchmark, all in us */
+typedef struct {
+    uint32_t p50;
+    uint32_t p99;
+    uint32_t max;
+    double mean;
+} benchStats;
+
+static int compareU32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+    return (x > y) - (x < y);
+}
+
+/* Sort samples in place and summarize them */
+static benchStats summarize(uint32_t* samples, int n) {
+    benchStats s = { 0, 0, 0, 0.0 };
+    double sum = 0;
+    int i;
+
+    if (n == 0) return s;
+    qsort(samples, n, sizeof(samples[0]), compareU32);
+    for (i = 0; i < n; i++) sum += samples[i];
+    s.p50 = samples[(n - 1) / 2];
+    s.p99 = samples[(n * 99 - 1) / 100];
+    s.max = samples[n - 1];
+    s.mean = sum / n;
+    return s;
+}
+
+/* Open a connection to a freshly started simulator */
+static pid_t openSim(char** args, rego_conn* conn) {
+    char path[64];
+    pid_t pid = startSim(args, path, sizeof(path));
+
+    initConnection(conn);
+    if (openSerialPort(conn, path) < 0) {
+        printConnError(conn);
+        stopSim(pid);
+        exit(EXIT_FAILURE);
+    }
+    return pid;
+}
+
+/* Back-to-back reads of a single register on a clean link */
+static benchStats benchRegister(int n) {
+    char* args[] = { NULL };
+    uint32_t* samples = malloc(n * sizeof(uint32_t));
+    rego_conn conn;
+    benchStats s;
+    int16_t value;
+    int64_t start, t;
+    int i;
+    pid_t pid = openSim(args, &conn);
+
+    start = monotonicMicros();
+    for (i = 0; i < n; i++) {
+        t = monotonicMicros();
+        queryRegister(&conn, BENCH_REGISTER, &value);
+        samples[i] = monotonicMicros() - t;
+    }
+    t = monotonicMicros() - start;
+
+    s = summarize(samples, n);
+    printf("{\"bench\":\"register\",\"n\":%d,\"p50_us\":%u,\"p99_us\":%u,\"max_us\":%u,\"ops_per_s\":%.1f}\n",
+           n, s.p50, s.p99, s.max, n * 1e6 / t);
+
+    closeSerialPort(&conn);
+    stopSim(pid);
+    free(samples);
+    return s;
+}
+
+/* Full sweeps over the known registers, as done by read_known_registers */
+static void benchSweep(void) {
+    char* args[] = { NULL };
+    uint32_t samples[BENCH_SWEEPS];
+    rego_conn conn;
+    int16_t value;
+    int64_t total = 0, t;
+    int i, count = 0;
+    int16_t id;
+    benchStats s;
+    pid_t pid = openSim(args, &conn);
+
+    for (i = 0; i < BENCH_SWEEPS; i++) {
+        count = 0;
+        t = monotonicMicros();
+        for (id = nextKnownRegister(&conn, -1); id >= 0; id = nextKnownRegister(&conn, id)) {
+            queryRegister(&conn, getRegisterAddressById(id), &value);
+            count++;
+        }
+        samples[i] = monotonicMicros() - t;
+        total += samples[i];
+    }
+
+    s = summarize(samples, BENCH_SWEEPS);
+    printf("{\"bench\":\"sweep\",\"registers\":%d,\"sweeps\":%d,\"p50_us\":%u,\"p99_us\":%u,\"max_us\":%u,\"regs_per_s\":%.1f}\n",
+           count, BENCH_SWEEPS, s.p50, s.p99, s.max, (double) count * BENCH_SWEEPS * 1e6 / total);
+
+    closeSerialPort(&conn);
+    stopSim(pid);
+}
+
+/* Fetches of the whole 4-row display, as done by show_display */
+static void benchDisplay(int n) {
+    char* args[] = { NULL };
+    uint32_t* samples = malloc(n * sizeof(uint32_t));
+    char text[170];
+    rego_conn conn;
+    benchStats s;
+    int64_t start, t;
+    int i;
+    pid_t pid = openSim(args, &conn);
+
+    start = monotonicMicros();
+    for (i = 0; i < n; i++) {
+        t = monotonicMicros();
+        queryDisplay(&conn, text);
+        samples[i] = monotonicMicros() - t;
+    }
+    t = monotonicMicros() - start;
+
+    s = summarize(samples, n);
+    printf("{\"bench\":\"display\",\"n\":%d,\"p50_us\":%u,\"p99_us\":%u,\"max_us\":%u,\"fetches_per_s\":%.1f}\n",
+           n, s.p50, s.p99, s.max, n * 1e6 / t);
+
+    closeSerialPort(&conn);
+    stopSim(pid);
+    free(samples);
+}
+
+/*
+ * Reads on a link with faults injected at about rate percent, split evenly
+ * between dropped bytes, corrupted checksums and lost responses. Each fault
+ * gets rate / 3 rounded up, and the rates actually injected are reported.
+ * The retry cost is the mean latency above that of the clean link
+ */
+static void benchRecovery(int rate, int n, double cleanMean) {
+    char rateArg[8], seedArg[8];
+    char* args[] = { "--drop", rateArg, "--corrupt", rateArg, "--silent", rateArg, "--seed", seedArg, NULL };
+    uint32_t* samples = malloc(n * sizeof(uint32_t));
+    rego_conn conn;
+    int16_t value;
+    int64_t t;
+    int i, ok = 0, faultRate = (rate + 2) / 3;
+    benchStats s;
+    pid_t pid;
+
+    snprintf(rateArg, sizeof(rateArg), "%d", faultRate);
+    snprintf(seedArg, sizeof(seedArg), "%d", rate + 1);
+    pid = openSim(args, &conn);
+    conn.responseTimeout = 50;
+    conn.maxRetries = 5;
+
+    for (i = 0; i < n; i++) {
+        t = monotonicMicros();
+        if (queryRegister(&conn, BENCH_REGISTER, &value) == RESPONSE_OK) ok++;
+        samples[i] = monotonicMicros() - t;
+    }
+
+    s = summarize(samples, n);
+    printf("{\"bench\":\"recovery\",\"fault_pct\":%d,\"drop_pct\":%d,\"corrupt_pct\":%d,\"silent_pct\":%d,"
+           "\"n\":%d,\"ok\":%d,\"p50_us\":%u,\"p99_us\":%u,\"max_us\":%u,"
+           "\"mean_us\":%.1f,\"retry_cost_us\":%.1f,\"discarded_bytes\":%u,\"link_error_rate\":%u}\n",
+           3 * faultRate, faultRate, faultRate, faultRate, n, ok, s.p50, s.p99, s.max, s.mean, s.mean - cleanMean,
+           getDiscardedBytes(&conn), getLinkErrorRate(&conn));
+
+    closeSerialPort(&conn);
+    stopSim(pid);
+    free(samples);
+}
+
+int main(int argc, char** argv) {
+    static const int faultRates[] = { 0, 3, 10, 30 };
+    int n = argc > 1 ? atoi(argv[1]) : BENCH_DEFAULT_N;
+    benchStats clean;
+    unsigned i;
+
+    if (n <= 0) n = BENCH_DEFAULT_N;
+
+    clean = benchRegister(n);
+    benchSweep();
+    benchDisplay(n / 5);
+    for (i = 0; i < sizeof(faultRates)/sizeof(faultRates[0]); i++) {
+        benchRecovery(faultRates[i], n / 5, clean.mean);
+    }
+    return 0;
+}
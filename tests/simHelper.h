@@ -0,0 +1,70 @@
+/*
+ * Helpers for running tests/regoSim as a child process
+ */
+
+#ifndef SIM_HELPER_H
+#define SIM_HELPER_H
+
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * Start the simulator with extra arguments, returning its pid and pty path.
+ * If logPath is set, the simulator's stderr goes to that file
+ */
+static pid_t startSimLogged(char** args, char* path, size_t size, const char* logPath) {
+    char* argv[24] = { "./tests/regoSim" };
+    int pipefd[2], i;
+    pid_t pid;
+    FILE* f;
+
+    for (i = 0; args[i] != NULL && i < 22; i++) argv[i+1] = args[i];
+    argv[i+1] = NULL;
+
+    assert(pipe(pipefd) == 0);
+    pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        dup2(pipefd[1], STDOUT_FILENO);
+        if (logPath) assert(freopen(logPath, "w", stderr) != NULL);
+        close(pipefd[0]);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    close(pipefd[1]);
+
+    f = fdopen(pipefd[0], "r");
+    assert(fgets(path, size, f) != NULL);
+    path[strcspn(path, "\n")] = 0;
+    fclose(f);
+    return pid;
+}
+
+/* Start the simulator with extra arguments, returning its pid and pty path */
+static pid_t startSim(char** args, char* path, size_t size) {
+    return startSimLogged(args, path, size, NULL);
+}
+
+/* Number of requests a stopped simulator reported serving in its log */
+static unsigned long simRequests(const char* logPath) {
+    unsigned long requests = 0;
+    char line[128];
+    FILE* f = fopen(logPath, "r");
+
+    assert(f != NULL);
+    while (fgets(line, sizeof(line), f)) sscanf(line, "regoSim: %lu requests served", &requests);
+    fclose(f);
+    return requests;
+}
+
+/* Stop a simulator started with startSim() */
+static void stopSim(pid_t pid) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+#endif
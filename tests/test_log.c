@@ -0,0 +1,171 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "regoComm.h"
+#include "regoLog.h"
+#include "regoShm.h"
+
+#define LOG_PATH "tests/ring.log"
+#define CAPACITY (4 * REGO_LOG_BATCH_RECORDS)
+#define SHM_NAME "/regoClientTest"
+
+/* Close without syncing, as if power was cut before the batch was done */
+static void crashLog(regoLog* log) {
+    munmap(log->map, log->mapSize);
+    close(log->fd);
+}
+
+/* Count records of a register from one time to another */
+static int countRange(regoLog* log, uint16_t address, uint32_t from, uint32_t to) {
+    uint64_t i, first, end;
+    int count = 0;
+
+    getLogRange(log, &first, &end);
+    for (i = findLogTime(log, from); i < end && getLogRecord(log, i)->time <= to; i++) {
+        if (getLogRecord(log, i)->address == address) count++;
+    }
+    return count;
+}
+
+static void testAppendAndQuery(void) {
+    regoLog log, reader;
+    uint64_t first, end;
+    uint32_t t;
+
+    unlink(LOG_PATH);
+    assert(openLog(&log, LOG_PATH, CAPACITY, 1) == 0);
+    assert(log.header.capacity == CAPACITY);
+
+    /* A second writer is refused */
+    assert(openLog(&reader, LOG_PATH, CAPACITY, 1) < 0);
+
+    /* Two registers sampled every 10 s */
+    for (t = 1000; t < 1000 + 100 * 10; t += 10) {
+        appendLog(&log, t, 0x0209, 1, t / 10);
+        appendLog(&log, t, 0x020a, 1, -(int16_t) (t / 10));
+    }
+    assert(countRange(&log, 0x0209, 1100, 1190) == 10);
+    assert(findLogTime(&log, 1105) == 22);
+    assert(getLogRecord(&log, findLogTime(&log, 1105))->time == 1110);
+    getLogRange(&log, &first, &end);
+    assert(findLogTime(&log, 5000) == end);
+
+    /* A clock stepping back keeps the time order */
+    appendLog(&log, 500, 0x0209, 1, 1);
+    assert(getLogRecord(&log, end)->time == 1990);
+    closeLog(&log);
+
+    /* A reader sees all synced records */
+    assert(openLog(&reader, LOG_PATH, 0, 0) == 0);
+    getLogRange(&reader, &first, &end);
+    assert(first == 0 && end == 201);
+    assert(countRange(&reader, 0x020a, 0, 2000) == 100);
+    assert(getLogRecord(&reader, 3)->value == -101);
+    closeLog(&reader);
+}
+
+static void testWrapAround(void) {
+    regoLog log;
+    uint64_t first, end;
+    uint32_t t;
+
+    unlink(LOG_PATH);
+    assert(openLog(&log, LOG_PATH, CAPACITY, 1) == 0);
+    for (t = 0; t < 3 * CAPACITY; t++) appendLog(&log, 10000 + t, 0x0001, 1, t);
+
+    /* The oldest batch worth of slots is not counted as valid */
+    getLogRange(&log, &first, &end);
+    assert(end == 3 * CAPACITY);
+    assert(end - first == CAPACITY - REGO_LOG_BATCH_RECORDS);
+    assert(getLogRecord(&log, first)->value == (int16_t) first);
+    assert(findLogTime(&log, 0) == first);
+    assert(findLogTime(&log, 10000 + 2 * CAPACITY + 500) == 2 * CAPACITY + 500);
+    closeLog(&log);
+
+    /* The capacity of an existing log is kept */
+    assert(openLog(&log, LOG_PATH, 2 * CAPACITY, 1) == 0);
+    assert(log.header.capacity == CAPACITY);
+    closeLog(&log);
+}
+
+static void testCrashRecovery(void) {
+    regoLog log;
+    uint64_t first, end;
+    uint32_t t;
+
+    unlink(LOG_PATH);
+    assert(openLog(&log, LOG_PATH, CAPACITY, 1) == 0);
+    for (t = 0; t < REGO_LOG_BATCH_RECORDS + 10; t++) appendLog(&log, 100 + t, 0x0002, 1, t);
+    crashLog(&log);
+
+    /* Only the batch in progress is lost */
+    assert(openLog(&log, LOG_PATH, CAPACITY, 1) == 0);
+    getLogRange(&log, &first, &end);
+    assert(end == REGO_LOG_BATCH_RECORDS);
+    assert(log.lastTime == 100 + REGO_LOG_BATCH_RECORDS - 1);
+
+    /* A torn header falls back to the previous one */
+    appendLog(&log, 1000, 0x0002, 1, 0);
+    assert(flushLog(&log) == 0);
+    log.map[(log.header.sequence % 2) * REGO_LOG_HEADER_SIZE / 2 + 20] ^= 0xff;
+    crashLog(&log);
+
+    assert(openLog(&log, LOG_PATH, CAPACITY, 1) == 0);
+    getLogRange(&log, &first, &end);
+    assert(end == REGO_LOG_BATCH_RECORDS);
+    closeLog(&log);
+    unlink(LOG_PATH);
+}
+
+static void testSharedSnapshot(void) {
+    regoShm writer, reader, other;
+    regoShmEntry entries[512], entry;
+    int count;
+
+    shm_unlink(SHM_NAME);
+    assert(openShm(&writer, SHM_NAME, 1) == 0);
+    assert(openShm(&other, SHM_NAME, 1) < 0);
+    assert(openShm(&reader, SHM_NAME, 0) == 0);
+
+    /* Every known register has an entry, unread until published */
+    count = readShmSnapshot(&reader, entries, 512);
+    assert(count == getKnownRegisterCount());
+    assert(entries[1].address == getRegisterAddressById(1));
+    assert(strcmp(entries[1].name, getRegisterNameById(1)) == 0);
+    assert(entries[1].valueTime == 0);
+
+    /* A failed read keeps the last good value */
+    publishShm(&writer, 1, RESPONSE_OK, 215, 1000);
+    publishShm(&writer, 1, RESPONSE_CHECKSUM_ERROR, 0, 1010);
+    assert(readShmRegister(&reader, getRegisterAddressById(1), &entry) == 1);
+    assert(entry.value == 215 && entry.valueTime == 1000);
+    assert(entry.status == RESPONSE_CHECKSUM_ERROR && entry.readTime == 1010);
+    assert(writer.header->sequence % 2 == 0);
+
+    /* A write that never ends makes readers give up instead of spinning */
+    writer.header->sequence++;
+    assert(readShmSnapshot(&reader, entries, 512) == -1);
+    closeShm(&writer);
+
+    /* A new publisher recovers the segment */
+    assert(openShm(&writer, SHM_NAME, 1) == 0);
+    assert(readShmSnapshot(&reader, entries, 2) == 2);
+    assert(entries[1].valueTime == 0);
+
+    closeShm(&reader);
+    closeShm(&writer);
+    shm_unlink(SHM_NAME);
+}
+
+int main(void) {
+    testAppendAndQuery();
+    testWrapAround();
+    testCrashRecovery();
+    testSharedSnapshot();
+
+    puts("All log and snapshot tests passed!");
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "regoComm.h"
+#include "regoMap.h"
+
+#define MAP_PATH "tests/test.map"
+#define CACHE_PATH MAP_PATH REGO_MAP_CACHE_SUFFIX
+
+static void writeMap(const char* text) {
+    FILE* f = fopen(MAP_PATH, "w");
+    assert(f);
+    fputs(text, f);
+    fclose(f);
+}
+
+static void testLoad(void) {
+    struct stat st;
+
+    unlink(CACHE_PATH);
+    writeMap("# test map\n"
+             "0x0213 hotWater temp graphite 60 sensor Temp. varmvatten (GT3)\n"
+             "\n"
+             "0x01fe compressor bool graphite 10 status Status kompressor\n"
+             "  0x0000 curve frac - 0 setting Heat curve\n"
+             "4660 plain int - 3600 setting\n");
+    assert(loadRegisterMap(MAP_PATH) == 0);
+    assert(stat(CACHE_PATH, &st) == 0);
+
+    assert(getKnownRegisterCount() == 4);
+    assert(getRegisterIdByName("compressor") == 1);
+    assert(getRegisterIdByAddress(0x0213) == 0);
+    assert(getRegisterIdByAddress(0x1234) == 3);
+    assert(getRegisterIdByAddress(0x0209) == -1);
+    assert(strcmp(getRegisterDescriptionById(0), "Temp. varmvatten (GT3)") == 0);
+    assert(strcmp(getRegisterDescriptionById(3), "") == 0);
+    assert(getRegisterTypeById(1) == REG_TYPE_BOOL && isGraphiteRegisterById(1));
+    assert(getRegisterTypeById(2) == REG_TYPE_FRAC && !isGraphiteRegisterById(2));
+    assert(getRegisterIntervalById(0) == 60 && getRegisterPriorityById(0) == REG_PRIO_SENSOR);
+
+    /* The second load maps the cache */
+    setRegisterMap(NULL, 0, NULL, NULL);
+    assert(getRegisterIdByName("compressor") == -1);
+    assert(loadRegisterMap(MAP_PATH) == 0);
+    assert(getRegisterIdByName("curve") == 2);
+
+    /* A changed map replaces the stale cache */
+    writeMap("0x0209 radiatorReturn temp graphite 15 sensor Retur radiator (GT1)\n");
+    assert(loadRegisterMap(MAP_PATH) == 0);
+    assert(getKnownRegisterCount() == 1);
+    assert(getRegisterIdByAddress(0x0209) == 0);
+}
+
+static void testErrors(void) {
+    uint8_t* image;
+    size_t size;
+
+    writeMap("0x0001 a int - 0 setting A\n0x0001 b int - 0 setting B\n");
+    assert(compileRegisterMap(MAP_PATH, &image, &size) < 0);
+    writeMap("0x0001 a int - 0 setting A\n0x0002 a int - 0 setting B\n");
+    assert(compileRegisterMap(MAP_PATH, &image, &size) < 0);
+    writeMap("0x0001 a float - 0 setting A\n");
+    assert(compileRegisterMap(MAP_PATH, &image, &size) < 0);
+    writeMap("0x10000 a int - 0 setting A\n");
+    assert(compileRegisterMap(MAP_PATH, &image, &size) < 0);
+    writeMap("0x0001 a int - 0\n");
+    assert(compileRegisterMap(MAP_PATH, &image, &size) < 0);
+
+    /* A damaged image is refused */
+    writeMap("0x0001 a int - 0 setting A\n");
+    assert(compileRegisterMap(MAP_PATH, &image, &size) == 0);
+    assert(useRegisterMapImage(image, size - 1) < 0);
+    image[size - 1] = 'x';
+    assert(useRegisterMapImage(image, size) < 0);
+    free(image);
+
+    unlink(MAP_PATH);
+    unlink(CACHE_PATH);
+}
+
+int main(void) {
+    testLoad();
+    testErrors();
+
+    puts("All register map tests passed!");
+    return 0;
+}
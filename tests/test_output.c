@@ -0,0 +1,399 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "regoAggregate.h"
+#include "regoComm.h"
+#include "regoGraphite.h"
+#include "regoOutput.h"
+#include "regoSerialIO.h"
+#include "regoWatch.h"
+
+#define SPOOL_PATH "tests/output.spool"
+
+/* Internal functions under test */
+void cutSpoolFile(int fd, off_t offset);
+
+/* Listen on a local TCP port, any free one if port is 0 */
+static int openListener(uint16_t* port) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int one = 1, fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    assert(fd >= 0);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(*port);
+    assert(bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0);
+    assert(listen(fd, 1) == 0);
+    assert(getsockname(fd, (struct sockaddr*) &addr, &len) == 0);
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+/* Read what has arrived on a connection, waiting briefly for it */
+static size_t readAll(int fd, char* buf, size_t size) {
+    struct timeval tv = { 0, 200000 };
+    size_t len = 0;
+    ssize_t n;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    while (len < size - 1 && (n = read(fd, buf + len, size - 1 - len)) > 0) len += n;
+    buf[len] = 0;
+    return len;
+}
+
+static int countLines(const char* text) {
+    int n = 0;
+    while ((text = strchr(text, '\n')) != NULL) { n++; text++; }
+    return n;
+}
+
+/* Render one sample in a format, null terminated */
+static const char* render(uint8_t format, const char* tag, uint16_t address, int8_t status, int16_t value) {
+    static char line[REGO_OUTPUT_LINE_MAX + 1];
+    regoSample sample = { tag, address, getRegisterIdByAddress(address), NULL, 0, status, value, 1700000000 };
+
+    line[formatSample(format, line, &sample)] = 0;
+    return line;
+}
+
+/* Every format renders values in fixed point, and handles errors and unknown registers */
+static void testFormats(void) {
+    assert(strcmp(render(OUTPUT_HUMAN, "", 0x020a, RESPONSE_OK, -52),
+                  "sensors.temperature.gt2Outdoor(020a) - Utomhustemperatur (GT2): -5.2 degrees\n") == 0);
+    assert(strcmp(render(OUTPUT_HUMAN, "hp1", 0x020a, RESPONSE_OK, -5),
+                  "hp1: sensors.temperature.gt2Outdoor(020a) - Utomhustemperatur (GT2): -0.5 degrees\n") == 0);
+    assert(strcmp(render(OUTPUT_HUMAN, "", 0x01fe, RESPONSE_OK, 1),
+                  "status.compressor(01fe) - Status kompressor: ON\n") == 0);
+    assert(strcmp(render(OUTPUT_HUMAN, "", 0x1234, RESPONSE_OK, -321), "1234: -321\n") == 0);
+    assert(strcmp(render(OUTPUT_HUMAN, "", 0x1234, RESPONSE_TIMEOUT, 0), "Error 0 requesting register 1234.\n") == 0);
+
+    assert(strcmp(render(OUTPUT_GRAPHITE, "hp1", 0x0209, RESPONSE_OK, 312),
+                  "heatpump.hp1.sensors.temperature.gt1RadiatorReturn 31.2 1700000000\n") == 0);
+    assert(strcmp(render(OUTPUT_GRAPHITE, "", 0x1234, RESPONSE_OK, 1), "") == 0);
+    assert(strcmp(render(OUTPUT_GRAPHITE, "", 0x0209, RESPONSE_CHECKSUM_ERROR, 0), "") == 0);
+
+    assert(strcmp(render(OUTPUT_INFLUX, "hp 1", 0x0209, RESPONSE_OK, 312),
+                  "heatpump,register=sensors.temperature.gt1RadiatorReturn,port=hp\\ 1 value=31.2 1700000000000000000\n") == 0);
+    assert(strcmp(render(OUTPUT_INFLUX, "", 0x01fe, RESPONSE_OK, 0),
+                  "heatpump,register=status.compressor value=0i 1700000000000000000\n") == 0);
+
+    assert(strcmp(render(OUTPUT_JSON, "hp1", 0x0209, RESPONSE_OK, 312),
+                  "{\"time\":1700000000,\"tag\":\"hp1\",\"address\":\"0209\",\"name\":\"sensors.temperature.gt1RadiatorReturn\",\"value\":31.2,\"status\":1}\n") == 0);
+    assert(strcmp(render(OUTPUT_JSON, "", 0x1234, RESPONSE_TIMEOUT, 0),
+                  "{\"time\":1700000000,\"address\":\"1234\",\"value\":null,\"status\":0}\n") == 0);
+    assert(strcmp(render(OUTPUT_JSON, "hp\t\"1\"", 0x1234, RESPONSE_TIMEOUT, 0),
+                  "{\"time\":1700000000,\"tag\":\"hp\\u0009\\\"1\\\"\",\"address\":\"1234\",\"value\":null,\"status\":0}\n") == 0);
+
+    /* Text cut to its longest length keeps whole UTF-8 characters */
+    assert(strcmp(render(OUTPUT_HUMAN, "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\xc3\xa9", 0x1234, RESPONSE_OK, 1),
+                  "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaa: 1234: 1\n") == 0);
+
+    assert(strcmp(render(OUTPUT_CSV, "", 0x0000, RESPONSE_OK, 40),
+                  "1700000000,,0000,setting_heat_curve,4.0,1\n") == 0);
+    assert(strcmp(render(OUTPUT_CSV, "hp1", 0x1234, RESPONSE_INVALID_LENGTH, 0), "1700000000,hp1,1234,,,-2\n") == 0);
+
+    assert(getOutputFormatByName("influx") == OUTPUT_INFLUX && getOutputFormatByName("xml") == -1);
+}
+
+/* Delta mode passes changes past the deadband, and errors */
+static void testDelta(void) {
+    rego_conn conn;
+    uint16_t reg;
+    int16_t gt1 = getRegisterIdByAddress(0x0209), comp = getRegisterIdByAddress(0x01fe);
+
+    initConnection(&conn);
+    conn.deltaKeyframe = 3600;
+
+    updateRegisterCache(&conn, 0x0209, RESPONSE_OK, 312);
+    assert(isDeltaChange(&conn, gt1, RESPONSE_OK, 312) == 1);
+    assert(isDeltaChange(&conn, gt1, RESPONSE_OK, 314) == 0);
+    assert(isDeltaChange(&conn, gt1, RESPONSE_OK, 310) == 0);
+    assert(isDeltaChange(&conn, gt1, RESPONSE_OK, 315) == 1);
+    assert(isDeltaChange(&conn, gt1, RESPONSE_OK, 313) == 0);
+    assert(isDeltaChange(&conn, gt1, RESPONSE_TIMEOUT, 0) == 1);
+
+    updateRegisterCache(&conn, 0x01fe, RESPONSE_OK, 1);
+    assert(isDeltaChange(&conn, comp, RESPONSE_OK, 1) == 1);
+    assert(isDeltaChange(&conn, comp, RESPONSE_OK, 1) == 0);
+    assert(isDeltaChange(&conn, comp, RESPONSE_OK, 0) == 1);
+
+    /* Reading many other registers, evicting cache entries, keeps the state */
+    for (reg = 0x1000; reg < 0x1100; reg++) updateRegisterCache(&conn, reg, RESPONSE_OK, 0);
+    assert(isDeltaChange(&conn, gt1, RESPONSE_OK, 313) == 0);
+    assert(isDeltaChange(&conn, comp, RESPONSE_OK, 0) == 0);
+
+    /* A new keyframe period outputs everything again */
+    conn.deltaKeyframe = 1;
+    assert(isDeltaChange(&conn, comp, RESPONSE_OK, 0) == 1);
+    assert(isDeltaChange(&conn, gt1, RESPONSE_OK, 315) == 1);
+    closeDelta(&conn);
+}
+
+/* Age the cached read of a register by ms */
+static void ageCacheEntry(rego_conn* conn, uint16_t reg, int64_t ms) {
+    int i;
+
+    for (i = 0; i < REGO_CACHE_SIZE; i++) {
+        if (conn->cache[i].used && conn->cache[i].address == reg) conn->cache[i].time -= ms;
+    }
+}
+
+/* Cached values are used by their register's TTL or the age asked for */
+static void testCache(void) {
+    uint16_t colliding[REGO_CACHE_PROBES + 1], reg;
+    rego_conn conn;
+    int16_t value;
+    int n = 0;
+
+    initConnection(&conn);
+
+    /* Settings keep for minutes by default, sensors for seconds */
+    updateRegisterCache(&conn, 0x0000, RESPONSE_OK, 12);
+    updateRegisterCache(&conn, 0x0209, RESPONSE_OK, 312);
+    assert(getFreshRegister(&conn, 0x0209, &value, REGO_CACHE_DEFAULT_AGE) && value == 312);
+    ageCacheEntry(&conn, 0x0000, 10000);
+    ageCacheEntry(&conn, 0x0209, 10000);
+    assert(getFreshRegister(&conn, 0x0000, &value, REGO_CACHE_DEFAULT_AGE) && value == 12);
+    assert(!getFreshRegister(&conn, 0x0209, &value, REGO_CACHE_DEFAULT_AGE));
+    assert(getFreshRegister(&conn, 0x0209, &value, 20000));
+
+    /* Age 0 always reads, and settings expire too */
+    assert(!getFreshRegister(&conn, 0x0000, &value, 0));
+    ageCacheEntry(&conn, 0x0000, REGO_CACHE_TTL_SETTING);
+    assert(!getFreshRegister(&conn, 0x0000, &value, REGO_CACHE_DEFAULT_AGE));
+
+    /* A failed read is remembered, but never served */
+    updateRegisterCache(&conn, 0x020a, RESPONSE_TIMEOUT, 0);
+    assert(!getFreshRegister(&conn, 0x020a, &value, 60000));
+    assert(!getFreshRegister(&conn, 0x1234, &value, 60000));
+
+    /* Once the probe slots of an address are full, the oldest entry goes */
+    for (reg = 0x1000; n < REGO_CACHE_PROBES + 1; reg++) {
+        if ((((reg * 40503u) >> 4) & (REGO_CACHE_SIZE - 1)) == (((0x1000 * 40503u) >> 4) & (REGO_CACHE_SIZE - 1))) {
+            colliding[n++] = reg;
+        }
+    }
+    initConnection(&conn);
+    for (n = 0; n < REGO_CACHE_PROBES; n++) {
+        updateRegisterCache(&conn, colliding[n], RESPONSE_OK, n);
+        ageCacheEntry(&conn, colliding[n], 1000 - n);
+    }
+    updateRegisterCache(&conn, colliding[REGO_CACHE_PROBES], RESPONSE_OK, REGO_CACHE_PROBES);
+    assert(!getFreshRegister(&conn, colliding[0], &value, 60000));
+    for (n = 1; n <= REGO_CACHE_PROBES; n++) {
+        assert(getFreshRegister(&conn, colliding[n], &value, 60000) && value == n);
+    }
+}
+
+/* Aggregates of a window are output once it ends */
+static void testAggregate(void) {
+    static regoAggregator agg;
+    regoOutput out;
+    int16_t comp = getRegisterIdByAddress(0x01fe), gt8 = getRegisterIdByAddress(0x020f), gt9 = getRegisterIdByAddress(0x0210);
+    uint32_t t = 60000;
+
+    assert(initAggregator(&agg, "0") < 0);
+    assert(initAggregator(&agg, "60x") < 0);
+    assert(initAggregator(&agg, "1,2,3,4") < 0);
+    assert(initAggregator(&agg, "60") == 0);
+    initOutput(&out, OUTPUT_CSV);
+    out.headerDone = 1;
+
+    addAggregateSample(&agg, &out, "", t, comp, RESPONSE_OK, 0);
+    addAggregateSample(&agg, &out, "", t + 5, gt8, RESPONSE_OK, 350);
+    addAggregateSample(&agg, &out, "", t + 6, gt9, RESPONSE_OK, 300);
+    addAggregateSample(&agg, &out, "", t + 10, comp, RESPONSE_OK, 1);
+    addAggregateSample(&agg, &out, "", t + 15, gt8, RESPONSE_OK, 360);
+    addAggregateSample(&agg, &out, "", t + 20, gt8, RESPONSE_TIMEOUT, 0);
+    addAggregateSample(&agg, &out, "", t + 40, comp, RESPONSE_OK, 0);
+    addAggregateSample(&agg, &out, "", t + 50, comp, RESPONSE_OK, 1);
+    assert(out.len == 0);
+
+    /* The first sample of the next window ends this one */
+    addAggregateSample(&agg, &out, "", t + 61, gt9, RESPONSE_OK, 301);
+    out.buffer[out.len] = 0;
+    assert(strstr(out.buffer, "60060,,01fe,status.compressor.1m.duty,66.6,1\n"));
+    assert(strstr(out.buffer, "60060,,01fe,status.compressor.1m.onTime,40,1\n"));
+    assert(strstr(out.buffer, "60060,,01fe,status.compressor.1m.starts,2,1\n"));
+    assert(strstr(out.buffer, "60060,,020f,sensors.temperature.gt8HeatFluidOut.1m.min,35.0,1\n"));
+    assert(strstr(out.buffer, "60060,,020f,sensors.temperature.gt8HeatFluidOut.1m.mean,35.5,1\n"));
+    assert(strstr(out.buffer, "60060,,020f,sensors.temperature.gt8HeatFluidOut.1m.last,36.0,1\n"));
+    assert(strstr(out.buffer, "60060,,0000,derived.heatFluidDeltaT.1m.min,5.0,1\n"));
+    assert(strstr(out.buffer, "60060,,0000,derived.heatFluidDeltaT.1m.max,6.0,1\n"));
+    assert(countLines(out.buffer) == 3 + 3 * 4);
+
+    /* The compressor stays on into the next window */
+    out.len = 0;
+    addAggregateSample(&agg, &out, "", t + 125, gt9, RESPONSE_OK, 301);
+    out.buffer[out.len] = 0;
+    assert(strstr(out.buffer, "60120,,01fe,status.compressor.1m.duty,100.0,1\n"));
+    assert(strstr(out.buffer, "60120,,01fe,status.compressor.1m.starts,0,1\n"));
+}
+
+/* Set the state read of one watched register in the current round */
+static void setWatchReading(regoWatch* watch, int16_t id, int8_t value) {
+    uint16_t bit;
+
+    for (bit = 0; watch->ids[bit] != id; bit++);
+    watch->valid[bit / 64] |= 1ULL << (bit % 64);
+    if (value) watch->reading[bit / 64] |= 1ULL << (bit % 64);
+    else watch->reading[bit / 64] &= ~(1ULL << (bit % 64));
+}
+
+/* Status edges are output once they have persisted for the debounce time */
+static void testWatch(void) {
+    regoWatch watch;
+    regoOutput out;
+    rego_conn conn;
+    int16_t comp = getRegisterIdByAddress(0x01fe), alarm = getRegisterIdByAddress(0x0206);
+
+    initConnection(&conn);
+    initOutput(&out, OUTPUT_CSV);
+    out.headerDone = 1;
+    conn.output = &out;
+    assert(initWatch(&watch, &conn, 100, NULL, 0) == 0);
+    assert(comp >= 0 && alarm >= 0);
+
+    /* The first reading is the initial state, not an edge */
+    setWatchReading(&watch, comp, 1);
+    setWatchReading(&watch, alarm, 0);
+    assert(applyWatchRound(&watch, 1000) == 0);
+
+    /* A glitch shorter than the debounce time is ignored */
+    setWatchReading(&watch, comp, 0);
+    assert(applyWatchRound(&watch, 1050) == 0);
+    setWatchReading(&watch, comp, 1);
+    assert(applyWatchRound(&watch, 1100) == 0);
+
+    /* A change that persists is one edge, also across failed reads */
+    setWatchReading(&watch, alarm, 1);
+    assert(applyWatchRound(&watch, 1200) == 0);
+    memset(watch.valid, 0, watch.words * sizeof(uint64_t));
+    assert(applyWatchRound(&watch, 1250) == 0);
+    setWatchReading(&watch, alarm, 1);
+    assert(applyWatchRound(&watch, 1300) == 1);
+    assert(applyWatchRound(&watch, 1400) == 0);
+    out.buffer[out.len] = 0;
+    assert(strstr(out.buffer, ",,0206,status.alarm,1,1\n") && countLines(out.buffer) == 1);
+
+    freeWatch(&watch);
+}
+
+/* Graphite sweeps go to a carbon server in one piece, and are spooled while it is away */
+static void testGraphiteSender(void) {
+    char target[32], buf[4096], ts1[16], ts2[16];
+    graphiteSender sender;
+    regoOutput out;
+    uint16_t port = 0;
+    int listener, conn, conn2;
+
+    unlink(SPOOL_PATH);
+    unlink(SPOOL_PATH ".1");
+
+    listener = openListener(&port);
+    snprintf(target, sizeof(target), "127.0.0.1:%u", port);
+    assert(initGraphiteSender(&sender, target, SPOOL_PATH) == 0);
+    sender.retryInterval = 0;
+    initOutput(&out, OUTPUT_GRAPHITE);
+    out.graphite = &sender;
+
+    /* A sweep arrives in one piece, all with the same timestamp */
+    addOutputSample(&out, "", 0x0209, getRegisterIdByAddress(0x0209), RESPONSE_OK, 312, 0);
+    addOutputSample(&out, "hp1", 0x01fe, getRegisterIdByAddress(0x01fe), RESPONSE_OK, 1, 0);
+    assert(flushOutput(&out) == 0);
+    conn = accept(listener, NULL, NULL);
+    assert(conn >= 0);
+    readAll(conn, buf, sizeof(buf));
+    assert(sscanf(buf, "heatpump.sensors.temperature.gt1RadiatorReturn 31.2 %15s", ts1) == 1);
+    assert(sscanf(strchr(buf, '\n') + 1, "heatpump.hp1.status.compressor 1 %15s", ts2) == 1);
+    assert(strcmp(ts1, ts2) == 0);
+
+    /* The connection is kept for the next sweep */
+    addOutputSample(&out, "", 0x020a, getRegisterIdByAddress(0x020a), RESPONSE_OK, -52, 0);
+    assert(flushOutput(&out) == 0);
+    readAll(conn, buf, sizeof(buf));
+    assert(strncmp(buf, "heatpump.sensors.temperature.gt2Outdoor -5.2 ", 45) == 0);
+
+    /* Server goes away: sweeps are spooled */
+    close(conn);
+    close(listener);
+    addOutputSample(&out, "", 0x0213, getRegisterIdByAddress(0x0213), RESPONSE_OK, 493, 0);
+    assert(flushOutput(&out) == -1);
+    addOutputSample(&out, "", 0x020d, getRegisterIdByAddress(0x020d), RESPONSE_OK, 211, 0);
+    assert(flushOutput(&out) == -1);
+    assert(access(SPOOL_PATH, F_OK) == 0);
+
+    /* Server is back: spool is replayed in order before the new sweep */
+    listener = openListener(&port);
+    addOutputSample(&out, "", 0x020e, getRegisterIdByAddress(0x020e), RESPONSE_OK, 754, 0);
+    assert(flushOutput(&out) == 0);
+    conn2 = accept(listener, NULL, NULL);
+    assert(conn2 >= 0);
+    readAll(conn2, buf, sizeof(buf));
+    assert(countLines(buf) == 3);
+    assert(strstr(buf, "gt3") < strstr(buf, "gt5") && strstr(buf, "gt5") < strstr(buf, "gt6"));
+    assert(access(SPOOL_PATH, F_OK) != 0);
+
+    closeGraphiteSender(&sender);
+    close(conn2);
+    close(listener);
+}
+
+/* A spool larger than one replay chunk is delivered whole, and a failed replay keeps what was not delivered */
+static void testGraphiteSpool(void) {
+    static char spool[12000], buf[16000];
+    char target[32];
+    graphiteSender sender;
+    uint16_t port = 0;
+    size_t len = 0;
+    int listener, conn, fd, i;
+
+    unlink(SPOOL_PATH ".1");
+    for (i = 0; i < 300; i++) len += sprintf(spool + len, "heatpump.test.line%03d %d 1700000000\n", i, i);
+    fd = open(SPOOL_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0 && write(fd, spool, len) == (ssize_t) len);
+    close(fd);
+
+    /* Cutting the delivered part leaves the rest at the front */
+    fd = open(SPOOL_PATH, O_RDWR);
+    cutSpoolFile(fd, 1000);
+    assert(pread(fd, buf, sizeof(buf), 0) == (ssize_t) len - 1000);
+    assert(memcmp(buf, spool + 1000, len - 1000) == 0);
+    assert(pwrite(fd, spool, len, 0) == (ssize_t) len);
+    close(fd);
+
+    listener = openListener(&port);
+    snprintf(target, sizeof(target), "127.0.0.1:%u", port);
+    assert(initGraphiteSender(&sender, target, SPOOL_PATH) == 0);
+    assert(sendGraphiteSweep(&sender, "heatpump.test.sweep 1 1700000001\n", 33) == 0);
+    conn = accept(listener, NULL, NULL);
+    assert(conn >= 0);
+    assert(readAll(conn, buf, sizeof(buf)) == len + 33);
+    assert(memcmp(buf, spool, len) == 0 && strcmp(buf + len, "heatpump.test.sweep 1 1700000001\n") == 0);
+    assert(access(SPOOL_PATH, F_OK) != 0);
+
+    closeGraphiteSender(&sender);
+    close(conn);
+    close(listener);
+}
+
+int main(void) {
+    testFormats();
+    testDelta();
+    testCache();
+    testAggregate();
+    testWatch();
+    testGraphiteSender();
+    testGraphiteSpool();
+
+    puts("All output tests passed!");
+    return 0;
+}
@@ -0,0 +1,438 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "regoAsync.h"
+#include "regoComm.h"
+#include "regoDaemon.h"
+#include "regoMap.h"
+#include "regoSched.h"
+#include "regoScan.h"
+#include "regoSerialIO.h"
+#include "regoTune.h"
+#include "simHelper.h"
+
+/* Clean link: registers and display come back as configured */
+static void testCleanLink(void) {
+    char* args[] = { "--set", "0x1234=-321", NULL };
+    char path[64], text[170];
+    int16_t value;
+    rego_conn conn;
+    pid_t pid = startSim(args, path, sizeof(path));
+
+    initConnection(&conn);
+    assert(openSerialPort(&conn, path) == 0);
+
+    assert(queryRegister(&conn, 0x020a, &value) == RESPONSE_OK && value == -52);
+    assert(queryRegister(&conn, 0x1234, &value) == RESPONSE_OK && value == -321);
+    assert(queryDisplay(&conn, text) == RESPONSE_OK);
+    assert(strncmp(text, "Rego 637 simulator", 18) == 0);
+
+    closeSerialPort(&conn);
+    stopSim(pid);
+}
+
+/* Noisy link: split, truncated, corrupted and padded responses are recovered by retries */
+static void testNoisyLink(void) {
+    char* args[] = { "--split", "2", "--garbage", "20", "--corrupt", "10", "--drop", "5", "--seed", "1", NULL };
+    char path[64];
+    int16_t value;
+    rego_conn conn;
+    int i;
+    pid_t pid = startSim(args, path, sizeof(path));
+
+    initConnection(&conn);
+    conn.responseTimeout = 100;
+    conn.maxRetries = 5;
+    assert(openSerialPort(&conn, path) == 0);
+
+    for (i = 0; i < 50; i++) {
+        assert(queryRegister(&conn, 0x0209, &value) == RESPONSE_OK && value == 312);
+    }
+
+    closeSerialPort(&conn);
+    stopSim(pid);
+}
+
+/* Hung up port: reads fail at once instead of spinning until the timeout */
+static void testHangUp(void) {
+    char* args[] = { NULL };
+    char path[64];
+    int16_t value;
+    int64_t start;
+    rego_conn conn;
+    pid_t pid = startSim(args, path, sizeof(path));
+
+    initConnection(&conn);
+    conn.responseTimeout = 1000;
+    conn.maxRetries = 0;
+    assert(openSerialPort(&conn, path) == 0);
+    stopSim(pid);
+
+    start = monotonicMicros();
+    assert(queryRegister(&conn, 0x020a, &value) != RESPONSE_OK);
+    assert(monotonicMicros() - start < 500000);
+    assert(conn.lastErrno != 0);
+
+    closeSerialPort(&conn);
+}
+
+/* Discovery scan: responsive addresses found through corrupt responses, resumed from a checkpoint */
+static void testScan(void) {
+    char* args[] = { "--set", "0x0300=7", "--corrupt", "20", "--seed", "2", NULL };
+    char path[64];
+    regoScan scan;
+    rego_conn conn;
+    pid_t pid = startSim(args, path, sizeof(path));
+
+    initConnection(&conn);
+    conn.responseTimeout = 100;
+    conn.maxRetries = 5;
+    assert(openSerialPort(&conn, path) == 0);
+    unlink("tests/scan.state");
+
+    assert(initScan(&scan, "0x0200-0x0213,0x0300", 1, "tests/scan.state") == 0);
+    assert(runScan(&scan, &conn) == 0);
+    assert(scan.entries[0x020a].reads == 1 && scan.entries[0x020a].last == -52);
+    assert(scan.entries[0x0300].reads == 1 && scan.entries[0x0300].last == 7);
+    assert(scan.entries[0x0214].pass == 0 && scan.entries[0x01ff].pass == 0);
+    assert(getScanTimeout(&scan) < conn.responseTimeout);
+    freeScan(&scan);
+
+    /* A second pass only reads the responsive addresses, tracking changes */
+    assert(initScan(&scan, "all", 2, "tests/scan.state") == 1);
+    assert(scan.header.rangeCount == 2 && scan.header.pass == 2);
+    scan.passInterval = 0;
+    assert(runScan(&scan, &conn) == 0);
+    assert(scan.entries[0x0300].reads == 2 && scan.entries[0x0300].changes == 0);
+    assert(scan.entries[0x1234].pass == 0);
+    addScanSample(&scan, 0x0300, RESPONSE_OK, 9);
+    addScanSample(&scan, 0x0300, RESPONSE_TIMEOUT, 0);
+    addScanSample(&scan, 0x0300, RESPONSE_OK, 9);
+    assert(scan.entries[0x0300].changes == 1 && scan.entries[0x0300].min == 7 && scan.entries[0x0300].max == 9);
+    freeScan(&scan);
+
+    unlink("tests/scan.state");
+    closeSerialPort(&conn);
+    stopSim(pid);
+}
+
+/* Async API: results come back in order, by callback or from the queue */
+static void countCompletion(const regoCompletion* completion, void* context) {
+    assert(completion->status == RESPONSE_OK && completion->value == -52);
+    (*(int*) context)++;
+}
+
+static void testAsync(void) {
+    char* args[] = { "--split", "2", "--corrupt", "20", "--seed", "3", NULL };
+    char path[64];
+    regoCompletion completion;
+    regoAsync async;
+    rego_conn conn;
+    struct pollfd pfd;
+    int32_t first, row;
+    int called = 0, i;
+    pid_t pid = startSim(args, path, sizeof(path));
+
+    initConnection(&conn);
+    conn.maxRetries = 10;
+    assert(openSerialPort(&conn, path) == 0);
+    initAsync(&async, &conn);
+
+    first = submitRegisterRead(&async, 0x0209, NULL, NULL);
+    assert(submitRegisterRead(&async, 0x020a, countCompletion, &called) == first + 1);
+    row = submitDisplayRowRead(&async, 1, NULL, NULL);
+    for (i = 3; i < REGO_ASYNC_QUEUE_SIZE; i++) assert(submitRegisterRead(&async, 0x020a, countCompletion, &called) > 0);
+    assert(submitRegisterRead(&async, 0x020a, NULL, NULL) == -1);
+
+    /* Driven from the caller's own poll loop */
+    while (getAsyncTimeout(&async) >= 0) {
+        pfd.fd = getAsyncFd(&async);
+        pfd.events = POLLIN;
+        poll(&pfd, 1, getAsyncTimeout(&async));
+        processAsync(&async);
+    }
+    assert(called == REGO_ASYNC_QUEUE_SIZE - 2);
+
+    assert(takeCompletion(&async, &completion) == 1);
+    assert(completion.id == first && completion.status == RESPONSE_OK && completion.value == 312);
+    assert(takeCompletion(&async, &completion) == 1);
+    assert(completion.id == row && completion.status == RESPONSE_OK && strcmp(completion.text, "GT1 31.2 C          \n") == 0);
+    assert(takeCompletion(&async, &completion) == 0);
+
+    /* Waiting on an empty queue does not block */
+    assert(waitAsync(&async) == 0);
+
+    closeSerialPort(&conn);
+    stopSim(pid);
+}
+
+/* Batch mode: every request is answered in order and ended with END */
+static void testBatch(void) {
+    char* args[] = { NULL };
+    const char* requests = "read_register 0x020a\n\nread_reg_range 0x0209 0x020b\nbogus\nread_register 0x1234 0";
+    char* response;
+    size_t len;
+    char path[64];
+    rego_conn conn;
+    FILE* out;
+    int fds[2];
+    pid_t pid = startSim(args, path, sizeof(path));
+
+    initConnection(&conn);
+    assert(openSerialPort(&conn, path) == 0);
+    assert(pipe(fds) == 0);
+    assert(write(fds[1], requests, strlen(requests)) == (ssize_t) strlen(requests));
+    close(fds[1]);
+
+    out = open_memstream(&response, &len);
+    assert(runBatch(&conn, fds[0], out) == 0);
+    fclose(out);
+    assert(strcmp(response, "OK 020a -52\nEND\n"
+        "OK 0209 312\nOK 020a -52\nOK 020b 0\nEND\n"
+        "ERR invalid command\nEND\n"
+        "OK 1234 0\nEND\n") == 0);
+
+    free(response);
+    close(fds[0]);
+    closeSerialPort(&conn);
+    stopSim(pid);
+}
+
+/* Connect to the daemon's socket, waiting for it to come up */
+static int connectDaemon(const char* socketPath) {
+    struct sockaddr_un addr;
+    int fd, tries;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socketPath);
+    for (tries = 0; tries < 200; tries++) {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        assert(fd >= 0);
+        if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0) return fd;
+        close(fd);
+        usleep(10000);
+    }
+    assert(0);
+    return -1;
+}
+
+/* Read one response line from a daemon client socket */
+static void readResponse(int fd, char* line, size_t size) {
+    size_t len = 0;
+
+    while (len < size - 1 && read(fd, line + len, 1) == 1) {
+        if (line[len++] == '\n') break;
+    }
+    line[len] = 0;
+}
+
+/* Daemon mode: clients get their lines, and identical queued requests share a transaction */
+static void testDaemon(void) {
+    char* args[] = { "--latency", "200", NULL };
+    const char* socketPath = "tests/test.sock";
+    const char* logPath = "tests/sim.log";
+    const char* filePath = "tests/test.file";
+    char path[64], line[64];
+    rego_conn conn;
+    int clients[5], i;
+    pid_t pid = startSimLogged(args, path, sizeof(path), logPath), daemon;
+
+    unlink(socketPath);
+    daemon = fork();
+    assert(daemon >= 0);
+    if (daemon == 0) {
+        initConnection(&conn);
+        conn.maxRetries = 0;
+        if (openSerialPort(&conn, path) < 0) _exit(1);
+        _exit(runDaemon(&conn, socketPath, NULL) < 0);
+    }
+    for (i = 0; i < 5; i++) clients[i] = connectDaemon(socketPath);
+
+    /* A second daemon neither takes over the socket nor deletes other files */
+    initConnection(&conn);
+    assert(runDaemon(&conn, socketPath, NULL) < 0);
+    assert(close(open(filePath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == 0);
+    assert(runDaemon(&conn, filePath, NULL) < 0);
+    assert(unlink(filePath) == 0);
+
+    /* The later requests queue up while the first one is in flight */
+    assert(write(clients[0], "read_register 0x020a\n", 21) == 21);
+    usleep(50000);
+    assert(write(clients[1], "read_register 0x020b 0\n", 23) == 23);
+    assert(write(clients[2], "read_register 0x020b\n", 21) == 21);
+    assert(write(clients[3], "read_register 0x020b 0\n", 23) == 23);
+    assert(write(clients[4], "bogus\n", 6) == 6);
+
+    readResponse(clients[0], line, sizeof(line));
+    assert(strcmp(line, "OK 020a -52\n") == 0);
+    for (i = 1; i < 4; i++) {
+        readResponse(clients[i], line, sizeof(line));
+        assert(strcmp(line, "OK 020b 0\n") == 0);
+    }
+    readResponse(clients[4], line, sizeof(line));
+    assert(strcmp(line, "ERR invalid command\n") == 0);
+
+    for (i = 0; i < 5; i++) close(clients[i]);
+    kill(daemon, SIGTERM);
+    waitpid(daemon, &i, 0);
+    assert(WIFEXITED(i) && WEXITSTATUS(i) == 0);
+    stopSim(pid);
+
+    /* One transaction for the first request, one shared by the three others */
+    assert(simRequests(logPath) == 2);
+    unlink(logPath);
+}
+
+/* Calibration picks a working profile, and profiles round trip per port */
+static void testCalibrate(void) {
+    char* args[] = { NULL };
+    char path[64];
+    regoSerialProfile best, loaded;
+    rego_conn conn;
+    FILE* report;
+    pid_t pid = startSim(args, path, sizeof(path));
+
+    initConnection(&conn);
+    assert(openSerialPort(&conn, path) == 0);
+    report = fopen("/dev/null", "w");
+    assert(calibratePort(&conn, 3, &best, report) == 0);
+    fclose(report);
+    /* A pty has no low latency mode, and a gap only slows down a clean link */
+    assert(best.lowLatency == 0 && best.gap == 0);
+    assert(best.timeout >= REGO_TUNE_MIN_TIMEOUT && best.timeout <= REGO_RESPONSE_TIMEOUT);
+    assert(conn.responseTimeout == best.timeout && conn.maxRetries == REGO_DEFAULT_RETRIES);
+
+    unlink("tests/test.profiles");
+    assert(loadSerialProfile("tests/test.profiles", path, &loaded) == 0);
+    best.gap = 7;
+    assert(saveSerialProfile("tests/test.profiles", "/dev/other", &best) == 0);
+    assert(saveSerialProfile("tests/test.profiles", path, &best) == 0);
+    best.gap = 9;
+    assert(saveSerialProfile("tests/test.profiles", path, &best) == 0);
+    assert(loadSerialProfile("tests/test.profiles", path, &loaded) == 1);
+    assert(loaded.baud == best.baud && loaded.gap == 9 && loaded.timeout == best.timeout);
+    assert(loadSerialProfile("tests/test.profiles", "/dev/other", &loaded) == 1 && loaded.gap == 7);
+    unlink("tests/test.profiles");
+
+    closeSerialPort(&conn);
+    stopSim(pid);
+}
+
+/*
+ * Scheduler: the most urgent class goes first, registers come back at their
+ * interval, and a slow link is reported as overloaded. Only the order and
+ * bounds of the polls are checked, so a loaded host does not fail the test
+ */
+static void testSchedule(void) {
+    char* args[] = { NULL };
+    char* slowArgs[] = { "--latency", "200", NULL };
+    const char* mapPath = "tests/sched.map";
+    const char* cachePath = "tests/sched.map.cache";
+    const char* outPath = "tests/sched.out";
+    char path[64], line[128];
+    unsigned int polled[64], reg, seen = 0;
+    int n = 0, out, saved, i, j, settingPolled = 0, sensorRepolled = 0;
+    int64_t start, elapsed;
+    regoSchedule sched;
+    rego_conn conn;
+    FILE* f;
+    pid_t pid;
+
+    f = fopen(mapPath, "w");
+    assert(f != NULL);
+    fputs("0x0001 set int - 60 setting Setting\n", f);
+    for (i = 2; i <= 8; i++) fprintf(f, "0x%04x s%d int - 1 sensor Sensor\n", i, i);
+    fputs("0x0009 flag bool - 60 status Status\n", f);
+    fclose(f);
+    assert(loadRegisterMap(mapPath) == 0);
+
+    /* Poll until the setting has been read and a sensor has come back */
+    pid = startSim(args, path, sizeof(path));
+    initConnection(&conn);
+    assert(openSerialPort(&conn, path) == 0);
+    start = monotonicMillis();
+    assert(initSchedule(&sched, &conn) == 0 && sched.count == 9);
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    out = open(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    dup2(out, STDOUT_FILENO);
+    while (!(settingPolled && sensorRepolled) && monotonicMillis() - start < 10000) {
+        if (!runScheduledPoll(&sched)) usleep(10000);
+        for (i = 0; i < sched.count; i++) {
+            if (sched.entries[i].address == 0x0001 && sched.entries[i].due >= start + 60000) settingPolled = 1;
+            if (sched.entries[i].interval == 1000 && sched.entries[i].due >= start + 2000) sensorRepolled = 1;
+        }
+    }
+    elapsed = monotonicMillis() - start;
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    close(out);
+    freeSchedule(&sched);
+    closeSerialPort(&conn);
+    stopSim(pid);
+    assert(settingPolled && sensorRepolled);
+
+    f = fopen(outPath, "r");
+    assert(f != NULL);
+    while (n < 64 && fgets(line, sizeof(line), f)) {
+        assert(sscanf(strchr(line, '('), "(%x)", &reg) == 1);
+        polled[n++] = reg;
+    }
+    fclose(f);
+    unlink(outPath);
+
+    /* Status first, then every sensor once before any comes back */
+    assert(n >= 10);
+    assert(polled[0] == 0x0009);
+    for (i = 1; i < 8; i++) {
+        assert(polled[i] >= 0x0002 && polled[i] <= 0x0008 && !(seen & 1U << polled[i]));
+        seen |= 1U << polled[i];
+    }
+
+    /* The 60 s registers once, each 1 s sensor at most once per started second */
+    for (reg = 0x0001; reg <= 0x0009; reg++) {
+        for (i = j = 0; i < n; i++) j += polled[i] == reg;
+        if (reg == 0x0001 || reg == 0x0009) assert(j == 1);
+        else assert(j >= 1 && j <= elapsed / 1000 + 1);
+    }
+
+    /* Seven 1 s registers at 200 ms per read need 140% of the link */
+    pid = startSim(slowArgs, path, sizeof(path));
+    initConnection(&conn);
+    assert(openSerialPort(&conn, path) == 0);
+    assert(initSchedule(&sched, &conn) == 0);
+    measureLinkCapacity(&sched, 2);
+    assert(getScheduleLoad(&sched) > 1000);
+    freeSchedule(&sched);
+    closeSerialPort(&conn);
+    stopSim(pid);
+
+    /* Later tests expect the built-in register table */
+    setRegisterMap(NULL, 0, NULL, NULL);
+    unlink(mapPath);
+    unlink(cachePath);
+}
+
+int main(void) {
+    testCleanLink();
+    testNoisyLink();
+    testHangUp();
+    testScan();
+    testAsync();
+    testBatch();
+    testDaemon();
+    testCalibrate();
+    testSchedule();
+
+    puts("All simulator tests passed!");
+    return 0;
+}
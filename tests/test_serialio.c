@@ -1,11 +1,160 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "regoCapture.h"
+#include "regoComm.h"
 #include "regoSerialIO.h"
+#include "regoStats.h"
 
 /* Prototypes for internal functions */
 int16_t decodeInt(char* buffer);
 void encodeInt(char* buffer, int16_t number);
+uint8_t decodeText(char* buffer, char* text);
+char checksum(char* buffer, uint8_t len);
+void rxRingPush(rego_conn* conn, char* data, uint8_t len);
+uint8_t extractFrame(rego_conn* conn, uint8_t expectedLen);
+uint8_t bucketIndex(uint32_t micros);
+uint32_t bucketLowerBound(uint8_t bucket);
+uint32_t histogramPercentile(regoHistogram* hist, uint8_t percent);
+
+/* Build a valid 5-byte register response for value */
+static void buildResponse(char* frame, int16_t value) {
+    frame[0] = DEVICE_ME;
+    encodeInt(frame+1, value);
+    frame[4] = checksum(frame+1, 3);
+}
+
+static void testFrameParser(void) {
+    char frame[5], bad[5];
+    char garbage[] = { 0x7f, 0x00, 0x55 };
+    int16_t value;
+    rego_conn conn;
+
+    initConnection(&conn);
+
+    /* Split read: frame arrives in two chunks */
+    buildResponse(frame, 215);
+    rxRingPush(&conn, frame, 2);
+    assert(extractFrame(&conn, 5) == 0);
+    rxRingPush(&conn, frame+2, 3);
+    assert(extractFrame(&conn, 5) == 1);
+    assert(decodeIntPacket(&conn, &value) == RESPONSE_OK && value == 215);
+
+    /* Garbage and a false header with bad checksum before the real frame */
+    buildResponse(bad, 100);
+    bad[4] ^= 0x11;
+    buildResponse(frame, -42);
+    rxRingPush(&conn, garbage, sizeof(garbage));
+    rxRingPush(&conn, bad, sizeof(bad));
+    assert(extractFrame(&conn, 5) == 0);
+    rxRingPush(&conn, frame, sizeof(frame));
+    assert(extractFrame(&conn, 5) == 1);
+    assert(decodeIntPacket(&conn, &value) == RESPONSE_OK && value == -42);
+    assert(extractFrame(&conn, 5) == 0);
+}
+
+/* Latencies land in the bucket whose bounds contain them */
+static void testHistogram(void) {
+    uint32_t samples[] = {0, 1, 3, 4, 7, 8, 1000, 2047, 2048, 65535, 500000, 1800000};
+    regoHistogram hist = {{0}};
+    size_t i;
+    uint8_t b;
+
+    for (i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+        b = bucketIndex(samples[i]);
+        assert(bucketLowerBound(b) <= samples[i] && samples[i] < bucketLowerBound(b + 1));
+    }
+    assert(bucketIndex(0xffffffff) == REGO_STATS_BUCKETS - 1);
+
+    /* 99 fast samples and one slow */
+    for (i = 0; i < 99; i++) hist.buckets[bucketIndex(2100)]++;
+    hist.buckets[bucketIndex(90000)]++;
+    hist.count = 100;
+    hist.max = 90000;
+    assert(histogramPercentile(&hist, 50) >= 2100 && histogramPercentile(&hist, 50) < 2100 * 5 / 4);
+    assert(histogramPercentile(&hist, 99) < 2100 * 5 / 4);
+    assert(histogramPercentile(&hist, 100) == 90000);
+}
+
+/* Every known register is found through the address and name indexes */
+static void testRegisterLookup(void) {
+    int16_t id;
+    uint16_t reg;
+
+    for (id = 0; id < getKnownRegisterCount(); id++) {
+        assert(getRegisterIdByAddress(getRegisterAddressById(id)) == id);
+        assert(getRegisterIdByName(getRegisterNameById(id)) == id);
+    }
+    assert(getRegisterIdByAddress(0x0002) == -1);
+    assert(getRegisterIdByAddress(0xffff) == -1);
+    assert(getRegisterIdByName("status.compressor2") == -1);
+    assert(lookupRegister("status.compressor", &reg) == 0 && reg == 0x01fe);
+    assert(lookupRegister("0x0123", &reg) == 0 && reg == 0x0123);
+}
+
+/* Display text: LCD characters remapped to UTF-8 */
+static void testDecodeText(void) {
+    const char* lcd = "Jaj \xe5\xe4\xf6\xc5 GT1 5.2\xb0 ok";
+    char buffer[40], text[REGO_DISPLAY_ROW_SIZE];
+    int i;
+
+    for (i = 0; i < 20; i++) {
+        buffer[2*i] = (lcd[i] >> 4) & 0x0f;
+        buffer[2*i+1] = lcd[i] & 0x0f;
+    }
+    assert(decodeText(buffer, text) == strlen("Mam åäöÅ GT1 5.2° ok\n") + 1);
+    assert(strcmp(text, "Mam åäöÅ GT1 5.2° ok\n") == 0);
+}
+
+/* Capture: responses replay in order, decoded for the request before them */
+static int replayed;
+
+static void checkReplayed(uint64_t time, const regoCompletion* response, void* context) {
+    switch (replayed++) {
+    case 0:
+        assert(response->reg == 0x020a && response->status == RESPONSE_OK && response->value == -52);
+        break;
+    case 1:
+        assert(response->reg == 0x020a && response->status == RESPONSE_CHECKSUM_ERROR);
+        break;
+    case 2:
+        assert(response->command == COMMAND_READ_DISPLAY && response->reg == 1 && response->status == RESPONSE_INVALID_LENGTH);
+        break;
+    default:
+        assert(0);
+    }
+}
+
+static void testCapture(void) {
+    char frame[5];
+    regoCapture capture;
+    rego_conn conn;
+
+    initConnection(&conn);
+    assert(openCapture(&capture, "tests/test.cap") == 0);
+    buildPacket(&conn, DEVICE_HEATPUMP, COMMAND_READ_SYS_REG, 0x020a, 0);
+    captureFrame(&capture, REGO_CAPTURE_SENT, conn.buffer, conn.len);
+    buildResponse(frame, -52);
+    captureFrame(&capture, REGO_CAPTURE_RECEIVED, frame, sizeof(frame));
+    captureFrame(&capture, REGO_CAPTURE_SENT, conn.buffer, conn.len);
+    frame[4] ^= 0x11;
+    captureFrame(&capture, REGO_CAPTURE_RECEIVED, frame, sizeof(frame));
+    buildPacket(&conn, DEVICE_HEATPUMP, COMMAND_READ_DISPLAY, 1, 0);
+    captureFrame(&capture, REGO_CAPTURE_SENT, conn.buffer, conn.len);
+    captureFrame(&capture, REGO_CAPTURE_RECEIVED, frame, 3);
+    closeCapture(&capture);
+
+    assert(replayCapture(&conn, "tests/test.cap", 0, checkReplayed, NULL) == 3);
+    assert(replayed == 3);
+
+    /* A cut off capture replays up to the last whole record */
+    assert(truncate("tests/test.cap", sizeof(regoCaptureHeader) + 2 * sizeof(regoCaptureRecord) + 9 + 5 + 2) == 0);
+    replayed = 0;
+    assert(replayCapture(&conn, "tests/test.cap", 0, checkReplayed, NULL) == 1);
+    unlink("tests/test.cap");
+}
 
 int main(void) {
     int16_t values[] = {0, 1, -1, 1234, -1234, 16384, -16384, 32767, -32768};
@@ -18,7 +167,13 @@ int main(void) {
         assert(decoded == values[i]);
     }
 
-    puts("All encode/decode tests passed!");
+    testFrameParser();
+    testHistogram();
+    testRegisterLookup();
+    testDecodeText();
+    testCapture();
+
+    puts("All encode/decode, framing, histogram, lookup, display and capture tests passed!");
     return 0;
 }
 